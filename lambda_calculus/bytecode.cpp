@@ -0,0 +1,394 @@
+#include "bytecode.h"
+#include "utils/visit.h"
+#include <array>
+#include <unordered_map>
+
+// Threaded dispatch relies on the labels-as-values extension.
+#if defined(__GNUC__)
+#define LAMBDA_THREADED_DISPATCH 1
+#else
+#define LAMBDA_THREADED_DISPATCH 0
+#endif
+
+namespace lambda {
+
+namespace {
+
+//--------------------------------------------------------------------------------------------------
+// Identifies a subterm along with the de Bruijn indices of its free variables. Subterms with the
+// same key compile to the same code.
+struct CodeKey {
+    TermId term;
+    std::array<uint32_t, FreeVariables::capacity> indices;
+
+    bool operator==(CodeKey const&) const = default;
+};
+
+//--------------------------------------------------------------------------------------------------
+struct CodeKeyHash {
+    std::size_t operator()(CodeKey const& key) const {
+        std::size_t hash = std::hash<TermId>{}(key.term);
+        for (uint32_t index : key.indices) {
+            hash = hash * 31 + index;
+        }
+        return hash;
+    }
+};
+
+//--------------------------------------------------------------------------------------------------
+class Compiler {
+public:
+    Compiler(TermArena const& arena): arena_(arena) {}
+
+    BytecodeProgram compile(TermId root_id) {
+        program_.entry = 0;
+        compile_block(root_id, no_scope);
+
+        // Arguments are compiled after the code that pushes them.
+        while (!pending_.empty()) {
+            PendingArgument const pending = pending_.back();
+            pending_.pop_back();
+            if (std::optional<uint32_t> const address = find_code(pending.term, pending.scope)) {
+                program_.code[pending.push_address].operand = *address;
+                continue;
+            }
+            program_.code[pending.push_address].operand = code_size();
+            compile_block(pending.term, pending.scope);
+        }
+        return std::move(program_);
+    }
+
+private:
+    static constexpr uint32_t no_scope = 0xFFFFFFFF;
+    // Stands in for the index of a variable that isn't bound by any enclosing abstraction.
+    static constexpr uint32_t unbound = 0xFFFFFFFF;
+
+    // Scopes form linked lists of the abstractions enclosing a term, innermost first.
+    struct Scope {
+        TermId abstraction;
+        uint32_t parent;
+    };
+
+    struct PendingArgument {
+        TermId term;
+        uint32_t scope;
+        uint32_t push_address;
+    };
+
+    uint32_t code_size() const { return static_cast<uint32_t>(program_.code.size()); }
+
+    // Compiles a term into a contiguous run of instructions at the end of the code.
+    void compile_block(TermId term_id, uint32_t scope) {
+        while (true) {
+            // If this term has already been compiled in an equivalent context, jump there.
+            std::optional<CodeKey> const key = code_key(term_id, scope);
+            if (key.has_value()) {
+                auto const itr = compiled_.find(*key);
+                if (itr != compiled_.end()) {
+                    program_.code.push_back(Instruction{Opcode::jump, itr->second});
+                    return;
+                }
+                compiled_.emplace(*key, code_size());
+            }
+
+            auto const [child_0, child_1] = arena_.children(term_id);
+            switch (arena_.kind(term_id)) {
+                case TermKind::variable: {
+                    std::optional<uint32_t> const index = de_bruijn_index(term_id, scope);
+                    if (index.has_value()) {
+                        program_.code.push_back(Instruction{Opcode::access, *index});
+                    } else {
+                        program_.code.push_back(
+                            Instruction{Opcode::free_variable, variable_index(term_id)}
+                        );
+                    }
+                    return;
+                }
+                case TermKind::abstraction:
+                    program_.code.push_back(Instruction{Opcode::grab, variable_index(child_0)});
+                    scopes_.push_back(Scope{term_id, scope});
+                    scope = static_cast<uint32_t>(scopes_.size() - 1);
+                    term_id = child_1;
+                    break;
+                case TermKind::application:
+                    pending_.push_back(PendingArgument{child_1, scope, code_size()});
+                    program_.code.push_back(Instruction{Opcode::push, 0});
+                    term_id = child_0;
+                    break;
+                case TermKind::substitution: {
+                    // [x := N] M runs like (λx.M) N. The scope is that of the binding's
+                    // abstraction, since that's what x is bound by.
+                    auto const [function_id, argument_id] = arena_.children(child_1);
+                    pending_.push_back(PendingArgument{argument_id, scope, code_size()});
+                    program_.code.push_back(Instruction{Opcode::push, 0});
+                    TermId const variable_id = arena_.children(function_id)[0];
+                    program_.code.push_back(Instruction{Opcode::grab, variable_index(variable_id)});
+                    scopes_.push_back(Scope{function_id, scope});
+                    scope = static_cast<uint32_t>(scopes_.size() - 1);
+                    term_id = child_0;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Returns the address of the code for term_id in this scope, if it has been compiled.
+    std::optional<uint32_t> find_code(TermId term_id, uint32_t scope) const {
+        std::optional<CodeKey> const key = code_key(term_id, scope);
+        if (!key.has_value()) {
+            return std::nullopt;
+        }
+        auto const itr = compiled_.find(*key);
+        if (itr == compiled_.end()) {
+            return std::nullopt;
+        }
+        return itr->second;
+    }
+
+    // Terms whose free variables aren't known exactly don't get keys, so they aren't shared.
+    std::optional<CodeKey> code_key(TermId term_id, uint32_t scope) const {
+        FreeVariables const free_variables = arena_.free_variables(term_id);
+        if (!free_variables.is_exact()) {
+            return std::nullopt;
+        }
+        CodeKey key{term_id, {}};
+        uint32_t i = 0;
+        for (TermId variable_id : free_variables.variables()) {
+            key.indices[i] = de_bruijn_index(variable_id, scope).value_or(unbound);
+            ++i;
+        }
+        return key;
+    }
+
+    std::optional<uint32_t> de_bruijn_index(TermId variable_id, uint32_t scope) const {
+        std::optional<TermId> const binder = arena_.binder(variable_id);
+        if (!binder.has_value()) {
+            return std::nullopt;
+        }
+        uint32_t index = 0;
+        while (scope != no_scope) {
+            if (scopes_[scope].abstraction == *binder) {
+                return index;
+            }
+            scope = scopes_[scope].parent;
+            ++index;
+        }
+        return std::nullopt;
+    }
+
+    uint32_t variable_index(TermId variable_id) {
+        auto const [itr, inserted] = variable_indices_.try_emplace(
+            variable_id,
+            static_cast<uint32_t>(program_.variables.size())
+        );
+        if (inserted) {
+            program_.variables.push_back(variable_id);
+        }
+        return itr->second;
+    }
+
+    TermArena const& arena_;
+    BytecodeProgram program_;
+    std::vector<Scope> scopes_;
+    std::vector<PendingArgument> pending_;
+    std::unordered_map<CodeKey, uint32_t, CodeKeyHash> compiled_;
+    std::unordered_map<TermId, uint32_t> variable_indices_;
+};
+
+}
+
+//..................................................................................................
+BytecodeProgram compile_term(TermArena const& arena, TermId root_id) {
+    return Compiler(arena).compile(root_id);
+}
+
+//..................................................................................................
+TermId BytecodeMachine::normalize(BytecodeProgram const& program) {
+    // Thunks and frames don't outlive a call. Variables introduced while reading back are added
+    // to our own copy of the variable table.
+    variables_ = program.variables;
+    thunks_.clear();
+    frames_.clear();
+    tasks_.clear();
+    results_.clear();
+
+    Instruction const* const code = program.code.data();
+    tasks_.push_back(ReadBack{make_thunk(program.entry, empty_environment)});
+    while (!tasks_.empty()) {
+        Task const task = tasks_.back();
+        tasks_.pop_back();
+        lambda::visit(
+            task,
+            [&](ReadBack read_back) {
+                // Shared thunks are only read back once.
+                std::optional<TermId> const normal_form = thunks_[read_back.thunk].normal_form;
+                if (normal_form.has_value()) {
+                    results_.push_back(*normal_form);
+                    return;
+                }
+                tasks_.push_back(Memoize{read_back.thunk});
+
+                evaluate(code, read_back.thunk);
+                if (!head_.has_value()) {
+                    // Evaluate the body with the variable bound to a new free variable.
+                    TermId const variable_id = variables_[code[pc_].operand];
+                    TermId const new_variable_id = arena_.make_variable(arena_.symbol(variable_id));
+                    variables_.push_back(new_variable_id);
+                    auto const variable_index = static_cast<uint32_t>(variables_.size() - 1);
+                    frames_.push_back(Frame{make_thunk(no_code, variable_index), environment_});
+                    auto const environment = static_cast<uint32_t>(frames_.size() - 1);
+                    tasks_.push_back(BuildAbstraction{new_variable_id});
+                    tasks_.push_back(ReadBack{make_thunk(pc_ + 1, environment)});
+                    return;
+                }
+
+                // Otherwise we have a free variable applied to some arguments. The first argument
+                // is at the back, so it's pushed last and read back first.
+                tasks_.push_back(BuildApplications{
+                    *head_,
+                    static_cast<uint32_t>(arguments_.size())
+                });
+                for (uint32_t argument : arguments_) {
+                    tasks_.push_back(ReadBack{argument});
+                }
+            },
+            [&](BuildAbstraction build) {
+                TermId const body_id = results_.back();
+                results_.back() = arena_.make_abstraction(build.variable, body_id);
+            },
+            [&](BuildApplications build) {
+                auto const first = results_.end() - build.n_arguments;
+                TermId term_id = build.head;
+                for (auto itr = first; itr != results_.end(); ++itr) {
+                    term_id = arena_.make_application(term_id, *itr);
+                }
+                results_.erase(first, results_.end());
+                results_.push_back(term_id);
+            },
+            [&](Memoize memoize) {
+                thunks_[memoize.thunk].normal_form = results_.back();
+            }
+        );
+    }
+
+    return results_.back();
+}
+
+//..................................................................................................
+uint32_t BytecodeMachine::make_thunk(uint32_t code, uint32_t environment) {
+    thunks_.push_back(Thunk{code, environment, false, std::nullopt});
+    return static_cast<uint32_t>(thunks_.size() - 1);
+}
+
+//..................................................................................................
+#if LAMBDA_THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+void BytecodeMachine::evaluate(Instruction const* code, uint32_t thunk) {
+    arguments_.clear();
+    update_markers_.clear();
+    head_.reset();
+
+    // Returns false if the thunk stands for a free variable.
+    auto const enter = [this](uint32_t thunk) {
+        Thunk const& entered = thunks_[thunk];
+        if (entered.code == no_code) {
+            head_ = variables_[entered.environment];
+            return false;
+        }
+        if (!entered.is_evaluated) {
+            update_markers_.push_back(
+                UpdateMarker{thunk, static_cast<uint32_t>(arguments_.size())}
+            );
+        }
+        pc_ = entered.code;
+        environment_ = entered.environment;
+        return true;
+    };
+    if (!enter(thunk)) {
+        return;
+    }
+
+    // Each handler ends by dispatching the next instruction. With threaded dispatch that's an
+    // indirect jump from the end of each handler, so the branch predictor sees each transition
+    // separately. Otherwise it's a switch in a loop.
+#if LAMBDA_THREADED_DISPATCH
+    static void* const handlers[] = {&&grab, &&push, &&access, &&free_variable, &&jump};
+    #define LAMBDA_DISPATCH() goto *handlers[static_cast<uint32_t>(code[pc_].opcode)]
+    #define LAMBDA_HANDLER(opcode) opcode:
+    LAMBDA_DISPATCH();
+#else
+    #define LAMBDA_DISPATCH() continue
+    #define LAMBDA_HANDLER(opcode) case Opcode::opcode:
+    while (true) switch (code[pc_].opcode) {
+#endif
+
+    LAMBDA_HANDLER(grab) {
+        ++n_instructions_;
+        // If a thunk was evaluated with exactly the arguments we have left, this is its weak head
+        // normal form.
+        while (
+            !update_markers_.empty() &&
+            update_markers_.back().n_arguments == arguments_.size()
+        ) {
+            Thunk& updated = thunks_[update_markers_.back().thunk];
+            updated.code = pc_;
+            updated.environment = environment_;
+            updated.is_evaluated = true;
+            update_markers_.pop_back();
+        }
+        if (arguments_.empty()) {
+            return;
+        }
+
+        ++n_reductions_;
+        frames_.push_back(Frame{arguments_.back(), environment_});
+        arguments_.pop_back();
+        environment_ = static_cast<uint32_t>(frames_.size() - 1);
+        ++pc_;
+        LAMBDA_DISPATCH();
+    }
+
+    LAMBDA_HANDLER(push) {
+        ++n_instructions_;
+        arguments_.push_back(make_thunk(code[pc_].operand, environment_));
+        ++pc_;
+        LAMBDA_DISPATCH();
+    }
+
+    LAMBDA_HANDLER(access) {
+        ++n_instructions_;
+        uint32_t environment = environment_;
+        for (uint32_t i = 0; i < code[pc_].operand; ++i) {
+            environment = frames_[environment].parent;
+        }
+        if (!enter(frames_[environment].thunk)) {
+            return;
+        }
+        LAMBDA_DISPATCH();
+    }
+
+    LAMBDA_HANDLER(free_variable) {
+        ++n_instructions_;
+        head_ = variables_[code[pc_].operand];
+        return;
+    }
+
+    LAMBDA_HANDLER(jump) {
+        ++n_instructions_;
+        pc_ = code[pc_].operand;
+        LAMBDA_DISPATCH();
+    }
+
+#if !LAMBDA_THREADED_DISPATCH
+    }
+#endif
+    #undef LAMBDA_DISPATCH
+    #undef LAMBDA_HANDLER
+}
+#if LAMBDA_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
+}
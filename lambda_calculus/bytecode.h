@@ -0,0 +1,128 @@
+#ifndef LAMBDA_BYTECODE_H
+#define LAMBDA_BYTECODE_H
+
+#include "term_arena.h"
+#include "utils/stdint.h"
+#include <optional>
+#include <variant>
+#include <vector>
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// Instructions for a lazy Krivine machine. Each term compiles to a straight run of instructions
+// that ends by transferring control (with access, free_variable, or jump), so there's no return
+// instruction.
+//  - grab: Pops an argument and binds it to a new innermost variable. If there are no arguments
+//    left, the machine has reached weak head normal form. The operand indexes the variable table
+//    (this is only used to name the variable when reading back).
+//  - push: Pushes a thunk for the code at the operand address, in the current environment.
+//  - access: Enters the thunk bound to the variable with the given de Bruijn index.
+//  - free_variable: The head of the term is the free variable at the given index in the variable
+//    table, so the machine is stuck.
+//  - jump: Continues at the operand address. This is how code is shared between terms.
+enum class Opcode : uint32_t {
+    grab,
+    push,
+    access,
+    free_variable,
+    jump
+};
+
+//--------------------------------------------------------------------------------------------------
+struct Instruction {
+    Opcode opcode;
+    uint32_t operand;
+};
+
+//--------------------------------------------------------------------------------------------------
+struct BytecodeProgram {
+    std::vector<Instruction> code;
+    // Bound variables (for their names) and free variables that the code refers to.
+    std::vector<TermId> variables;
+    uint32_t entry;
+};
+
+//--------------------------------------------------------------------------------------------------
+// Compiles the term beneath root_id. Each shared subterm whose free variables are known exactly is
+// only compiled once per binding context (which always includes closed subterms); other subterms
+// are compiled once for each path that leads to them.
+BytecodeProgram compile_term(TermArena const& arena, TermId root_id);
+
+//--------------------------------------------------------------------------------------------------
+// Runs bytecode programs. Like KrivineMachine, arguments are delayed as thunks that are updated
+// when they reach weak head normal form, and normalize reads the result back into the arena. On
+// compilers that support it (GCC and Clang), instructions are dispatched by jumping straight from
+// one handler to the next.
+class BytecodeMachine {
+public:
+    explicit BytecodeMachine(TermArena& arena): arena_(arena) {}
+
+    // Builds the normal form of the program's term in the arena, and returns its id. This doesn't
+    // terminate if the term doesn't have a normal form.
+    TermId normalize(BytecodeProgram const& program);
+
+    // These count executed instructions and beta reductions, over all calls.
+    uint64_t n_instructions() const { return n_instructions_; }
+    uint64_t n_reductions() const { return n_reductions_; }
+
+private:
+    static constexpr uint32_t empty_environment = 0xFFFFFFFF;
+    // Thunks for variables introduced while reading back have no code. Their environment field
+    // holds the variable's index in the variable table instead.
+    static constexpr uint32_t no_code = 0xFFFFFFFF;
+
+    struct Thunk {
+        uint32_t code;
+        uint32_t environment;
+        // True once the thunk points at the grab instruction of its weak head normal form.
+        bool is_evaluated;
+        std::optional<TermId> normal_form;
+    };
+
+    // Environments are linked lists of frames. The innermost variable (de Bruijn index zero) is
+    // bound by the first frame.
+    struct Frame {
+        uint32_t thunk;
+        uint32_t parent;
+    };
+
+    struct UpdateMarker {
+        uint32_t thunk;
+        uint32_t n_arguments;
+    };
+
+    struct ReadBack { uint32_t thunk; };
+    struct BuildAbstraction { TermId variable; };
+    struct BuildApplications { TermId head; uint32_t n_arguments; };
+    struct Memoize { uint32_t thunk; };
+    using Task = std::variant<ReadBack, BuildAbstraction, BuildApplications, Memoize>;
+
+    uint32_t make_thunk(uint32_t code, uint32_t environment);
+
+    // Evaluates a thunk to weak head normal form. Afterward, either pc_ is the address of a grab
+    // instruction and environment_ is its environment, or head_ is a free variable applied to the
+    // thunks in arguments_ (the first argument is at the back).
+    void evaluate(Instruction const* code, uint32_t thunk);
+
+    TermArena& arena_;
+    std::vector<TermId> variables_;
+    std::vector<Thunk> thunks_;
+    std::vector<Frame> frames_;
+
+    uint32_t pc_;
+    uint32_t environment_;
+    std::optional<TermId> head_;
+    std::vector<uint32_t> arguments_;
+    std::vector<UpdateMarker> update_markers_;
+
+    std::vector<Task> tasks_;
+    std::vector<TermId> results_;
+
+    uint64_t n_instructions_ = 0;
+    uint64_t n_reductions_ = 0;
+};
+
+}
+
+#endif
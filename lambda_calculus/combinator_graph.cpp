@@ -0,0 +1,326 @@
+#include "combinator_graph.h"
+#include "utils/visit.h"
+#include <string>
+
+namespace lambda {
+
+namespace {
+
+//--------------------------------------------------------------------------------------------------
+uint32_t arity(Combinator combinator) {
+    switch (combinator) {
+        case Combinator::i:
+            return 1;
+        case Combinator::k:
+            return 2;
+        case Combinator::s:
+        case Combinator::b:
+        case Combinator::c:
+            return 3;
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Read back variables are named after their depth.
+std::string depth_name(uint32_t depth) {
+    std::string name(1, 'x');
+    name += std::to_string(depth);
+    return name;
+}
+
+}
+
+//..................................................................................................
+CombinatorGraph::CombinatorGraph(TermArena& arena): arena_(arena) {
+    for (auto const combinator : {
+        Combinator::s,
+        Combinator::k,
+        Combinator::i,
+        Combinator::b,
+        Combinator::c
+    }) {
+        combinators_[static_cast<uint32_t>(combinator)] = static_cast<uint32_t>(nodes_.size());
+        nodes_.push_back(Node{NodeKind::combinator, combinator, 0, 0});
+    }
+}
+
+//..................................................................................................
+uint32_t CombinatorGraph::compile(TermId root_id, BracketAbstraction method) {
+    // Subterms are compiled after their children. Since a compiled subterm doesn't depend on where
+    // it appears (its variables are only abstracted by the enclosing abstractions), shared
+    // subterms are compiled once.
+    std::unordered_map<TermId, uint32_t> compiled;
+    std::vector<std::pair<TermId, bool>> stack;
+    stack.emplace_back(root_id, false);
+    while (!stack.empty()) {
+        auto const [term_id, is_expanded] = stack.back();
+        if (compiled.contains(term_id)) {
+            stack.pop_back();
+            continue;
+        }
+        auto const [child_0, child_1] = arena_.children(term_id);
+        switch (arena_.kind(term_id)) {
+            case TermKind::variable:
+                compiled.emplace(term_id, make_variable(term_id));
+                stack.pop_back();
+                break;
+            case TermKind::abstraction:
+                if (!is_expanded) {
+                    stack.back().second = true;
+                    stack.emplace_back(child_1, false);
+                    break;
+                }
+                compiled.emplace(
+                    term_id,
+                    abstract(make_variable(child_0), compiled.at(child_1), method)
+                );
+                stack.pop_back();
+                break;
+            case TermKind::application:
+                if (!is_expanded) {
+                    stack.back().second = true;
+                    stack.emplace_back(child_1, false);
+                    stack.emplace_back(child_0, false);
+                    break;
+                }
+                compiled.emplace(
+                    term_id,
+                    make_application(compiled.at(child_0), compiled.at(child_1))
+                );
+                stack.pop_back();
+                break;
+            case TermKind::substitution: {
+                // [x := N] M compiles like (λx.M) N.
+                auto const [variable_id, argument_id] = arena_.binding(term_id);
+                if (!is_expanded) {
+                    stack.back().second = true;
+                    stack.emplace_back(argument_id, false);
+                    stack.emplace_back(child_0, false);
+                    break;
+                }
+                uint32_t const function =
+                    abstract(make_variable(variable_id), compiled.at(child_0), method);
+                compiled.emplace(term_id, make_application(function, compiled.at(argument_id)));
+                stack.pop_back();
+                break;
+            }
+        }
+    }
+    return compiled.at(root_id);
+}
+
+//..................................................................................................
+TermId CombinatorGraph::normalize(uint32_t node) {
+    // Normal forms don't outlive a call, since the arena may change in between.
+    normal_forms_.clear();
+    tasks_.clear();
+    results_.clear();
+
+    tasks_.push_back(ReadBack{node, 0});
+    while (!tasks_.empty()) {
+        Task const task = tasks_.back();
+        tasks_.pop_back();
+        lambda::visit(
+            task,
+            [&](ReadBack read_back) {
+                auto const normal_form = normal_forms_.find(read_back.node);
+                if (normal_form != normal_forms_.end()) {
+                    results_.push_back(normal_form->second);
+                    return;
+                }
+                tasks_.push_back(Memoize{read_back.node});
+
+                uint32_t const head = reduce_to_head(read_back.node);
+                if (nodes_[head].kind == NodeKind::combinator) {
+                    // A combinator that's missing arguments is a function. Apply it to a new
+                    // variable to get its body.
+                    TermId const variable_id = arena_.make_variable(depth_name(read_back.depth));
+                    uint32_t const body =
+                        make_application(read_back.node, make_variable(variable_id));
+                    tasks_.push_back(BuildAbstraction{variable_id});
+                    tasks_.push_back(ReadBack{body, read_back.depth + 1});
+                    return;
+                }
+
+                // Otherwise we have a free variable applied to some arguments. The first argument
+                // is innermost, so it's pushed last and read back first.
+                tasks_.push_back(BuildApplications{
+                    variables_[nodes_[head].left],
+                    static_cast<uint32_t>(spine_.size())
+                });
+                for (uint32_t application : spine_) {
+                    tasks_.push_back(ReadBack{nodes_[application].right, read_back.depth});
+                }
+            },
+            [&](BuildAbstraction build) {
+                TermId const body_id = results_.back();
+                results_.back() = arena_.make_abstraction(build.variable, body_id);
+            },
+            [&](BuildApplications build) {
+                auto const first = results_.end() - build.n_arguments;
+                TermId term_id = build.head;
+                for (auto itr = first; itr != results_.end(); ++itr) {
+                    term_id = arena_.make_application(term_id, *itr);
+                }
+                results_.erase(first, results_.end());
+                results_.push_back(term_id);
+            },
+            [&](Memoize memoize) {
+                normal_forms_.emplace(memoize.node, results_.back());
+            }
+        );
+    }
+
+    return results_.back();
+}
+
+//..................................................................................................
+uint32_t CombinatorGraph::make_application(uint32_t left, uint32_t right) {
+    nodes_.push_back(Node{NodeKind::application, Combinator::i, left, right});
+    return static_cast<uint32_t>(nodes_.size() - 1);
+}
+
+//..................................................................................................
+uint32_t CombinatorGraph::make_variable(TermId variable_id) {
+    auto const [itr, is_new] = variable_nodes_.try_emplace(variable_id, 0);
+    if (is_new) {
+        itr->second = static_cast<uint32_t>(nodes_.size());
+        nodes_.push_back(Node{
+            NodeKind::variable,
+            Combinator::i,
+            static_cast<uint32_t>(variables_.size()),
+            0
+        });
+        variables_.push_back(variable_id);
+    }
+    return itr->second;
+}
+
+//..................................................................................................
+uint32_t CombinatorGraph::abstract(uint32_t variable, uint32_t body, BracketAbstraction method) {
+    // Each node beneath body maps to its abstraction, or to nothing if it doesn't contain the
+    // variable (in which case its abstraction is K applied to it).
+    constexpr uint32_t constant = 0xFFFFFFFF;
+    std::unordered_map<uint32_t, uint32_t> abstracted;
+    auto const lift = [&](uint32_t node, uint32_t result) {
+        return (result == constant) ? make_application(combinator(Combinator::k), node) : result;
+    };
+
+    std::vector<std::pair<uint32_t, bool>> stack;
+    stack.emplace_back(body, false);
+    while (!stack.empty()) {
+        auto const [node, is_expanded] = stack.back();
+        if (abstracted.contains(node)) {
+            stack.pop_back();
+            continue;
+        }
+        if (nodes_[node].kind != NodeKind::application) {
+            abstracted.emplace(node, (node == variable) ? combinator(Combinator::i) : constant);
+            stack.pop_back();
+            continue;
+        }
+        uint32_t const left = nodes_[node].left;
+        uint32_t const right = nodes_[node].right;
+        if (!is_expanded) {
+            stack.back().second = true;
+            stack.emplace_back(right, false);
+            stack.emplace_back(left, false);
+            continue;
+        }
+        stack.pop_back();
+
+        uint32_t const left_result = abstracted.at(left);
+        uint32_t const right_result = abstracted.at(right);
+        uint32_t result;
+        if (left_result == constant && right_result == constant) {
+            result = constant;
+        } else if (method == BracketAbstraction::basic) {
+            result = make_application(
+                make_application(combinator(Combinator::s), lift(left, left_result)),
+                lift(right, right_result)
+            );
+        } else if (left_result == constant) {
+            result = make_application(
+                make_application(combinator(Combinator::b), left),
+                right_result
+            );
+        } else if (right_result == constant) {
+            result = make_application(
+                make_application(combinator(Combinator::c), left_result),
+                right
+            );
+        } else {
+            result = make_application(
+                make_application(combinator(Combinator::s), left_result),
+                right_result
+            );
+        }
+        abstracted.emplace(node, result);
+    }
+    return lift(body, abstracted.at(body));
+}
+
+//..................................................................................................
+uint32_t CombinatorGraph::reduce_to_head(uint32_t node) {
+    spine_.clear();
+    uint32_t head = follow(node);
+    while (true) {
+        Node const current = nodes_[head];
+        if (current.kind == NodeKind::application) {
+            spine_.push_back(head);
+            // Skip over indirections, so we don't have to follow them again.
+            uint32_t const left = follow(current.left);
+            nodes_[head].left = left;
+            head = left;
+            continue;
+        }
+        if (current.kind == NodeKind::variable) {
+            return head;
+        }
+
+        uint32_t const n_arguments = arity(current.combinator);
+        if (spine_.size() < n_arguments) {
+            return head;
+        }
+
+        // The arguments are the right children of the innermost applications.
+        auto const argument = [&](uint32_t idx) {
+            return nodes_[spine_[spine_.size() - 1 - idx]].right;
+        };
+        uint32_t const root = spine_[spine_.size() - n_arguments];
+        ++n_reductions_;
+        switch (current.combinator) {
+            case Combinator::i:
+                nodes_[root] = Node{NodeKind::indirection, Combinator::i, argument(0), 0};
+                break;
+            case Combinator::k:
+                nodes_[root] = Node{NodeKind::indirection, Combinator::i, argument(0), 0};
+                break;
+            case Combinator::s: {
+                uint32_t const left = make_application(argument(0), argument(2));
+                uint32_t const right = make_application(argument(1), argument(2));
+                nodes_[root] = Node{NodeKind::application, Combinator::i, left, right};
+                break;
+            }
+            case Combinator::b: {
+                uint32_t const right = make_application(argument(1), argument(2));
+                nodes_[root] = Node{NodeKind::application, Combinator::i, argument(0), right};
+                break;
+            }
+            case Combinator::c: {
+                uint32_t const left = make_application(argument(0), argument(2));
+                nodes_[root] = Node{NodeKind::application, Combinator::i, left, argument(1)};
+                break;
+            }
+        }
+
+        // Carry on from the root of the redex, which isn't on the spine anymore.
+        spine_.resize(spine_.size() - n_arguments);
+        head = follow(root);
+        // The application above the root still points at it, so it passes through the
+        // indirection (if there is one) next time.
+    }
+}
+
+}
@@ -0,0 +1,130 @@
+#ifndef LAMBDA_COMBINATOR_GRAPH_H
+#define LAMBDA_COMBINATOR_GRAPH_H
+
+#include "term_arena.h"
+#include "utils/stdint.h"
+#include <array>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+//  - s: S f g x = f x (g x)
+//  - k: K x y = x
+//  - i: I x = x
+//  - b: B f g x = f (g x)
+//  - c: C f g x = f x g
+enum class Combinator : uint8_t {
+    s,
+    k,
+    i,
+    b,
+    c
+};
+
+//--------------------------------------------------------------------------------------------------
+enum class BracketAbstraction : uint8_t {
+    // Only S, K, and I.
+    basic,
+    // Turner's optimizations: S (K f) (K g) becomes K (f g), S (K f) g becomes B f g, and S f (K g)
+    // becomes C f g. The eta rules (S (K f) I becomes f, and abstracting x from f x gives f) are
+    // left out, so that normal forms are read back exactly as reduce_normal_order would find them.
+    turner
+};
+
+//--------------------------------------------------------------------------------------------------
+// Compiles terms to combinator graphs by bracket abstraction, and normalizes them by graph
+// reduction. There are no variables in the graph (other than free ones) and nothing is ever
+// substituted: each reduction overwrites the application at the root of the redex with its result,
+// so every other reference to it sees the reduced version. Arguments are shared rather than
+// copied, and reduction always starts from the head of the term, so each argument is reduced at
+// most once, and only if it's needed. This is what lets recursion through the Y combinator
+// terminate.
+// To read back the normal form, normalize reduces the graph to weak head normal form. If the head
+// is a free variable, its arguments are normalized in turn. If it's a combinator that's missing
+// arguments, the graph is a function, so it's applied to a new variable and the result is read back
+// as the body of an abstraction. Each node is only read back once.
+// Nodes are never freed, so the graph only grows. Free variables are recorded by id, so the graph
+// can't be used across a collection of the arena.
+class CombinatorGraph {
+public:
+    explicit CombinatorGraph(TermArena& arena);
+
+    // Compiles the term beneath root_id, and returns its node. Variables that aren't bound within
+    // the term stay free.
+    uint32_t compile(TermId root_id, BracketAbstraction method = BracketAbstraction::turner);
+
+    // Reduces the graph beneath node to normal form, and builds the normal form in the arena. The
+    // variables of the abstractions in the result are named after their depth. This doesn't
+    // terminate if the term doesn't have a normal form.
+    TermId normalize(uint32_t node);
+
+    // The number of combinator reductions performed, over all calls.
+    uint64_t n_reductions() const { return n_reductions_; }
+    uint32_t n_nodes() const { return static_cast<uint32_t>(nodes_.size()); }
+
+private:
+    enum class NodeKind : uint8_t {
+        application,
+        combinator,
+        // A free variable. Its index in variables_ is held in left.
+        variable,
+        // A reduced application whose result is another node, held in left.
+        indirection
+    };
+
+    struct Node {
+        NodeKind kind;
+        Combinator combinator;
+        uint32_t left;
+        uint32_t right;
+    };
+
+    struct ReadBack { uint32_t node; uint32_t depth; };
+    struct BuildAbstraction { TermId variable; };
+    struct BuildApplications { TermId head; uint32_t n_arguments; };
+    struct Memoize { uint32_t node; };
+    using Task = std::variant<ReadBack, BuildAbstraction, BuildApplications, Memoize>;
+
+    uint32_t make_application(uint32_t left, uint32_t right);
+    uint32_t make_variable(TermId variable_id);
+    uint32_t combinator(Combinator combinator) const {
+        return combinators_[static_cast<uint32_t>(combinator)];
+    }
+
+    // Returns a graph that, applied to the variable, reduces to body. The graph beneath body isn't
+    // changed.
+    uint32_t abstract(uint32_t variable, uint32_t body, BracketAbstraction method);
+
+    uint32_t follow(uint32_t node) const {
+        while (nodes_[node].kind == NodeKind::indirection) {
+            node = nodes_[node].left;
+        }
+        return node;
+    }
+
+    // Reduces node to weak head normal form. Afterward, the head is returned, and spine_ holds the
+    // applications along the left spine (the outermost first), whose right children are the
+    // arguments.
+    uint32_t reduce_to_head(uint32_t node);
+
+    TermArena& arena_;
+    std::vector<Node> nodes_;
+    std::array<uint32_t, 5> combinators_;
+    std::vector<TermId> variables_;
+    // Maps variables in the arena to their nodes.
+    std::unordered_map<TermId, uint32_t> variable_nodes_;
+
+    std::vector<uint32_t> spine_;
+    std::vector<Task> tasks_;
+    std::vector<TermId> results_;
+    std::unordered_map<uint32_t, TermId> normal_forms_;
+
+    uint64_t n_reductions_ = 0;
+};
+
+}
+
+#endif
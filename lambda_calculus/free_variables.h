@@ -0,0 +1,122 @@
+#ifndef LAMBDA_FREE_VARIABLES_H
+#define LAMBDA_FREE_VARIABLES_H
+
+#include <algorithm>
+#include <array>
+#include <span>
+#include "term_id.h"
+#include "utils/stdint.h"
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// A summary of the variables that occur free in a term. Up to capacity variables are tracked
+// exactly (as a sorted list of ids). Terms with more free variables than that are summarized as
+// unknown, and are assumed to contain every variable. Summaries may overestimate the free variables
+// of a term (reduction only ever removes free variables), but they never leave one out.
+class FreeVariables {
+public:
+    static constexpr uint32_t capacity = 3;
+
+    static FreeVariables closed() { return FreeVariables{}; }
+    static FreeVariables unknown() {
+        FreeVariables result;
+        result.size_ = unknown_size;
+        return result;
+    }
+    static FreeVariables single(TermId variable_id) {
+        FreeVariables result;
+        result.variables_[0] = variable_id;
+        result.size_ = 1;
+        return result;
+    }
+
+    bool is_exact() const { return size_ != unknown_size; }
+    bool is_closed() const { return size_ == 0; }
+
+    // Only meaningful for exact summaries.
+    std::span<TermId const> variables() const {
+        return std::span<TermId const>(variables_.data(), is_exact() ? size_ : 0);
+    }
+
+    bool may_contain(TermId variable_id) const {
+        if (!is_exact()) {
+            return true;
+        }
+        auto const vars = variables();
+        return std::find(vars.begin(), vars.end(), variable_id) != vars.end();
+    }
+
+    // Returns true if every variable that may be free in this term may be free in that one too.
+    bool is_subset_of(FreeVariables that) const {
+        if (!that.is_exact()) {
+            return true;
+        }
+        if (!is_exact()) {
+            return false;
+        }
+        auto const vars = variables();
+        auto const that_vars = that.variables();
+        return std::includes(that_vars.begin(), that_vars.end(), vars.begin(), vars.end());
+    }
+
+    FreeVariables merged_with(FreeVariables that) const {
+        if (!is_exact() || !that.is_exact()) {
+            return unknown();
+        }
+        std::array<TermId, 2 * capacity> merged;
+        auto const vars = variables();
+        auto const that_vars = that.variables();
+        auto const merged_end = std::set_union(
+            vars.begin(), vars.end(), that_vars.begin(), that_vars.end(), merged.begin()
+        );
+        auto const merged_size = static_cast<uint32_t>(merged_end - merged.begin());
+        if (merged_size > capacity) {
+            return unknown();
+        }
+        FreeVariables result;
+        std::copy(merged.begin(), merged_end, result.variables_.begin());
+        result.size_ = merged_size;
+        return result;
+    }
+
+    // Unknown summaries stay unknown, since we can't tell if anything else is left.
+    FreeVariables without(TermId variable_id) const {
+        if (!is_exact()) {
+            return *this;
+        }
+        FreeVariables result;
+        for (TermId id : variables()) {
+            if (id != variable_id) {
+                result.variables_[result.size_++] = id;
+            }
+        }
+        return result;
+    }
+
+    // Replaces each variable id with remap(id), dropping those for which remap returns nothing.
+    // The remapping has to preserve the order of ids.
+    template <typename Remap>
+    FreeVariables remapped(Remap&& remap) const {
+        if (!is_exact()) {
+            return *this;
+        }
+        FreeVariables result;
+        for (TermId id : variables()) {
+            if (auto const new_id = remap(id)) {
+                result.variables_[result.size_++] = *new_id;
+            }
+        }
+        return result;
+    }
+
+private:
+    static constexpr uint8_t unknown_size = 0xFF;
+
+    std::array<TermId, capacity> variables_{};
+    uint8_t size_ = 0;
+};
+
+}
+
+#endif
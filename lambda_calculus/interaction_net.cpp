@@ -0,0 +1,826 @@
+#include "interaction_net.h"
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <variant>
+#include "term_set.h"
+#include "utils/visit.h"
+
+namespace lambda {
+
+namespace {
+
+// Threads hand pairs over to the common queue once they have more than this many, and take this
+// many at a time when they run out.
+constexpr std::size_t share_threshold = 256;
+constexpr std::size_t batch_size = 64;
+// Threads add up their interactions in batches, so they don't all hammer the same counter.
+constexpr uint64_t count_interval = 64;
+
+}
+
+//..................................................................................................
+InteractionNet::InteractionNet(TermArena const& arena, TermId root_id)
+    : chunks_(std::make_unique<std::atomic<Node*>[]>(max_chunks))
+    , n_allocated_(0)
+    , workers_(1)
+    , n_pending_(0)
+    , n_shared_interactions_(0)
+    , is_stopped_(false)
+    , is_broken_(false)
+{
+    Worker& worker = workers_[0];
+    root_ = allocate(worker, NodeKind::root, 0);
+
+    // Count how many times each reachable term is used.
+    std::vector<uint32_t> n_uses(arena.size(), 0);
+    {
+        std::vector<TermId> stack;
+        TermSet visited;
+        n_uses[root_id.value()] = 1;
+        visited.insert(root_id);
+        stack.push_back(root_id);
+        while (!stack.empty()) {
+            TermId const term_id = stack.back();
+            stack.pop_back();
+            if (arena.is_variable(term_id)) {
+                continue;
+            }
+            // An abstraction's variable is reached through its occurrences.
+            uint32_t const first_slot = arena.is_abstraction(term_id) ? 1 : 0;
+            for (uint32_t slot = first_slot; slot < 2; ++slot) {
+                TermId const child_id = arena.children(term_id)[slot];
+                ++n_uses[child_id.value()];
+                if (visited.insert(child_id)) {
+                    stack.push_back(child_id);
+                }
+            }
+        }
+    }
+
+    // Each task connects the output of a term to the given port: the principal port of an
+    // abstraction, or the result port of an application. The argument of an application is a level
+    // deeper than the application. A scope is an abstraction whose body is being translated, or the
+    // whole term at the bottom of the stack. The occurrences of a scope's variable are merged into
+    // a tree of duplicators as they're found, and connected to the abstraction once the body is
+    // done.
+    // A term that the arena shares is translated once for each scope it's used in: the innermost
+    // one whose variable it contains. It's treated as if that scope's body were let s = term in
+    // body, with the redex already contracted: its uses are occurrences of s, and it's translated a
+    // level deeper than the scope, as the argument of the let. Its output is recorded in its
+    // definition, and connected to the tree of its uses once the scope is done.
+    struct Definition {
+        explicit Definition(TermId term): term{term}, output{0} {}
+        TermId term;
+        std::optional<Port> uses;
+        Port output;
+    };
+    struct Scope {
+        Scope(TermId variable, uint32_t node, uint32_t level)
+            : variable{variable}, node{node}, level{level}, n_translated{0} {}
+        TermId variable;
+        uint32_t node;
+        uint32_t level;
+        std::optional<Port> occurrences;
+        std::unordered_map<TermId, uint32_t> definition_indices;
+        std::vector<uint32_t> definitions;
+        std::size_t n_translated;
+    };
+    struct Translate {
+        Translate(
+            TermId term,
+            Port destination,
+            uint32_t level,
+            std::optional<uint32_t> definition = std::nullopt
+        ): term{term}, destination{destination}, level{level}, definition{definition} {}
+        TermId term;
+        Port destination;
+        uint32_t level;
+        std::optional<uint32_t> definition;
+    };
+    struct Finish {};
+    using Task = std::variant<Translate, Finish>;
+    std::vector<Task> tasks;
+    std::vector<Scope> scopes;
+    std::vector<Definition> definitions;
+    std::unordered_map<TermId, uint32_t> scope_indices;
+    std::unordered_map<TermId, uint32_t> free_variable_indices;
+
+    // Brings a use at the given level up to the level of its scope, and adds it to the tree of
+    // duplicators of the other uses.
+    auto const add_use = [&](
+        std::optional<Port>& uses,
+        Port destination,
+        uint32_t level,
+        uint32_t scope_level
+    ) {
+        auto const croissant = allocate(worker, NodeKind::croissant, level);
+        link(destination, port(croissant, 1));
+        Port top = port(croissant, 0);
+        for (uint32_t bracket_level = level; bracket_level-- > scope_level;) {
+            auto const bracket = allocate(worker, NodeKind::bracket, bracket_level);
+            link(port(bracket, 1), top);
+            top = port(bracket, 0);
+        }
+        if (uses.has_value()) {
+            auto const duplicator = allocate(worker, NodeKind::duplicator, scope_level);
+            link(port(duplicator, 1), *uses);
+            link(port(duplicator, 2), top);
+            top = port(duplicator, 0);
+        }
+        uses = top;
+    };
+
+    // The innermost scope whose variable may occur in the term.
+    auto const home_scope = [&](TermId term_id) {
+        FreeVariables const free_variables = arena.free_variables(term_id);
+        uint32_t result = 0;
+        if (free_variables.is_exact()) {
+            for (TermId variable_id : free_variables.variables()) {
+                auto const itr = scope_indices.find(variable_id);
+                if (itr != scope_indices.end()) {
+                    result = std::max(result, itr->second);
+                }
+            }
+            return result;
+        }
+        for (auto i = static_cast<uint32_t>(scopes.size()); i-- > 1;) {
+            if (arena.may_contain(term_id, scopes[i].variable)) {
+                return i;
+            }
+        }
+        return result;
+    };
+
+    scopes.emplace_back(TermId{}, root_, 0);
+    tasks.push_back(Finish{});
+    tasks.push_back(Translate{root_id, port(root_, 0), 0});
+    while (!tasks.empty()) {
+        Task const task = tasks.back();
+        tasks.pop_back();
+        lambda::visit(
+            task,
+            [&](Translate const& translate) {
+                TermId const term_id = translate.term;
+                auto const [child_0, child_1] = arena.children(term_id);
+                auto const connect = [&](Port output) {
+                    if (translate.definition.has_value()) {
+                        definitions[*translate.definition].output = output;
+                    } else {
+                        link(translate.destination, output);
+                    }
+                };
+                if (
+                    !translate.definition.has_value() &&
+                    !arena.is_variable(term_id) &&
+                    n_uses[term_id.value()] > 1
+                ) {
+                    Scope& scope = scopes[home_scope(term_id)];
+                    auto const [itr, is_new] = scope.definition_indices.try_emplace(
+                        term_id,
+                        static_cast<uint32_t>(definitions.size())
+                    );
+                    if (is_new) {
+                        definitions.emplace_back(term_id);
+                        scope.definitions.push_back(itr->second);
+                    }
+                    add_use(
+                        definitions[itr->second].uses,
+                        translate.destination,
+                        translate.level,
+                        scope.level
+                    );
+                    return;
+                }
+                switch (arena.kind(term_id)) {
+                    case TermKind::abstraction: {
+                        auto const node_id = allocate(
+                            worker,
+                            NodeKind::constructor,
+                            translate.level,
+                            static_cast<uint32_t>(names_.size())
+                        );
+                        names_.push_back(symbols_.intern(arena.name(child_0)));
+                        connect(port(node_id, 0));
+                        scope_indices[child_0] = static_cast<uint32_t>(scopes.size());
+                        scopes.emplace_back(child_0, node_id, translate.level);
+                        tasks.push_back(Finish{});
+                        tasks.push_back(Translate{child_1, port(node_id, 2), translate.level});
+                        break;
+                    }
+                    case TermKind::application: {
+                        auto const node_id =
+                            allocate(worker, NodeKind::constructor, translate.level);
+                        connect(port(node_id, 2));
+                        tasks.push_back(
+                            Translate{child_1, port(node_id, 1), translate.level + 1}
+                        );
+                        tasks.push_back(Translate{child_0, port(node_id, 0), translate.level});
+                        break;
+                    }
+                    case TermKind::substitution:
+                        // Its variable's abstraction is in the binding, not above the body.
+                        throw std::runtime_error("Explicit substitutions can't be translated");
+                    case TermKind::variable: {
+                        auto const itr = scope_indices.find(term_id);
+                        if (itr != scope_indices.end()) {
+                            Scope& scope = scopes[itr->second];
+                            add_use(
+                                scope.occurrences,
+                                translate.destination,
+                                translate.level,
+                                scope.level
+                            );
+                            break;
+                        }
+                        // Variables that aren't bound within the term get a node for each
+                        // occurrence.
+                        auto const [index_itr, is_new] = free_variable_indices.try_emplace(
+                            term_id,
+                            static_cast<uint32_t>(free_variables_.size())
+                        );
+                        if (is_new) {
+                            free_variables_.push_back(term_id);
+                        }
+                        auto const node_id =
+                            allocate(worker, NodeKind::free_variable, 0, index_itr->second);
+                        link(translate.destination, port(node_id, 0));
+                        break;
+                    }
+                }
+            },
+            [&](Finish) {
+                // Translating the shared terms may turn up more of them, so check again after.
+                Scope& scope = scopes.back();
+                if (scope.n_translated < scope.definitions.size()) {
+                    tasks.push_back(Finish{});
+                    for (; scope.n_translated < scope.definitions.size(); ++scope.n_translated) {
+                        uint32_t const index = scope.definitions[scope.n_translated];
+                        tasks.push_back(
+                            Translate{definitions[index].term, 0, scope.level + 1, index}
+                        );
+                    }
+                    return;
+                }
+                for (uint32_t index : scope.definitions) {
+                    link(definitions[index].output, *definitions[index].uses);
+                }
+                if (scopes.size() > 1) {
+                    Port const variable = port(scope.node, 1);
+                    if (scope.occurrences.has_value()) {
+                        link(variable, *scope.occurrences);
+                    } else {
+                        link(variable, port(allocate(worker, NodeKind::eraser, 0), 0));
+                    }
+                    scope_indices.erase(scope.variable);
+                }
+                scopes.pop_back();
+            }
+        );
+    }
+
+    // Queue up the initial active pairs.
+    uint32_t const n_nodes = n_allocated_.load(std::memory_order_relaxed);
+    for (uint32_t node_id = 0; node_id < n_nodes; ++node_id) {
+        Port const other = partner(port(node_id, 0));
+        if (
+            slot_of(other) == 0 &&
+            node_of(other) > node_id &&
+            interacts(node(node_id).kind, node(node_of(other)).kind)
+        ) {
+            queue_.push_back(ActivePair{node_id, node_of(other)});
+        }
+    }
+    n_pending_.store(queue_.size(), std::memory_order_relaxed);
+}
+
+//..................................................................................................
+bool InteractionNet::reduce(uint32_t n_threads, std::optional<uint64_t> max_interactions) {
+    n_threads = std::max<uint32_t>(n_threads, 1);
+    workers_.resize(n_threads);
+    is_stopped_.store(false, std::memory_order_relaxed);
+    n_shared_interactions_.store(0, std::memory_order_relaxed);
+
+    if (n_threads == 1) {
+        run(workers_[0], max_interactions);
+    } else {
+        std::vector<std::thread> threads;
+        threads.reserve(n_threads - 1);
+        for (uint32_t i = 1; i < n_threads; ++i) {
+            threads.emplace_back([this, i, max_interactions] {
+                run(workers_[i], max_interactions);
+            });
+        }
+        run(workers_[0], max_interactions);
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // If we stopped early, the remaining pairs go back in the common queue for next time.
+    for (Worker& worker : workers_) {
+        n_interactions_ += worker.n_interactions;
+        worker.n_interactions = 0;
+        queue_.insert(queue_.end(), worker.active_pairs.begin(), worker.active_pairs.end());
+        worker.active_pairs.clear();
+    }
+    n_interactions_ += n_shared_interactions_.load(std::memory_order_relaxed);
+    if (is_broken_.load(std::memory_order_relaxed)) {
+        throw std::runtime_error("Interaction net reached a pair that no rule covers");
+    }
+    return n_pending_.load(std::memory_order_relaxed) == 0;
+}
+
+//..................................................................................................
+TermId InteractionNet::read_back(TermArena& arena) const {
+    // Paths carry a context (as in Gonthier, Abadi and Lévy's semantics): a stack of symbols for
+    // each level. Coming into a duplicator through an auxiliary port pushes that side on the stack
+    // of the duplicator's level, and coming in through its principal port pops the side to leave
+    // through. Coming into a croissant through its auxiliary port inserts a level holding a marker,
+    // and coming into a bracket through its auxiliary port merges its level with the next one into
+    // a pair. Coming in through their principal ports undoes that.
+    using Level = std::vector<uint32_t>;
+    using Context = std::vector<Level>;
+    constexpr uint32_t marker = 0;
+    constexpr uint32_t first_pair = 3;
+    std::vector<std::pair<Level, Level>> pairs;
+    auto const level_at = [](Context& context, uint32_t level) -> Level& {
+        if (context.size() <= level) {
+            context.resize(level + 1);
+        }
+        return context[level];
+    };
+
+    struct Binding { TermId variable; Context context; };
+    struct Visit { Port port; Context context; };
+    struct BuildAbstraction { TermId variable; uint32_t node; };
+    struct BuildApplication {};
+    using Task = std::variant<Visit, BuildAbstraction, BuildApplication>;
+
+    // The variables of the abstractions that are being read back, with the contexts they were
+    // entered with. The innermost copy of each abstraction is at the back.
+    std::unordered_map<uint32_t, std::vector<Binding>> variables;
+    std::vector<Task> tasks;
+    std::vector<TermId> results;
+    // A path that passes through more nodes than the net has, several times over, must be going
+    // around a cycle.
+    uint64_t const max_path_size = 4 * static_cast<uint64_t>(n_nodes());
+    tasks.push_back(Visit{partner(port(root_, 0)), Context{}});
+    while (!tasks.empty()) {
+        Task task = std::move(tasks.back());
+        tasks.pop_back();
+        lambda::visit(
+            task,
+            [&](Visit& visit) {
+                for (uint64_t path_size = 0; ; ++path_size) {
+                    if (path_size == max_path_size) {
+                        throw std::runtime_error("Read back doesn't terminate");
+                    }
+                    uint32_t const node_id = node_of(visit.port);
+                    uint32_t const slot = slot_of(visit.port);
+                    Node const& current = node(node_id);
+                    Context& context = visit.context;
+                    switch (current.kind) {
+                        case NodeKind::constructor:
+                            if (slot == 0) {
+                                TermId const variable_id =
+                                    arena.make_variable(symbols_.name(names_[current.payload]));
+                                variables[node_id].push_back(Binding{variable_id, context});
+                                tasks.push_back(BuildAbstraction{variable_id, node_id});
+                                tasks.push_back(
+                                    Visit{partner(port(node_id, 2)), std::move(context)}
+                                );
+                            } else if (slot == 2) {
+                                tasks.push_back(BuildApplication{});
+                                tasks.push_back(Visit{partner(port(node_id, 1)), context});
+                                tasks.push_back(
+                                    Visit{partner(port(node_id, 0)), std::move(context)}
+                                );
+                            } else {
+                                // Nothing inside an abstraction touches the levels below its own,
+                                // so those tell nested copies of it apart.
+                                auto const agrees = [&](Binding const& binding) {
+                                    for (uint32_t level = 0; level < current.level; ++level) {
+                                        Level const empty;
+                                        auto const& entered = (level < binding.context.size())
+                                            ? binding.context[level] : empty;
+                                        auto const& here = (level < context.size())
+                                            ? context[level] : empty;
+                                        if (entered != here) {
+                                            return false;
+                                        }
+                                    }
+                                    return true;
+                                };
+                                auto const itr = variables.find(node_id);
+                                if (itr == variables.end()) {
+                                    throw std::runtime_error("Variable outside of its abstraction");
+                                }
+                                auto const binding = std::find_if(
+                                    itr->second.rbegin(),
+                                    itr->second.rend(),
+                                    agrees
+                                );
+                                if (binding == itr->second.rend()) {
+                                    throw std::runtime_error("Variable outside of its abstraction");
+                                }
+                                results.push_back(binding->variable);
+                            }
+                            return;
+                        case NodeKind::duplicator: {
+                            Level& stack = level_at(context, current.level);
+                            if (slot != 0) {
+                                stack.push_back(slot);
+                                visit.port = partner(port(node_id, 0));
+                                break;
+                            }
+                            if (stack.empty() || stack.back() == marker ||
+                                stack.back() >= first_pair) {
+                                throw std::runtime_error("Unmatched duplicator");
+                            }
+                            visit.port = partner(port(node_id, stack.back()));
+                            stack.pop_back();
+                            break;
+                        }
+                        case NodeKind::croissant:
+                            if (slot != 0) {
+                                level_at(context, current.level);
+                                context.insert(context.begin() + current.level, Level{marker});
+                                visit.port = partner(port(node_id, 0));
+                                break;
+                            }
+                            if (level_at(context, current.level) != Level{marker}) {
+                                throw std::runtime_error("Unmatched croissant");
+                            }
+                            context.erase(context.begin() + current.level);
+                            visit.port = partner(port(node_id, 1));
+                            break;
+                        case NodeKind::bracket: {
+                            if (slot != 0) {
+                                level_at(context, current.level + 1);
+                                pairs.emplace_back(
+                                    std::move(context[current.level]),
+                                    std::move(context[current.level + 1])
+                                );
+                                auto const pair_index = static_cast<uint32_t>(pairs.size() - 1);
+                                context[current.level] = Level{first_pair + pair_index};
+                                context.erase(context.begin() + current.level + 1);
+                                visit.port = partner(port(node_id, 0));
+                                break;
+                            }
+                            Level const& merged = level_at(context, current.level);
+                            if (merged.size() != 1 || merged[0] < first_pair) {
+                                throw std::runtime_error("Unmatched bracket");
+                            }
+                            // Other paths may share the pair, so it's copied out.
+                            auto const& [lower, upper] = pairs[merged[0] - first_pair];
+                            context[current.level] = lower;
+                            context.insert(context.begin() + current.level + 1, upper);
+                            visit.port = partner(port(node_id, 1));
+                            break;
+                        }
+                        case NodeKind::free_variable:
+                            results.push_back(free_variables_[current.payload]);
+                            return;
+                        case NodeKind::root:
+                        case NodeKind::eraser:
+                            throw std::runtime_error("Unexpected node while reading back");
+                    }
+                }
+            },
+            [&](BuildAbstraction build) {
+                variables[build.node].pop_back();
+                results.back() = arena.make_abstraction(build.variable, results.back());
+            },
+            [&](BuildApplication) {
+                TermId const argument_id = results.back();
+                results.pop_back();
+                results.back() = arena.make_application(results.back(), argument_id);
+            }
+        );
+    }
+    return results.back();
+}
+
+//..................................................................................................
+uint32_t InteractionNet::n_nodes() const {
+    uint32_t n_nodes = n_allocated_.load(std::memory_order_relaxed);
+    for (Worker const& worker : workers_) {
+        n_nodes -= static_cast<uint32_t>(worker.free_nodes.size());
+    }
+    return n_nodes;
+}
+
+//..................................................................................................
+uint32_t InteractionNet::arity(NodeKind kind) {
+    switch (kind) {
+        case NodeKind::constructor:
+        case NodeKind::duplicator:
+            return 2;
+        case NodeKind::croissant:
+        case NodeKind::bracket:
+            return 1;
+        case NodeKind::root:
+        case NodeKind::eraser:
+        case NodeKind::free_variable:
+            return 0;
+    }
+    return 0;
+}
+
+//..................................................................................................
+bool InteractionNet::has_level(NodeKind kind) {
+    return arity(kind) > 0;
+}
+
+//..................................................................................................
+bool InteractionNet::interacts(NodeKind kind_0, NodeKind kind_1) {
+    if (kind_0 == NodeKind::root || kind_1 == NodeKind::root) {
+        return false;
+    }
+    // A free variable applied to something is stuck.
+    return !(
+        (kind_0 == NodeKind::constructor && kind_1 == NodeKind::free_variable) ||
+        (kind_0 == NodeKind::free_variable && kind_1 == NodeKind::constructor)
+    );
+}
+
+//..................................................................................................
+uint32_t InteractionNet::allocate(
+    Worker& worker,
+    NodeKind kind,
+    uint32_t level,
+    uint32_t payload
+) {
+    uint32_t node_id;
+    if (!worker.free_nodes.empty()) {
+        node_id = worker.free_nodes.back();
+        worker.free_nodes.pop_back();
+    } else {
+        node_id = n_allocated_.fetch_add(1, std::memory_order_relaxed);
+        uint32_t const chunk = node_id >> chunk_bits;
+        if (chunk >= max_chunks) {
+            throw std::runtime_error("Interaction net is full");
+        }
+        if (chunks_[chunk].load(std::memory_order_acquire) == nullptr) {
+            std::lock_guard<std::mutex> lock(chunk_mutex_);
+            if (chunks_[chunk].load(std::memory_order_relaxed) == nullptr) {
+                owned_chunks_.push_back(std::make_unique<Node[]>(chunk_size));
+                chunks_[chunk].store(owned_chunks_.back().get(), std::memory_order_release);
+            }
+        }
+    }
+    // The lock flag is left alone, since another thread may briefly hold it if it saw this node
+    // before it was freed.
+    Node& new_node = node(node_id);
+    new_node.kind = kind;
+    new_node.level = level;
+    new_node.payload = payload;
+    return node_id;
+}
+
+//..................................................................................................
+void InteractionNet::push_active_pair(Worker& worker, ActivePair pair) {
+    n_pending_.fetch_add(1, std::memory_order_relaxed);
+    worker.active_pairs.push_back(pair);
+    if (workers_.size() > 1 && worker.active_pairs.size() > share_threshold) {
+        auto const first = worker.active_pairs.begin() + share_threshold / 2;
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        queue_.insert(queue_.end(), first, worker.active_pairs.end());
+        worker.active_pairs.erase(first, worker.active_pairs.end());
+    }
+}
+
+//..................................................................................................
+bool InteractionNet::pop_active_pair(Worker& worker, ActivePair& pair) {
+    if (worker.active_pairs.empty()) {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        std::size_t const n_taken = std::min(queue_.size(), batch_size);
+        worker.active_pairs.insert(worker.active_pairs.end(), queue_.end() - n_taken, queue_.end());
+        queue_.resize(queue_.size() - n_taken);
+    }
+    if (worker.active_pairs.empty()) {
+        return false;
+    }
+    pair = worker.active_pairs.back();
+    worker.active_pairs.pop_back();
+    return true;
+}
+
+//..................................................................................................
+void InteractionNet::run(Worker& worker, std::optional<uint64_t> max_interactions) {
+    while (!is_stopped_.load(std::memory_order_relaxed)) {
+        ActivePair pair;
+        if (!pop_active_pair(worker, pair)) {
+            if (n_pending_.load(std::memory_order_acquire) == 0) {
+                return;
+            }
+            std::this_thread::yield();
+            continue;
+        }
+
+        interact(worker, pair);
+        n_pending_.fetch_sub(1, std::memory_order_release);
+
+        if (worker.n_interactions >= count_interval) {
+            uint64_t const n_interactions = worker.n_interactions +
+                n_shared_interactions_.fetch_add(worker.n_interactions, std::memory_order_relaxed);
+            worker.n_interactions = 0;
+            if (max_interactions.has_value() && n_interactions >= *max_interactions) {
+                is_stopped_.store(true, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+//..................................................................................................
+void InteractionNet::interact(Worker& worker, ActivePair pair) {
+    // A single thread has the net to itself, so it doesn't need to lock anything.
+    Neighborhood const locked = (workers_.size() > 1) ? lock_neighborhood(pair) : Neighborhood{};
+    Node& node_0 = node(pair.node_0);
+    Node& node_1 = node(pair.node_1);
+    auto const is_dying = [&](Port p) {
+        return node_of(p) == pair.node_0 || node_of(p) == pair.node_1;
+    };
+    ++worker.n_interactions;
+
+    // These are the ports whose wires changed, so any new active pairs involve one of them.
+    std::array<Port, 4> touched;
+    uint32_t n_touched = 0;
+
+    if (
+        node_0.kind == node_1.kind &&
+        node_0.level == node_1.level &&
+        has_level(node_0.kind)
+    ) {
+        // Annihilation. Connect the auxiliary ports pairwise. If the nodes are wired to each other,
+        // the first link writes to one of their ports, which the second link then picks up.
+        for (uint32_t slot = 1; slot <= arity(node_0.kind); ++slot) {
+            Port const p = partner(port(pair.node_0, slot));
+            Port const q = partner(port(pair.node_1, slot));
+            link(p, q);
+            touched[n_touched++] = p;
+            touched[n_touched++] = q;
+        }
+    } else {
+        // Commutation. Each auxiliary port of one node gets a copy of the other node, and the
+        // copies are wired to each other. Erasers have no auxiliary ports, so an eraser just
+        // spreads to the neighbors of the other node. Between two nodes with levels, the one with
+        // the lower level has to be a duplicator, croissant or bracket, and the copies of the
+        // other one keep its level, or move down or up a level.
+        uint32_t level_0 = node_0.level;
+        uint32_t level_1 = node_1.level;
+        if (has_level(node_0.kind) && has_level(node_1.kind)) {
+            bool const is_lower_0 = node_0.level < node_1.level;
+            NodeKind const lower_kind = is_lower_0 ? node_0.kind : node_1.kind;
+            uint32_t& upper_level = is_lower_0 ? level_1 : level_0;
+            if (node_0.level == node_1.level || lower_kind == NodeKind::constructor) {
+                is_broken_.store(true, std::memory_order_relaxed);
+                is_stopped_.store(true, std::memory_order_relaxed);
+                unlock(locked);
+                return;
+            }
+            if (lower_kind == NodeKind::croissant) {
+                --upper_level;
+            } else if (lower_kind == NodeKind::bracket) {
+                ++upper_level;
+            }
+        }
+        uint32_t const arity_0 = arity(node_0.kind);
+        uint32_t const arity_1 = arity(node_1.kind);
+        std::array<uint32_t, 2> copies_0;
+        std::array<uint32_t, 2> copies_1;
+        for (uint32_t i = 0; i < arity_1; ++i) {
+            copies_0[i] = allocate(worker, node_0.kind, level_0, node_0.payload);
+        }
+        for (uint32_t i = 0; i < arity_0; ++i) {
+            copies_1[i] = allocate(worker, node_1.kind, level_1, node_1.payload);
+        }
+        for (uint32_t i = 0; i < arity_0; ++i) {
+            for (uint32_t j = 0; j < arity_1; ++j) {
+                link(port(copies_1[i], j + 1), port(copies_0[j], i + 1));
+            }
+        }
+
+        // The wire at each old auxiliary port now ends at the principal port of its copy.
+        auto const replacement = [&](Port p) {
+            return (node_of(p) == pair.node_0)
+                ? port(copies_1[slot_of(p) - 1], 0)
+                : port(copies_0[slot_of(p) - 1], 0);
+        };
+        auto const reconnect = [&](uint32_t node_id, uint32_t arity) {
+            for (uint32_t slot = 1; slot <= arity; ++slot) {
+                Port const p = port(node_id, slot);
+                Port const q = partner(p);
+                if (!is_dying(q)) {
+                    link(replacement(p), q);
+                } else if (p < q) {
+                    link(replacement(p), replacement(q));
+                }
+                touched[n_touched++] = replacement(p);
+            }
+        };
+        reconnect(pair.node_0, arity_0);
+        reconnect(pair.node_1, arity_1);
+    }
+
+    // Look for new active pairs. A wire may be reached from both ends.
+    std::array<ActivePair, 4> found;
+    uint32_t n_found = 0;
+    for (uint32_t i = 0; i < n_touched; ++i) {
+        Port const p = touched[i];
+        Port const q = partner(p);
+        if (is_dying(p) || slot_of(p) != 0 || slot_of(q) != 0) {
+            continue;
+        }
+        if (!interacts(node(node_of(p)).kind, node(node_of(q)).kind)) {
+            continue;
+        }
+        ActivePair const new_pair{
+            std::min(node_of(p), node_of(q)),
+            std::max(node_of(p), node_of(q))
+        };
+        auto const end = found.begin() + n_found;
+        auto const is_same = [&](ActivePair other) {
+            return other.node_0 == new_pair.node_0 && other.node_1 == new_pair.node_1;
+        };
+        if (std::find_if(found.begin(), end, is_same) == end) {
+            found[n_found++] = new_pair;
+        }
+    }
+
+    unlock(locked);
+    worker.free_nodes.push_back(pair.node_0);
+    worker.free_nodes.push_back(pair.node_1);
+    for (uint32_t i = 0; i < n_found; ++i) {
+        push_active_pair(worker, found[i]);
+    }
+}
+
+//..................................................................................................
+bool InteractionNet::Neighborhood::operator==(Neighborhood const& other) const {
+    return size == other.size &&
+        std::equal(nodes.begin(), nodes.begin() + size, other.nodes.begin());
+}
+
+//..................................................................................................
+InteractionNet::Neighborhood InteractionNet::neighborhood(ActivePair pair) const {
+    Neighborhood result;
+    for (uint32_t node_id : {pair.node_0, pair.node_1}) {
+        result.nodes[result.size++] = node_id;
+        for (uint32_t slot = 1; slot <= arity(node(node_id).kind); ++slot) {
+            result.nodes[result.size++] = node_of(partner(port(node_id, slot)));
+        }
+    }
+    // There are at most six nodes, so an insertion sort is plenty.
+    uint32_t n_unique = 0;
+    for (uint32_t i = 0; i < result.size; ++i) {
+        uint32_t const node_id = result.nodes[i];
+        uint32_t j = 0;
+        while (j < n_unique && result.nodes[j] < node_id) {
+            ++j;
+        }
+        if (j < n_unique && result.nodes[j] == node_id) {
+            continue;
+        }
+        std::copy_backward(
+            result.nodes.begin() + j,
+            result.nodes.begin() + n_unique,
+            result.nodes.begin() + n_unique + 1
+        );
+        result.nodes[j] = node_id;
+        ++n_unique;
+    }
+    result.size = n_unique;
+    return result;
+}
+
+//..................................................................................................
+InteractionNet::Neighborhood InteractionNet::lock_neighborhood(ActivePair pair) {
+    // Only this thread can change the nodes of the pair, but their neighbors may be rewired by
+    // other interactions until they're locked. So after locking, we check that they're still the
+    // neighbors, and start over if not.
+    while (true) {
+        Neighborhood const result = neighborhood(pair);
+        for (uint32_t i = 0; i < result.size; ++i) {
+            std::atomic<bool>& is_locked = node(result.nodes[i]).is_locked;
+            while (is_locked.exchange(true, std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+        }
+        if (neighborhood(pair) == result) {
+            return result;
+        }
+        unlock(result);
+    }
+}
+
+//..................................................................................................
+void InteractionNet::unlock(Neighborhood const& neighborhood) {
+    for (uint32_t i = 0; i < neighborhood.size; ++i) {
+        node(neighborhood.nodes[i]).is_locked.store(false, std::memory_order_release);
+    }
+}
+
+}
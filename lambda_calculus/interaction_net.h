@@ -0,0 +1,169 @@
+#ifndef LAMBDA_INTERACTION_NET_H
+#define LAMBDA_INTERACTION_NET_H
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <vector>
+#include "term_arena.h"
+#include "utils/stdint.h"
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// Interaction nets for optimal reduction (Lamping's algorithm, with the levels of Gonthier, Abadi
+// and Lévy that keep it sound for every term).
+// A term is translated into a net of nodes with one principal port and up to two auxiliary ports.
+// Abstractions and applications both become constructors: an abstraction's principal port is the
+// abstraction itself and its auxiliary ports are its variable and body, while an application's
+// principal port leads to its function and its auxiliary ports to its argument and result. So a
+// beta redex is a pair of constructors joined at their principal ports. Every node but an eraser
+// has a level, which counts the arguments it's nested in. Variables that occur more than once are
+// copied lazily by trees of duplicators, and unused variables are connected to erasers. On its way
+// to its abstraction, each occurrence of a variable goes through a croissant, which takes whatever
+// the variable is bound to down a level, and a bracket for each argument it leaves, which takes it
+// up a level. A subterm that the arena shares is translated once, as if it were bound by a let,
+// and its uses are duplicated the same way; so the net is about as large as the arena's graph of
+// the term, plus a bracket for each argument that a variable occurrence is nested in.
+// Wherever two principal ports meet, the nodes interact: nodes of the same kind and level
+// annihilate, connecting their auxiliary ports pairwise, and otherwise the node with the lower
+// level is copied past the other, which is duplicated, moved down a level or moved up a level.
+// Since duplicators copy bodies incrementally, the work done inside a shared body is shared
+// between its copies.
+// Each interaction only touches the two nodes and their immediate neighbors, so reduce can spread
+// the work over several threads. Each interaction locks the nodes it touches (in order of id, so
+// threads can't deadlock), and pending interactions are shared through a common queue.
+// Every active pair is reduced, including those in parts of the net that end up being erased, so
+// terms whose normal forms depend on discarding diverging subterms (such as recursion with the Y
+// combinator) may not terminate.
+class InteractionNet {
+public:
+    // Translates the term beneath root_id.
+    InteractionNet(TermArena const& arena, TermId root_id);
+
+    // Performs interactions until there are none left, using the given number of threads. Returns
+    // false if max_interactions was reached first. (Interactions are counted in batches, so this
+    // may overshoot a little.) The remaining interactions are kept, so reduce can be called again.
+    // Throws if two nodes meet that no rule covers, which a translated term never leads to.
+    bool reduce(uint32_t n_threads, std::optional<uint64_t> max_interactions = std::nullopt);
+
+    // Builds the term that the net currently represents in the arena. After reduce, this is the
+    // normal form. Throws if the paths through the net don't match up, or go around a cycle.
+    TermId read_back(TermArena& arena) const;
+
+    uint64_t n_interactions() const { return n_interactions_; }
+    // This counts nodes that are in use, including the root.
+    uint32_t n_nodes() const;
+
+private:
+    enum class NodeKind : uint8_t {
+        root,
+        constructor,
+        duplicator,
+        croissant,
+        bracket,
+        eraser,
+        free_variable
+    };
+
+    // A port is a node id and a slot (zero for the principal port), packed in one word.
+    using Port = uint32_t;
+    static constexpr uint32_t slot_bits = 2;
+    static constexpr uint32_t chunk_bits = 16;
+    static constexpr uint32_t chunk_size = 1u << chunk_bits;
+    static constexpr uint32_t max_chunks = 1u << (32 - slot_bits - chunk_bits);
+
+    static Port port(uint32_t node, uint32_t slot) { return (node << slot_bits) | slot; }
+    static uint32_t node_of(Port p) { return p >> slot_bits; }
+    static uint32_t slot_of(Port p) { return p & ((1u << slot_bits) - 1); }
+
+    // Each port holds the port at the other end of its wire. Ports are atomic since threads peek at
+    // their neighbors before locking them. The payload is the index of an abstraction's variable
+    // name, or the index of a free variable. Roots, erasers and free variables ignore their level.
+    struct Node {
+        std::atomic<Port> ports[3];
+        std::atomic<bool> is_locked;
+        NodeKind kind;
+        uint32_t level;
+        uint32_t payload;
+    };
+
+    struct ActivePair {
+        uint32_t node_0;
+        uint32_t node_1;
+    };
+
+    // Each thread allocates from its own free list first, and keeps its own stack of active pairs.
+    struct Worker {
+        std::vector<uint32_t> free_nodes;
+        std::vector<ActivePair> active_pairs;
+        uint64_t n_interactions = 0;
+    };
+
+    static uint32_t arity(NodeKind kind);
+    static bool has_level(NodeKind kind);
+    static bool interacts(NodeKind kind_0, NodeKind kind_1);
+
+    Node& node(uint32_t id) const {
+        return chunks_[id >> chunk_bits].load(std::memory_order_acquire)[id & (chunk_size - 1)];
+    }
+    Port partner(Port p) const {
+        return node(node_of(p)).ports[slot_of(p)].load(std::memory_order_relaxed);
+    }
+    void link(Port p, Port q) {
+        node(node_of(p)).ports[slot_of(p)].store(q, std::memory_order_relaxed);
+        node(node_of(q)).ports[slot_of(q)].store(p, std::memory_order_relaxed);
+    }
+
+    uint32_t allocate(Worker& worker, NodeKind kind, uint32_t level, uint32_t payload = 0);
+
+    // Pending interactions are counted from when they're found until they've been performed, so
+    // once the count drops to zero, every thread can stop.
+    void push_active_pair(Worker& worker, ActivePair pair);
+    bool pop_active_pair(Worker& worker, ActivePair& pair);
+    void run(Worker& worker, std::optional<uint64_t> max_interactions);
+    void interact(Worker& worker, ActivePair pair);
+
+    // The nodes of an active pair and the nodes connected to their auxiliary ports, sorted by id
+    // without duplicates.
+    struct Neighborhood {
+        std::array<uint32_t, 6> nodes = {};
+        uint32_t size = 0;
+        bool operator==(Neighborhood const& other) const;
+    };
+
+    Neighborhood neighborhood(ActivePair pair) const;
+    // Locks every node in the neighborhood of the pair, and returns the neighborhood.
+    Neighborhood lock_neighborhood(ActivePair pair);
+    void unlock(Neighborhood const& neighborhood);
+
+    // The net is stored in fixed size chunks, so nodes never move while other threads use them.
+    std::unique_ptr<std::atomic<Node*>[]> chunks_;
+    std::vector<std::unique_ptr<Node[]>> owned_chunks_;
+    std::mutex chunk_mutex_;
+    std::atomic<uint32_t> n_allocated_;
+    uint32_t root_;
+
+    // The names of the variables bound by constructors, indexed by payload. They're copied into a
+    // table of the net's own, since read_back may intern new names in the source arena.
+    SymbolTable symbols_;
+    std::vector<Symbol> names_;
+    std::vector<TermId> free_variables_;
+
+    std::vector<Worker> workers_;
+    std::mutex queue_mutex_;
+    std::vector<ActivePair> queue_;
+    std::atomic<uint64_t> n_pending_;
+    std::atomic<uint64_t> n_shared_interactions_;
+    std::atomic<bool> is_stopped_;
+    // Set when two nodes meet that no rule covers.
+    std::atomic<bool> is_broken_;
+    uint64_t n_interactions_ = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include "krivine_machine.h"
+#include "utils/visit.h"
+
+namespace lambda {
+
+//..................................................................................................
+TermId KrivineMachine::normalize(TermId root_id) {
+    // Thunks and frames don't outlive a call, since the arena may change in between.
+    thunks_.clear();
+    frames_.clear();
+    tasks_.clear();
+    results_.clear();
+
+    tasks_.push_back(ReadBack{make_thunk(root_id, empty_environment)});
+    while (!tasks_.empty()) {
+        Task const task = tasks_.back();
+        tasks_.pop_back();
+        lambda::visit(
+            task,
+            [&](ReadBack read_back) {
+                // Shared thunks are only read back once.
+                std::optional<TermId> const normal_form = thunks_[read_back.thunk].normal_form;
+                if (normal_form.has_value()) {
+                    results_.push_back(*normal_form);
+                    return;
+                }
+                tasks_.push_back(Memoize{read_back.thunk});
+
+                evaluate(read_back.thunk);
+                if (arena_.is_abstraction(closure_.term)) {
+                    // Evaluate the body with the variable bound to a new free variable.
+                    auto const [variable_id, body_id] = arena_.children(closure_.term);
+                    TermId const new_variable_id = arena_.make_variable(arena_.symbol(variable_id));
+                    frames_.push_back(Frame{
+                        variable_id,
+                        make_thunk(new_variable_id, empty_environment),
+                        closure_.environment
+                    });
+                    auto const environment = static_cast<uint32_t>(frames_.size() - 1);
+                    tasks_.push_back(BuildAbstraction{new_variable_id});
+                    tasks_.push_back(ReadBack{make_thunk(body_id, environment)});
+                    return;
+                }
+
+                // Otherwise we have a free variable applied to some arguments. The first argument
+                // is at the back, so it's pushed last and read back first.
+                tasks_.push_back(BuildApplications{
+                    closure_.term,
+                    static_cast<uint32_t>(arguments_.size())
+                });
+                for (uint32_t argument : arguments_) {
+                    tasks_.push_back(ReadBack{argument});
+                }
+            },
+            [&](BuildAbstraction build) {
+                TermId const body_id = results_.back();
+                results_.back() = arena_.make_abstraction(build.variable, body_id);
+            },
+            [&](BuildApplications build) {
+                auto const first = results_.end() - build.n_arguments;
+                TermId term_id = build.head;
+                for (auto itr = first; itr != results_.end(); ++itr) {
+                    term_id = arena_.make_application(term_id, *itr);
+                }
+                results_.erase(first, results_.end());
+                results_.push_back(term_id);
+            },
+            [&](Memoize memoize) {
+                thunks_[memoize.thunk].normal_form = results_.back();
+            }
+        );
+    }
+
+    return results_.back();
+}
+
+//..................................................................................................
+uint32_t KrivineMachine::make_thunk(TermId term, uint32_t environment) {
+    thunks_.push_back(Thunk{Closure{term, environment}, false, std::nullopt});
+    return static_cast<uint32_t>(thunks_.size() - 1);
+}
+
+//..................................................................................................
+void KrivineMachine::evaluate(uint32_t thunk) {
+    arguments_.clear();
+    update_markers_.clear();
+    closure_ = thunks_[thunk].closure;
+    if (!thunks_[thunk].is_evaluated) {
+        update_markers_.push_back(UpdateMarker{thunk, 0});
+    }
+
+    while (true) {
+        ++n_transitions_;
+        auto const [child_0, child_1] = arena_.children(closure_.term);
+        switch (arena_.kind(closure_.term)) {
+            case TermKind::application:
+                // Delay the argument, and evaluate the function.
+                arguments_.push_back(make_thunk(child_1, closure_.environment));
+                closure_.term = child_0;
+                break;
+            case TermKind::substitution: {
+                // An explicit substitution is just another frame of the environment.
+                auto const [variable_id, argument_id] = arena_.binding(closure_.term);
+                uint32_t const thunk = make_thunk(argument_id, closure_.environment);
+                frames_.push_back(Frame{variable_id, thunk, closure_.environment});
+                closure_ = Closure{child_0, static_cast<uint32_t>(frames_.size() - 1)};
+                break;
+            }
+            case TermKind::variable: {
+                std::optional<uint32_t> const bound_thunk =
+                    look_up(closure_.term, closure_.environment);
+                // A free variable can't be reduced any further. The thunks being evaluated are left
+                // as they are.
+                if (!bound_thunk.has_value()) {
+                    return;
+                }
+                Thunk const& next = thunks_[*bound_thunk];
+                if (!next.is_evaluated) {
+                    update_markers_.push_back(
+                        UpdateMarker{*bound_thunk, static_cast<uint32_t>(arguments_.size())}
+                    );
+                }
+                closure_ = next.closure;
+                break;
+            }
+            case TermKind::abstraction:
+                // If a thunk was evaluated with exactly the arguments we have left, this is its
+                // weak head normal form.
+                while (
+                    !update_markers_.empty() &&
+                    update_markers_.back().n_arguments == arguments_.size()
+                ) {
+                    Thunk& updated = thunks_[update_markers_.back().thunk];
+                    updated.closure = closure_;
+                    updated.is_evaluated = true;
+                    update_markers_.pop_back();
+                }
+                if (arguments_.empty()) {
+                    return;
+                }
+
+                // Bind the variable to the next argument.
+                ++n_reductions_;
+                frames_.push_back(Frame{child_0, arguments_.back(), closure_.environment});
+                arguments_.pop_back();
+                closure_ = Closure{child_1, static_cast<uint32_t>(frames_.size() - 1)};
+                break;
+        }
+    }
+}
+
+//..................................................................................................
+std::optional<uint32_t> KrivineMachine::look_up(TermId variable_id, uint32_t environment) const {
+    while (environment != empty_environment) {
+        Frame const& frame = frames_[environment];
+        if (frame.variable == variable_id) {
+            return frame.thunk;
+        }
+        environment = frame.parent;
+    }
+    return std::nullopt;
+}
+
+}
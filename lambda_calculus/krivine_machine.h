@@ -0,0 +1,108 @@
+#ifndef LAMBDA_KRIVINE_MACHINE_H
+#define LAMBDA_KRIVINE_MACHINE_H
+
+#include "term_arena.h"
+#include "utils/stdint.h"
+#include <optional>
+#include <variant>
+#include <vector>
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// A lazy Krivine machine. Instead of substituting arguments into bodies, it pairs each term with an
+// environment that says what its variables stand for, so a beta reduction takes constant time no
+// matter how big the body is. Terms in the arena are only read; nothing is copied until the result
+// is read back.
+// Arguments are delayed as thunks. When a thunk is first evaluated to an abstraction, it is
+// updated with the result, so shared arguments are only evaluated once (this is call-by-need).
+// Thunks that evaluate to an application of a free variable aren't updated, and are evaluated
+// again each time they're needed.
+// To reach normal form, normalize evaluates the term to weak head normal form, and then reads it
+// back into the arena. The bodies of abstractions are evaluated with their variables bound to new
+// free variables, and the arguments of free variables are normalized in turn. Each thunk is only
+// read back once, so the result shares structure wherever the arguments did.
+// Looking up a variable walks the environment from the innermost frame out, so it takes time
+// proportional to the number of frames between the variable and its binding (its de Bruijn index,
+// plus any explicit substitutions in between), not constant time. Environments would have to be
+// flat arrays for constant time lookups, and then each closure would have to copy its environment
+// instead of sharing it. A variable used deep inside many nested abstractions pays for this on
+// every use.
+class KrivineMachine {
+public:
+    explicit KrivineMachine(TermArena& arena): arena_(arena) {}
+
+    // Builds the normal form of root_id in the arena, and returns its id. root_id is left as it is.
+    // This doesn't terminate if root_id doesn't have a normal form.
+    TermId normalize(TermId root_id);
+
+    // These count transitions of the machine and beta reductions, over all calls.
+    uint64_t n_transitions() const { return n_transitions_; }
+    uint64_t n_reductions() const { return n_reductions_; }
+
+private:
+    static constexpr uint32_t empty_environment = 0xFFFFFFFF;
+
+    // A term, along with the environment that its free variables are looked up in.
+    struct Closure {
+        TermId term;
+        uint32_t environment;
+    };
+
+    struct Thunk {
+        Closure closure;
+        // True once the closure has been replaced by its weak head normal form.
+        bool is_evaluated;
+        std::optional<TermId> normal_form;
+    };
+
+    // Environments are linked lists of frames, each binding one variable to a thunk. Frames are
+    // shared between all the environments that extend them.
+    struct Frame {
+        TermId variable;
+        uint32_t thunk;
+        uint32_t parent;
+    };
+
+    // When a thunk is being evaluated, this records how many arguments were on the stack, so we
+    // can tell when it reaches weak head normal form.
+    struct UpdateMarker {
+        uint32_t thunk;
+        uint32_t n_arguments;
+    };
+
+    // Reading back is done with an explicit stack of tasks. Results go on their own stack.
+    struct ReadBack { uint32_t thunk; };
+    struct BuildAbstraction { TermId variable; };
+    struct BuildApplications { TermId head; uint32_t n_arguments; };
+    struct Memoize { uint32_t thunk; };
+    using Task = std::variant<ReadBack, BuildAbstraction, BuildApplications, Memoize>;
+
+    uint32_t make_thunk(TermId term, uint32_t environment);
+
+    // Evaluates a thunk to weak head normal form. Afterward, closure_ holds either an abstraction,
+    // or a free variable applied to the thunks in arguments_ (the first argument is at the back).
+    void evaluate(uint32_t thunk);
+
+    // Returns the thunk bound to variable_id, if there is one. This is a linear search of the
+    // environment (see above).
+    std::optional<uint32_t> look_up(TermId variable_id, uint32_t environment) const;
+
+    TermArena& arena_;
+    std::vector<Thunk> thunks_;
+    std::vector<Frame> frames_;
+
+    Closure closure_;
+    std::vector<uint32_t> arguments_;
+    std::vector<UpdateMarker> update_markers_;
+
+    std::vector<Task> tasks_;
+    std::vector<TermId> results_;
+
+    uint64_t n_transitions_ = 0;
+    uint64_t n_reductions_ = 0;
+};
+
+}
+
+#endif
@@ -26,7 +26,6 @@ int main() {
     */
 
     TermArena arena;
-    arena.reserve(2048);
 
     TermId const identity = [&arena]() {
         auto const var_x = arena.make_variable("x");
@@ -244,15 +243,13 @@ int main() {
     }();
 
     auto const step_by_step = [&arena](TermId root_id, std::string name) {
-        uint32_t total_reductions = 0;
-        uint32_t n_reductions;
+        NormalOrderReducer reducer(arena, root_id);
         std::cout << name << '\n';
         do {
-            std::cout << "step " << total_reductions << ": " << TermPrinter(arena, root_id) << "\n\n";
-            root_id = reduce_normal_order(arena, root_id, n_reductions, 1);
-            ++total_reductions;
-        } while (n_reductions != 0);
-        return root_id;
+            std::cout << "step " << reducer.n_reductions() << ": "
+                << TermPrinter(arena, reducer.root()) << "\n\n";
+        } while (reducer.step(1) != 0);
+        return reducer.root();
     };
 
     auto const all_at_once = [&arena](TermId root_id, std::string name) {
@@ -0,0 +1,299 @@
+#include "nbe_normalizer.h"
+#include "term_reduction.h"
+#include "utils/visit.h"
+#include <stdexcept>
+#include <unordered_map>
+
+namespace lambda {
+
+namespace {
+
+//--------------------------------------------------------------------------------------------------
+// Copies the term beneath root_id into another arena. Shared subterms stay shared. Variables that
+// are free in the term are copied as well, and copies records the copy of every term.
+TermId copy_term(
+    TermArena const& source,
+    TermId root_id,
+    TermArena& target,
+    std::unordered_map<TermId, TermId>& copies
+) {
+    std::vector<std::pair<TermId, bool>> stack;
+    stack.emplace_back(root_id, false);
+    while (!stack.empty()) {
+        auto const [term_id, is_expanded] = stack.back();
+        if (copies.contains(term_id)) {
+            stack.pop_back();
+            continue;
+        }
+        if (source.is_variable(term_id)) {
+            copies.emplace(term_id, target.make_variable(source.name(term_id)));
+            stack.pop_back();
+            continue;
+        }
+        auto const [child_0, child_1] = source.children(term_id);
+        if (!is_expanded) {
+            stack.back().second = true;
+            stack.emplace_back(child_1, false);
+            stack.emplace_back(child_0, false);
+            continue;
+        }
+        stack.pop_back();
+        TermId const copy_0 = copies.at(child_0);
+        TermId const copy_1 = copies.at(child_1);
+        switch (source.kind(term_id)) {
+            case TermKind::abstraction:
+                copies.emplace(term_id, target.make_abstraction(copy_0, copy_1));
+                break;
+            case TermKind::application:
+                copies.emplace(term_id, target.make_application(copy_0, copy_1));
+                break;
+            case TermKind::substitution:
+                copies.emplace(term_id, target.make_substitution(copy_0, copy_1));
+                break;
+            case TermKind::variable:
+                break;
+        }
+    }
+    return copies.at(root_id);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Compares terms in two arenas. Bound variables match if they're bound by matching abstractions.
+// Free variables match if free_variables maps the first to the second.
+bool are_alpha_equivalent(
+    TermArena const& arena_0,
+    TermId term_0,
+    TermArena const& arena_1,
+    TermId term_1,
+    std::unordered_map<TermId, TermId> const& free_variables
+) {
+    std::unordered_map<TermId, TermId> bound_variables;
+    std::vector<std::pair<TermId, TermId>> stack;
+    stack.emplace_back(term_0, term_1);
+    while (!stack.empty()) {
+        auto const [id_0, id_1] = stack.back();
+        stack.pop_back();
+        if (arena_0.kind(id_0) != arena_1.kind(id_1)) {
+            return false;
+        }
+        auto const [child_00, child_01] = arena_0.children(id_0);
+        auto const [child_10, child_11] = arena_1.children(id_1);
+        switch (arena_0.kind(id_0)) {
+            case TermKind::variable: {
+                auto const bound = bound_variables.find(id_0);
+                if (bound != bound_variables.end()) {
+                    if (bound->second != id_1) {
+                        return false;
+                    }
+                    break;
+                }
+                auto const free = free_variables.find(id_0);
+                if (free == free_variables.end() || free->second != id_1) {
+                    return false;
+                }
+                break;
+            }
+            case TermKind::abstraction:
+                bound_variables.insert_or_assign(child_00, child_10);
+                stack.emplace_back(child_01, child_11);
+                break;
+            case TermKind::application:
+                stack.emplace_back(child_00, child_10);
+                stack.emplace_back(child_01, child_11);
+                break;
+            case TermKind::substitution:
+                // The bindings are compared first, so that their variables are bound by the time
+                // the bodies are.
+                stack.emplace_back(child_00, child_10);
+                stack.emplace_back(child_01, child_11);
+                break;
+        }
+    }
+    return true;
+}
+
+}
+
+//..................................................................................................
+TermId NbeNormalizer::normalize(TermId root_id) {
+    // Thunks and frames don't outlive a call, since the arena may change in between.
+    thunks_.clear();
+    frames_.clear();
+    spine_cells_.clear();
+    continuations_.clear();
+    tasks_.clear();
+    results_.clear();
+
+    quote(evaluate(root_id, empty));
+    while (!tasks_.empty()) {
+        Task const task = tasks_.back();
+        tasks_.pop_back();
+        lambda::visit(
+            task,
+            [&](QuoteThunk quote_thunk) {
+                // Shared arguments are only quoted once.
+                std::optional<TermId> const normal_form = thunks_[quote_thunk.thunk].normal_form;
+                if (normal_form.has_value()) {
+                    results_.push_back(*normal_form);
+                    return;
+                }
+                tasks_.push_back(Memoize{quote_thunk.thunk});
+                quote(force(quote_thunk.thunk));
+            },
+            [&](BuildAbstraction build) {
+                TermId const body_id = results_.back();
+                results_.back() = arena_.make_abstraction(build.variable, body_id);
+            },
+            [&](BuildApplications build) {
+                auto const first = results_.end() - build.n_arguments;
+                TermId term_id = build.head;
+                for (auto itr = first; itr != results_.end(); ++itr) {
+                    term_id = arena_.make_application(term_id, *itr);
+                }
+                results_.erase(first, results_.end());
+                results_.push_back(term_id);
+            },
+            [&](Memoize memoize) {
+                thunks_[memoize.thunk].normal_form = results_.back();
+            }
+        );
+    }
+
+    TermId const normal_form_id = results_.back();
+    if (is_differential_) {
+        check(root_id, normal_form_id);
+    }
+    return normal_form_id;
+}
+
+//..................................................................................................
+uint32_t NbeNormalizer::make_thunk(TermId term, uint32_t environment) {
+    thunks_.push_back(Thunk{term, environment, std::nullopt, std::nullopt});
+    return static_cast<uint32_t>(thunks_.size() - 1);
+}
+
+//..................................................................................................
+uint32_t NbeNormalizer::make_frame(TermId variable, uint32_t thunk, uint32_t parent) {
+    frames_.push_back(Frame{variable, thunk, parent});
+    return static_cast<uint32_t>(frames_.size() - 1);
+}
+
+//..................................................................................................
+NbeNormalizer::Value NbeNormalizer::evaluate(TermId term, uint32_t environment) {
+    std::size_t const base = continuations_.size();
+    while (true) {
+        // Evaluate the term until it produces a value.
+        std::optional<Value> value;
+        auto const [child_0, child_1] = arena_.children(term);
+        switch (arena_.kind(term)) {
+            case TermKind::application:
+                continuations_.push_back(Apply{make_thunk(child_1, environment)});
+                term = child_0;
+                continue;
+            case TermKind::substitution: {
+                // An explicit substitution is just another frame of the environment.
+                auto const [variable_id, argument_id] = arena_.binding(term);
+                uint32_t const thunk = make_thunk(argument_id, environment);
+                environment = make_frame(variable_id, thunk, environment);
+                term = child_0;
+                continue;
+            }
+            case TermKind::abstraction:
+                value = Closure{term, environment};
+                break;
+            case TermKind::variable: {
+                uint32_t frame = environment;
+                while (frame != empty && frames_[frame].variable != term) {
+                    frame = frames_[frame].parent;
+                }
+                if (frame == empty) {
+                    value = Neutral{term, empty};
+                    break;
+                }
+                Thunk const& thunk = thunks_[frames_[frame].thunk];
+                if (thunk.value.has_value()) {
+                    value = *thunk.value;
+                    break;
+                }
+                continuations_.push_back(Update{frames_[frame].thunk});
+                term = thunk.term;
+                environment = thunk.environment;
+                continue;
+            }
+        }
+
+        // Pass the value to the continuations, until one of them has more to evaluate.
+        bool is_evaluating = false;
+        while (!is_evaluating) {
+            if (continuations_.size() == base) {
+                return *value;
+            }
+            Continuation const continuation = continuations_.back();
+            continuations_.pop_back();
+            if (Update const* update = std::get_if<Update>(&continuation)) {
+                thunks_[update->thunk].value = *value;
+                continue;
+            }
+
+            uint32_t const argument = std::get<Apply>(continuation).argument;
+            if (Closure const* closure = std::get_if<Closure>(&*value)) {
+                auto const [variable_id, body_id] = arena_.children(closure->abstraction);
+                ++n_applications_;
+                environment = make_frame(variable_id, argument, closure->environment);
+                term = body_id;
+                is_evaluating = true;
+            } else {
+                Neutral& neutral = std::get<Neutral>(*value);
+                spine_cells_.push_back(SpineCell{argument, neutral.spine});
+                neutral.spine = static_cast<uint32_t>(spine_cells_.size() - 1);
+            }
+        }
+    }
+}
+
+//..................................................................................................
+NbeNormalizer::Value NbeNormalizer::force(uint32_t thunk) {
+    if (!thunks_[thunk].value.has_value()) {
+        thunks_[thunk].value = evaluate(thunks_[thunk].term, thunks_[thunk].environment);
+    }
+    return *thunks_[thunk].value;
+}
+
+//..................................................................................................
+void NbeNormalizer::quote(Value const& value) {
+    // Closures are quoted by evaluating their bodies, which may produce more closures.
+    Value current = value;
+    while (Closure const* closure = std::get_if<Closure>(&current)) {
+        auto const [variable_id, body_id] = arena_.children(closure->abstraction);
+        TermId const new_variable_id = arena_.make_variable(arena_.symbol(variable_id));
+        uint32_t const thunk = make_thunk(new_variable_id, empty);
+        thunks_[thunk].value = Neutral{new_variable_id, empty};
+        tasks_.push_back(BuildAbstraction{new_variable_id});
+        current = evaluate(body_id, make_frame(variable_id, thunk, closure->environment));
+    }
+
+    // The spine starts with the last argument, so the first argument is pushed last and quoted
+    // first.
+    Neutral const neutral = std::get<Neutral>(current);
+    uint32_t n_arguments = 0;
+    for (uint32_t cell = neutral.spine; cell != empty; cell = spine_cells_[cell].next) {
+        ++n_arguments;
+    }
+    tasks_.push_back(BuildApplications{neutral.head, n_arguments});
+    for (uint32_t cell = neutral.spine; cell != empty; cell = spine_cells_[cell].next) {
+        tasks_.push_back(QuoteThunk{spine_cells_[cell].argument});
+    }
+}
+
+//..................................................................................................
+void NbeNormalizer::check(TermId root_id, TermId normal_form_id) const {
+    TermArena scratch;
+    std::unordered_map<TermId, TermId> copies;
+    TermId const copy_id = copy_term(arena_, root_id, scratch, copies);
+    TermId const expected_id = reduce_normal_order(scratch, copy_id);
+    if (!are_alpha_equivalent(arena_, normal_form_id, scratch, expected_id, copies)) {
+        throw std::runtime_error("Normalization by evaluation disagrees with reduce_normal_order");
+    }
+}
+
+}
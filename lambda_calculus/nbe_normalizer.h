@@ -0,0 +1,118 @@
+#ifndef LAMBDA_NBE_NORMALIZER_H
+#define LAMBDA_NBE_NORMALIZER_H
+
+#include "term_arena.h"
+#include "utils/stdint.h"
+#include <optional>
+#include <variant>
+#include <vector>
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// Normalization by evaluation. Terms are evaluated into a semantic domain of values: an
+// abstraction evaluates to a closure (the abstraction paired with the environment it was evaluated
+// in), and a free variable applied to arguments evaluates to a neutral value. Applying a closure
+// just extends its environment, so no term is ever copied or substituted into. Arguments are
+// evaluated lazily, and each one at most once.
+// The result is then quoted back into the arena. To quote a closure, its body is evaluated with
+// the variable bound to a new free variable, and quoted in turn; to quote a neutral value, its
+// arguments are quoted. Each argument is only quoted once, so the result shares structure wherever
+// the arguments did.
+// The normal form is the same one reduce_normal_order finds (up to alpha equivalence). In
+// differential mode, normalize checks this: it also reduces a copy of the term with
+// reduce_normal_order (in a separate arena, so the original is left alone), and throws if the
+// results differ.
+class NbeNormalizer {
+public:
+    explicit NbeNormalizer(TermArena& arena, bool is_differential = false)
+        : arena_(arena), is_differential_(is_differential) {}
+
+    // Builds the normal form of root_id in the arena, and returns its id. root_id is left as it is.
+    // This doesn't terminate if root_id doesn't have a normal form.
+    TermId normalize(TermId root_id);
+
+    // The number of closures that have been applied to arguments (that is, beta reductions), over
+    // all calls.
+    uint64_t n_applications() const { return n_applications_; }
+
+private:
+    static constexpr uint32_t empty = 0xFFFFFFFF;
+
+    struct Closure {
+        TermId abstraction;
+        uint32_t environment;
+    };
+
+    // A free variable applied to the thunks in a spine. Spines are linked lists that start with the
+    // last argument, so neutral values with a common prefix share their cells.
+    struct Neutral {
+        TermId head;
+        uint32_t spine;
+    };
+
+    using Value = std::variant<Closure, Neutral>;
+
+    struct Thunk {
+        TermId term;
+        uint32_t environment;
+        std::optional<Value> value;
+        std::optional<TermId> normal_form;
+    };
+
+    // Environments are linked lists of frames, each binding one variable to a thunk.
+    struct Frame {
+        TermId variable;
+        uint32_t thunk;
+        uint32_t parent;
+    };
+
+    struct SpineCell {
+        uint32_t argument;
+        uint32_t next;
+    };
+
+    // Evaluation is driven by an explicit stack of continuations: either apply the value to an
+    // argument, or store the value in a thunk.
+    struct Apply { uint32_t argument; };
+    struct Update { uint32_t thunk; };
+    using Continuation = std::variant<Apply, Update>;
+
+    struct QuoteThunk { uint32_t thunk; };
+    struct BuildAbstraction { TermId variable; };
+    struct BuildApplications { TermId head; uint32_t n_arguments; };
+    struct Memoize { uint32_t thunk; };
+    using Task = std::variant<QuoteThunk, BuildAbstraction, BuildApplications, Memoize>;
+
+    uint32_t make_thunk(TermId term, uint32_t environment);
+    uint32_t make_frame(TermId variable, uint32_t thunk, uint32_t parent);
+
+    // Evaluates term in the environment.
+    Value evaluate(TermId term, uint32_t environment);
+    // Evaluates the thunk (if it hasn't been already) and returns its value.
+    Value force(uint32_t thunk);
+
+    // Pushes the tasks that build the quoted form of value.
+    void quote(Value const& value);
+
+    // Throws if reduce_normal_order doesn't agree that normal_form_id is the normal form of
+    // root_id.
+    void check(TermId root_id, TermId normal_form_id) const;
+
+    TermArena& arena_;
+    bool is_differential_;
+
+    std::vector<Thunk> thunks_;
+    std::vector<Frame> frames_;
+    std::vector<SpineCell> spine_cells_;
+    std::vector<Continuation> continuations_;
+
+    std::vector<Task> tasks_;
+    std::vector<TermId> results_;
+
+    uint64_t n_applications_ = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef LAMBDA_PARENT_LIST_H
+#define LAMBDA_PARENT_LIST_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <memory_resource>
+#include "term_id.h"
+#include "utils/stdint.h"
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// A link from a term up to one of its parents. The slot says which child of the parent the term is:
+// 0 for the left term of an application, and 1 for the right term of an application or the body of
+// an abstraction. The two are packed into 32 bits, so term ids are limited to 31 bits.
+class ParentEdge {
+public:
+    ParentEdge() = default;
+    ParentEdge(TermId parent, uint32_t slot): packed_((parent.value() << 1) | slot) {}
+
+    TermId parent() const { return TermId{packed_ >> 1}; }
+    uint32_t slot() const { return packed_ & 1; }
+
+    bool operator==(ParentEdge rhs) const { return packed_ == rhs.packed_; }
+
+private:
+    uint32_t packed_;
+};
+
+//--------------------------------------------------------------------------------------------------
+// An unordered list of parent edges. The first few edges are stored inline, so most terms never
+// allocate. Edges are removed by position (the last edge is moved into the hole), so removal never
+// has to search the list. TermArena records where each edge lives, so that it can find them again.
+// Lists don't remember where their heap storage came from, so that they stay small: whatever grows
+// a list passes in a memory resource, and has to release the list to the same resource. Lists are
+// trivially destructible, so a resource that frees everything at once can skip releasing them.
+class ParentList {
+public:
+    static constexpr uint32_t inline_capacity = 2;
+
+    ParentList() = default;
+    ParentList(ParentList const&) = delete;
+    ParentList& operator=(ParentList const&) = delete;
+
+    // Frees the heap storage (if any), leaving the list empty.
+    void release(std::pmr::memory_resource& resource) {
+        if (!is_inline()) {
+            resource.deallocate(heap_, capacity_ * sizeof(ParentEdge), alignof(ParentEdge));
+            capacity_ = inline_capacity;
+        }
+        size_ = 0;
+    }
+
+    // Releases this list, and then takes over the edges and storage of that one, leaving it empty.
+    void take(ParentList& that, std::pmr::memory_resource& resource) {
+        if (this != &that) {
+            release(resource);
+            steal(that);
+        }
+    }
+
+    uint32_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool is_inline() const { return capacity_ == inline_capacity; }
+
+    ParentEdge const* begin() const { return data(); }
+    ParentEdge const* end() const { return data() + size_; }
+    ParentEdge operator[](uint32_t idx) const { return data()[idx]; }
+
+    // Returns the position of the new edge.
+    uint32_t push_back(ParentEdge edge, std::pmr::memory_resource& resource) {
+        if (size_ == capacity_) {
+            grow(resource);
+        }
+        data()[size_] = edge;
+        return size_++;
+    }
+
+    // Removes the edge at idx by moving the last edge into its place. If there was an edge moved,
+    // its new position is idx.
+    void remove(uint32_t idx) {
+        assert(idx < size_);
+        --size_;
+        data()[idx] = data()[size_];
+    }
+
+    // Keeps the first n edges.
+    void truncate(uint32_t n) { size_ = std::min(size_, n); }
+
+    // Once the list has spilled over to the heap, it keeps its heap storage. A term that has been
+    // heavily shared will likely be shared again.
+    void clear() { size_ = 0; }
+
+    ParentEdge* data() { return is_inline() ? inline_ : heap_; }
+    ParentEdge const* data() const { return is_inline() ? inline_ : heap_; }
+
+private:
+    void grow(std::pmr::memory_resource& resource) {
+        uint32_t const new_capacity = 2 * capacity_;
+        auto* const new_data = static_cast<ParentEdge*>(
+            resource.allocate(new_capacity * sizeof(ParentEdge), alignof(ParentEdge))
+        );
+        std::memcpy(new_data, data(), size_ * sizeof(ParentEdge));
+        uint32_t const size = size_;
+        release(resource);
+        size_ = size;
+        heap_ = new_data;
+        capacity_ = new_capacity;
+    }
+
+    void steal(ParentList& that) {
+        size_ = that.size_;
+        capacity_ = that.capacity_;
+        if (that.is_inline()) {
+            std::memcpy(inline_, that.inline_, sizeof(inline_));
+        } else {
+            heap_ = that.heap_;
+        }
+        that.size_ = 0;
+        that.capacity_ = inline_capacity;
+    }
+
+    uint32_t size_ = 0;
+    uint32_t capacity_ = inline_capacity;
+    union {
+        ParentEdge inline_[inline_capacity];
+        ParentEdge* heap_;
+    };
+};
+
+}
+
+#endif
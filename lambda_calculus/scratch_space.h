@@ -0,0 +1,83 @@
+#ifndef LAMBDA_SCRATCH_SPACE_H
+#define LAMBDA_SCRATCH_SPACE_H
+
+#include <memory>
+#include <vector>
+#include "utils/stdint.h"
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// A pool of reusable working storage (sets, maps, stacks, etc.) for traversals. Objects are
+// borrowed for the duration of a call and handed back when the lease goes out of scope, so once the
+// pool has warmed up, traversals don't allocate. Any type with a clear() method can be borrowed;
+// objects are cleared before they're lent out. Each TermArena owns one of these.
+class ScratchSpace {
+private:
+    struct PoolBase {
+        virtual ~PoolBase() = default;
+    };
+
+    template <typename T>
+    struct Pool : PoolBase {
+        std::vector<std::unique_ptr<T>> objects;
+        std::vector<T*> available;
+    };
+
+public:
+    template <typename T>
+    class Lease {
+    public:
+        Lease(Pool<T>& pool, T* object): pool_(pool), object_(object) {}
+        Lease(Lease const&) = delete;
+        Lease& operator=(Lease const&) = delete;
+        ~Lease() { pool_.available.push_back(object_); }
+
+        T& operator*() const { return *object_; }
+        T* operator->() const { return object_; }
+
+    private:
+        Pool<T>& pool_;
+        T* object_;
+    };
+
+    template <typename T>
+    Lease<T> borrow() {
+        Pool<T>& pool = get_pool<T>();
+        if (pool.available.empty()) {
+            pool.objects.push_back(std::make_unique<T>());
+            pool.available.push_back(pool.objects.back().get());
+        }
+        T* const object = pool.available.back();
+        pool.available.pop_back();
+        object->clear();
+        return Lease<T>(pool, object);
+    }
+
+private:
+    // Each type gets its own slot in pools_, numbered in order of first use.
+    template <typename T>
+    static uint32_t pool_index() {
+        static uint32_t const index = n_pool_types_++;
+        return index;
+    }
+
+    template <typename T>
+    Pool<T>& get_pool() {
+        uint32_t const index = pool_index<T>();
+        if (index >= pools_.size()) {
+            pools_.resize(index + 1);
+        }
+        if (!pools_[index]) {
+            pools_[index] = std::make_unique<Pool<T>>();
+        }
+        return static_cast<Pool<T>&>(*pools_[index]);
+    }
+
+    inline static uint32_t n_pool_types_ = 0;
+    std::vector<std::unique_ptr<PoolBase>> pools_;
+};
+
+}
+
+#endif
@@ -0,0 +1,51 @@
+#include "symbol_table.h"
+#include <stdexcept>
+
+namespace lambda {
+
+//..................................................................................................
+SymbolTable::SymbolTable(): starts_{0}, slots_(16, 0) {
+    intern(std::string_view());
+}
+
+//..................................................................................................
+Symbol SymbolTable::intern(std::string_view name) {
+    uint64_t const hash = std::hash<std::string_view>{}(name);
+    std::size_t const mask = slots_.size() - 1;
+    std::size_t slot = hash & mask;
+    while (slots_[slot] != 0) {
+        uint32_t const existing = slots_[slot] - 1;
+        if (hashes_[existing] == hash && this->name(Symbol(existing)) == name) {
+            return Symbol(existing);
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (pool_.size() + name.size() > 0xFFFFFFFF) {
+        throw std::runtime_error("Symbol table is full");
+    }
+    auto const idx = static_cast<uint32_t>(hashes_.size());
+    pool_.insert(pool_.end(), name.begin(), name.end());
+    starts_.push_back(static_cast<uint32_t>(pool_.size()));
+    hashes_.push_back(hash);
+    slots_[slot] = idx + 1;
+    if (2 * hashes_.size() > slots_.size()) {
+        grow();
+    }
+    return Symbol(idx);
+}
+
+//..................................................................................................
+void SymbolTable::grow() {
+    slots_.assign(2 * slots_.size(), 0);
+    std::size_t const mask = slots_.size() - 1;
+    for (uint32_t idx = 0; idx < hashes_.size(); ++idx) {
+        std::size_t slot = hashes_[idx] & mask;
+        while (slots_[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        slots_[slot] = idx + 1;
+    }
+}
+
+}
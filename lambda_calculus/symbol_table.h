@@ -0,0 +1,84 @@
+#ifndef LAMBDA_SYMBOL_TABLE_H
+#define LAMBDA_SYMBOL_TABLE_H
+
+#include "utils/stdint.h"
+#include <functional> // std::hash
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+class SymbolTable;
+
+//--------------------------------------------------------------------------------------------------
+// An interned name. Two symbols from the same table are equal exactly when their names are.
+class Symbol {
+public:
+    Symbol() = default;
+    uint32_t value() const { return idx; }
+
+    bool operator==(Symbol rhs) const { return idx == rhs.idx; }
+    bool operator<(Symbol rhs) const { return idx < rhs.idx; }
+
+private:
+    friend class SymbolTable;
+    explicit Symbol(uint32_t i): idx(i) {}
+
+    uint32_t idx = 0;
+};
+
+//--------------------------------------------------------------------------------------------------
+// Maps names to symbols. The characters of every name are copied into one pool, so the table
+// doesn't depend on the memory the names came from. Lookups use an open addressing hash table of
+// symbol values, which points back into the pool rather than holding strings of its own.
+// The symbol with value zero is always the empty name.
+class SymbolTable {
+public:
+    SymbolTable();
+
+    // Returns the symbol for name, adding it if it's new.
+    Symbol intern(std::string_view name);
+
+    // The view is only valid until the next name is added, since the pool may move when it grows.
+    std::string_view name(Symbol symbol) const {
+        uint32_t const start = starts_[symbol.value()];
+        return std::string_view(pool_.data() + start, starts_[symbol.value() + 1] - start);
+    }
+
+    std::size_t size() const { return hashes_.size(); }
+
+    // The pool, and where each name starts in it (followed by where the last one ends). Interning
+    // the names in order into an empty table reproduces the same symbols.
+    std::span<char const> pool() const { return pool_; }
+    std::span<uint32_t const> starts() const { return starts_; }
+
+private:
+    // Rebuilds the hash table with twice as many slots.
+    void grow();
+
+    // The names, back to back. Symbol i spans starts_[i] to starts_[i + 1].
+    std::vector<char> pool_;
+    std::vector<uint32_t> starts_;
+    std::vector<uint64_t> hashes_;
+    // Each slot holds one more than a symbol value, or zero if it's empty. The size is a power of
+    // two, and at most half the slots are used.
+    std::vector<uint32_t> slots_;
+};
+
+}
+
+namespace std {
+
+//--------------------------------------------------------------------------------------------------
+template <>
+struct hash<lambda::Symbol> {
+    std::size_t operator()(lambda::Symbol symbol) const {
+        return std::hash<uint32_t>{}(symbol.value());
+    }
+};
+
+}
+
+#endif
@@ -1,23 +1,91 @@
 #ifndef LAMBDA_TERM_H
 #define LAMBDA_TERM_H
 
+#include <array>
 #include <optional>
 #include <stdexcept>
-#include <string_view>
-#include <variant>
+#include <utility>
+#include "symbol_table.h"
 #include "term_id.h"
 #include "utils/overloaded.h"
+#include "utils/stdint.h"
 
 namespace lambda {
 
+//--------------------------------------------------------------------------------------------------
+enum class TermKind : uint8_t {
+    variable,
+    abstraction,
+    application,
+    substitution
+};
+
+//--------------------------------------------------------------------------------------------------
+// The shape of a term, packed into two 32-bit words. Ids only use 31 bits (see ParentEdge), so the
+// top bit of each word holds one bit of the kind. Abstractions store their variable and body,
+// applications their left and right terms, and substitutions their body and binding. Variables
+// have no children; the first word holds the abstraction that binds them instead, if there is one.
+// Their names are kept elsewhere.
+class PackedTerm {
+public:
+    PackedTerm() = default;
+
+    PackedTerm(TermKind kind, TermId child_0, TermId child_1)
+        : words_{
+            child_0.value() | (static_cast<uint32_t>(kind) & 1) << 31,
+            child_1.value() | (static_cast<uint32_t>(kind) >> 1) << 31
+        }
+    {}
+
+    static PackedTerm variable(std::optional<TermId> binder) {
+        PackedTerm result;
+        result.set_binder(binder);
+        return result;
+    }
+
+    TermKind kind() const {
+        return static_cast<TermKind>((words_[0] >> 31) | (words_[1] >> 31) << 1);
+    }
+
+    // Only meaningful for abstractions and applications.
+    std::array<TermId, 2> children() const {
+        return {TermId{words_[0] & id_mask}, TermId{words_[1] & id_mask}};
+    }
+    void set_child(uint32_t slot, TermId child) {
+        words_[slot] = (words_[slot] & ~id_mask) | child.value();
+    }
+
+    // Only meaningful for variables.
+    std::optional<TermId> binder() const {
+        if (words_[0] == no_binder) {
+            return std::nullopt;
+        }
+        return TermId{words_[0]};
+    }
+    void set_binder(std::optional<TermId> binder) {
+        words_[0] = binder.has_value() ? binder->value() : no_binder;
+    }
+
+    // Ids are below this, since the largest 31 bit id is reserved to mean that a variable is free.
+    static constexpr uint32_t max_terms = 0x7fffffff;
+
+private:
+    static constexpr uint32_t id_mask = 0x7fffffff;
+    static constexpr uint32_t no_binder = max_terms;
+
+    // The default is a free variable.
+    std::array<uint32_t, 2> words_ = {no_binder, 0};
+};
+
 //--------------------------------------------------------------------------------------------------
 struct Variable {
-    Variable(std::string_view n): name(n) {}
+    Variable(Symbol n): name(n) {}
     bool is_bound() const { return abstraction.has_value(); }
 
     // if this is a bound variable, this refers to the owning abstraction
     std::optional<TermId> abstraction;
-    std::string_view name;
+    // resolved through the symbol table of the arena
+    Symbol name;
 };
 
 //--------------------------------------------------------------------------------------------------
@@ -33,54 +101,87 @@ struct Application {
 };
 
 //--------------------------------------------------------------------------------------------------
-using LambdaVariant = std::variant<Variable, Abstraction, Application>;
+// An explicit substitution [x := N] M, which stands for M with x replaced by N, but hasn't been
+// carried out yet. The binding is an application (λx.P) N, which is where x and N come from: it's
+// the redex that the substitution was made from, and P is the body it started out at. Bindings are
+// shared by all the substitutions that are pushed down from the same one.
+struct Substitution {
+    TermId body;
+    TermId binding;
+};
 
 //--------------------------------------------------------------------------------------------------
-struct LambdaTerm {
-    std::vector<TermId> parents;
-    LambdaVariant data;
-
-    LambdaTerm(std::vector<TermId> p, LambdaVariant d): parents(std::move(p)), data(std::move(d)) {}
-
+// A single term, decoded from the columns of a TermArena. This is a copy, so modifying it doesn't
+// modify the arena. It also serves as the description of a term that hasn't been given an id yet.
+// It's a packed term plus a name (which only variables use), so it takes twelve bytes. Variable,
+// Abstraction, Application, and Substitution are unpacked on demand.
+class LambdaTerm {
+public:
+    explicit LambdaTerm(Variable variable)
+        : node_(PackedTerm::variable(variable.abstraction)), name_(variable.name) {}
+    explicit LambdaTerm(Abstraction abstraction)
+        : node_(TermKind::abstraction, abstraction.variable, abstraction.body) {}
+    explicit LambdaTerm(Application application)
+        : node_(TermKind::application, application.left, application.right) {}
+    explicit LambdaTerm(Substitution substitution)
+        : node_(TermKind::substitution, substitution.body, substitution.binding) {}
+
+    // Calls whichever visitor accepts the kind of this term. This is a switch on the kind, so it
+    // compiles to a jump table.
     template <typename... Visitors>
     constexpr decltype(auto) visit(Visitors&&... visitors) const {
-        return std::visit(overloaded{std::forward<Visitors>(visitors)...}, data);
+        overloaded visitor{std::forward<Visitors>(visitors)...};
+        switch (kind()) {
+            case TermKind::variable:
+                return visitor(get_variable());
+            case TermKind::abstraction:
+                return visitor(get_abstraction());
+            case TermKind::application:
+                return visitor(get_application());
+            case TermKind::substitution:
+                break;
+        }
+        return visitor(get_substitution());
     }
 
-    template <typename... Visitors>
-    constexpr decltype(auto) visit(Visitors&&... visitors) {
-        return std::visit(overloaded{std::forward<Visitors>(visitors)...}, data);
-    }
+    TermKind kind() const { return node_.kind(); }
+    bool is_variable() const { return kind() == TermKind::variable; }
+    bool is_abstraction() const { return kind() == TermKind::abstraction; }
+    bool is_applicaton() const { return kind() == TermKind::application; }
+    bool is_substitution() const { return kind() == TermKind::substitution; }
+
+    PackedTerm node() const { return node_; }
 
-    bool is_variable() const {
-        return visit([](Variable) { return true; }, [](auto) { return false; });
+    // These don't check the kind.
+    Variable get_variable() const {
+        Variable variable{name_};
+        variable.abstraction = node_.binder();
+        return variable;
     }
-    bool is_abstraction() const {
-        return visit([](Abstraction) { return true; }, [](auto) { return false; });
+    Abstraction get_abstraction() const {
+        auto const [variable, body] = node_.children();
+        return Abstraction{variable, body};
     }
-    bool is_applicaton() const {
-        return visit([](Application) { return true; }, [](auto) { return false; });
+    Application get_application() const {
+        auto const [left, right] = node_.children();
+        return Application{left, right};
+    }
+    Substitution get_substitution() const {
+        auto const [body, binding] = node_.children();
+        return Substitution{body, binding};
     }
-
-    Variable& get_variable() { return std::get<Variable>(data); }
-    Abstraction& get_abstraction() { return std::get<Abstraction>(data); }
-    Application& get_application() { return std::get<Application>(data); }
 
     // Throws an exception if this isn't a variable.
-    std::string_view get_name() const {
-        return visit(
-            [&](Variable variable) { return variable.name; },
-            [](auto) -> std::string_view { throw std::runtime_error("Expected variable"); }
-        );
+    Symbol get_name() const {
+        if (!is_variable()) {
+            throw std::runtime_error("Expected variable");
+        }
+        return name_;
     }
 
-    void add_parent(TermId parent_id) { parents.push_back(parent_id); }
-    void remove_parent(TermId parent_id) {
-        // This is linear time, but very cache friendly.
-        std::remove(parents.begin(), parents.end(), parent_id);
-        // Note that we only remove one occurence of parent_id. Others may remain.
-        parents.pop_back();
-    }
+private:
+    PackedTerm node_;
+    Symbol name_;
 };
 
 }
@@ -1,106 +1,1103 @@
 #include "term_arena.h"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <utility>
 
 namespace lambda {
 
+namespace {
+
+//--------------------------------------------------------------------------------------------------
+uint64_t hash_combine(uint64_t seed, uint64_t value) {
+    // This is the splitmix64 finalizer, applied to the seed and value mixed together.
+    uint64_t x = seed ^ (value + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2));
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+uint64_t constexpr variable_shape = 0x2545f4914f6cdd1d;
+
+// How many terms abstraction_free_variables looks at before it gives up on proving a term closed.
+constexpr uint32_t closed_search_budget = 32;
+
+//--------------------------------------------------------------------------------------------------
+// An arena image is a header followed by sections, each holding one array. Sections start on cache
+// line boundaries, so that every column is suitably aligned when the file is mapped.
+constexpr std::array<char, 8> image_magic = {'l', 'c', 'a', 'r', 'e', 'n', 'a', '\0'};
+constexpr uint32_t image_version = 3;
+constexpr uint64_t image_alignment = 64;
+
+constexpr uint32_t image_reference_counting = 1;
+constexpr uint32_t image_hash_consing = 2;
+
+enum class ImageSection : uint32_t {
+    nodes,
+    names,
+    parents,
+    free_variables,
+    shape_hashes,
+    hash_keys,
+    edge_positions,
+    // Parent lists that spilled onto the heap hold pointers, so their edges are saved here.
+    spilled_terms,
+    spilled_edges,
+    free_list,
+    symbol_pool,
+    symbol_starts,
+    count
+};
+
+constexpr auto n_image_sections = static_cast<std::size_t>(ImageSection::count);
+
+// Images hold the columns just as they are in memory, so they can only be read by builds that lay
+// them out the same way.
+constexpr std::array<uint32_t, 8> image_layout = {
+    std::endian::native == std::endian::little ? 1u : 2u,
+    sizeof(void*),
+    sizeof(PackedTerm),
+    sizeof(Symbol),
+    sizeof(ParentList),
+    sizeof(ParentEdge),
+    sizeof(FreeVariables),
+    sizeof(std::array<uint32_t, 2>)
+};
+
+struct ImageHeader {
+    std::array<char, 8> magic;
+    uint32_t version;
+    uint32_t flags;
+    std::array<uint32_t, image_layout.size()> layout;
+    // The position (in bytes) and number of elements of each section.
+    std::array<uint64_t, n_image_sections> offsets;
+    std::array<uint64_t, n_image_sections> counts;
+};
+
+//--------------------------------------------------------------------------------------------------
+// Returns the elements of a section of a mapped image, checking that they're within the file.
+template <typename T>
+std::span<T> image_section(
+    FileMapping const& image,
+    ImageHeader const& header,
+    ImageSection section
+) {
+    auto const idx = static_cast<std::size_t>(section);
+    uint64_t const offset = header.offsets[idx];
+    uint64_t const count = header.counts[idx];
+    if (offset % alignof(T) != 0 || offset > image.size() ||
+        count > (image.size() - offset) / sizeof(T)) {
+        throw std::runtime_error("Corrupt arena image");
+    }
+    return std::span<T>(reinterpret_cast<T*>(image.data() + offset), count);
+}
+
+}
+
+//..................................................................................................
+TermArena::TermArena(std::pmr::memory_resource* resource): resource_(resource) {}
+
+//..................................................................................................
+void TermArena::reserve(std::size_t capacity) {
+    nodes_.reserve(capacity);
+    names_.reserve(capacity);
+    parents_.reserve(capacity);
+    free_variables_.reserve(capacity);
+    shape_hashes_.reserve(capacity);
+    hash_keys_.reserve(capacity);
+    edge_positions_.reserve(capacity);
+}
+
+//..................................................................................................
+LambdaTerm TermArena::operator[](TermId idx) const {
+    PackedTerm const node = nodes_[idx.value()];
+    switch (node.kind()) {
+        case TermKind::variable: {
+            Variable variable{symbol(idx)};
+            variable.abstraction = node.binder();
+            return LambdaTerm{variable};
+        }
+        case TermKind::abstraction:
+            return LambdaTerm{Abstraction{node.children()[0], node.children()[1]}};
+        case TermKind::application:
+            return LambdaTerm{Application{node.children()[0], node.children()[1]}};
+        case TermKind::substitution:
+            return LambdaTerm{Substitution{node.children()[0], node.children()[1]}};
+    }
+    throw std::runtime_error("Corrupt term kind");
+}
+
+//..................................................................................................
+TermId TermArena::make_substitution(TermId body, TermId binding) {
+    if (hash_consing_) {
+        throw std::runtime_error("Substitutions can't be made while hash-consing");
+    }
+    if (!is_application(binding) || !is_abstraction(children(binding)[0])) {
+        throw std::runtime_error("Expected the binding to be a redex");
+    }
+    if (!are_substitutions_indexed_) {
+        index_substitutions();
+    }
+    auto const itr = substitutions_.find(substitution_key(body, binding));
+    if (itr != substitutions_.end()) {
+        return itr->second;
+    }
+    TermId const idx = construct(PackedTerm(TermKind::substitution, body, binding));
+    attach_edge(idx, 0);
+    attach_edge(idx, 1);
+    update_free_variables(idx);
+    substitutions_.emplace(substitution_key(body, binding), idx);
+    return idx;
+}
+
 //..................................................................................................
 void TermArena::replace_term(TermId old_id, TermId new_id) {
-    LambdaTerm& old_term = operator[](old_id);
-    uint32_t const n_parents = old_term.parents.size();
+    // Handles held by the caller move to the new term as well. Then the old term can be freed.
+    auto const retire_old_term = [this, old_id, new_id]() {
+        auto const itr = roots_.find(old_id);
+        if (itr != roots_.end()) {
+            roots_[new_id] += itr->second;
+            roots_.erase(old_id);
+        }
+        if (reference_counting_ && is_unreferenced(old_id)) {
+            free_term(old_id);
+        }
+    };
+
+    if (is_substitution(old_id)) {
+        forget_substitution(old_id);
+    }
+
+    ParentList& old_parents = parents_[old_id.value()];
+    uint32_t const n_parents = old_parents.size();
     if (n_parents == 0) {
+        retire_old_term();
         return;
     }
 
-    // This helper method remaps a single parent.
-    auto const remap_parent = [this, old_id, new_id](TermId parent_id) {
-        LambdaTerm& parent = operator[](parent_id);
-        parent.visit(
-            [](Variable) {
-                throw std::runtime_error("A variable cannot be a parent");
-            },
-            [old_id, new_id](Abstraction& abstraction) {
-                if (abstraction.body == old_id) {
-                    abstraction.body = new_id;
-                }
-            },
-            [old_id, new_id](Application& application) {
-                if (application.left == old_id) {
-                    application.left = new_id;
-                }
-                if (application.right == old_id) {
-                    application.right = new_id;
-                }
-            }
-        );
-    };
+    // Each edge knows exactly which child of its parent to remap.
+    for (ParentEdge edge : old_parents) {
+        nodes_[edge.parent().value()].set_child(edge.slot(), new_id);
+    }
 
-    // Note: if there are duplicate parents here we could skip them.
-    // This would be easy if we kept our parent lists sorted.
-    for (TermId parent_id : old_term.parents) {
-        remap_parent(parent_id);
+    // During beta reduction the new term never has free variables that the old one didn't. In any
+    // other case, the summaries of the parents may no longer cover their free variables.
+    if (!free_variables(new_id).is_subset_of(free_variables(old_id))) {
+        for (ParentEdge edge : old_parents) {
+            forget_free_variables(edge.parent());
+        }
     }
 
-    // Donate the old_term's parents to the new term.
-    LambdaTerm& new_term = operator[](new_id);
-    if (new_term.parents.size() == 0) {
-        new_term.parents = std::move(old_term.parents);
+    // Donate the old_term's parents to the new term. If the new term doesn't have any parents yet,
+    // we can take over the whole list, and the edges stay where they are.
+    ParentList& new_parents = parents_[new_id.value()];
+    if (new_parents.empty()) {
+        new_parents.take(old_parents, *parent_resource_);
     } else {
-        new_term.parents.insert(
-            new_term.parents.end(),
-            old_term.parents.begin(),
-            old_term.parents.end()
-        );
+        for (ParentEdge edge : old_parents) {
+            edge_positions_[edge.parent().value()][edge.slot()] =
+                new_parents.push_back(edge, *parent_resource_);
+        }
     }
-    old_term.parents.clear();
+    old_parents.clear();
 
     // If the old term is a bound variable, we also have to update its abstraction.
-    if (old_term.is_variable()) {
-        if (!new_term.is_variable()) {
+    if (is_variable(old_id)) {
+        if (!is_variable(new_id)) {
             throw std::runtime_error("Bound variables can only be replaced with other variables");
         }
 
-        Variable& old_variable = old_term.get_variable();
-        if (old_variable.abstraction.has_value()) {
-            TermId abstraction_id = old_variable.abstraction.value();
-            Abstraction& abstraction = operator[](abstraction_id).get_abstraction();
-            if (abstraction.variable != old_id) {
+        std::optional<TermId> const old_binder = binder(old_id);
+        if (old_binder.has_value()) {
+            PackedTerm& abstraction = nodes_[old_binder->value()];
+            if (abstraction.children()[0] != old_id) {
                 throw std::runtime_error("Can't replace corrupt bound variable");
             }
-            old_variable.abstraction.reset();
-            abstraction.variable = new_id;
+            nodes_[old_id.value()].set_binder(std::nullopt);
+            abstraction.set_child(0, new_id);
         }
     }
+
+    retire_old_term();
 }
 
 //..................................................................................................
-void TermArena::replace_application(TermId old_id, LambdaTerm new_term) {
-    LambdaTerm& term = operator[](old_id);
+void TermArena::replace_application(TermId old_id, LambdaTerm const& new_term) {
+    if (!is_application(old_id) && !is_substitution(old_id)) {
+        throw std::runtime_error("Expected application or substitution");
+    }
+    std::array<TermId, 2> const old_children = children(old_id);
+    if (hash_consing_) {
+        unshare(old_id);
+    }
+    if (is_substitution(old_id)) {
+        forget_substitution(old_id);
+    }
 
     // Remove the current children.
-    term.visit(
-        [this, old_id](Application& application) {
-            operator[](application.left).remove_parent(old_id);
-            operator[](application.right).remove_parent(old_id);
+    detach_edge(old_id, 0);
+    detach_edge(old_id, 1);
+
+    // Attach the new children. They didn't know about their parent yet, since it didn't have an id.
+    new_term.visit(
+        [](Variable) {
+            throw std::runtime_error("Can't replace an application with a variable");
+        },
+        [&](Abstraction abstraction) {
+            nodes_[old_id.value()] =
+                PackedTerm(TermKind::abstraction, abstraction.variable, abstraction.body);
+            bind_variable(abstraction.variable, old_id);
+            attach_edge(old_id, 1);
         },
-        [](auto) {
-            throw std::runtime_error("Expected application");
+        [&](Application application) {
+            nodes_[old_id.value()] =
+                PackedTerm(TermKind::application, application.left, application.right);
+            attach_edge(old_id, 0);
+            attach_edge(old_id, 1);
+        },
+        [&](Substitution substitution) {
+            if (hash_consing_) {
+                throw std::runtime_error("Substitutions can't be made while hash-consing");
+            }
+            nodes_[old_id.value()] =
+                PackedTerm(TermKind::substitution, substitution.body, substitution.binding);
+            attach_edge(old_id, 0);
+            attach_edge(old_id, 1);
+            if (are_substitutions_indexed_) {
+                substitutions_.try_emplace(
+                    substitution_key(substitution.body, substitution.binding),
+                    old_id
+                );
+            }
         }
     );
 
-    // Attach the new children.
-    term.data = new_term.data;
+    // During beta reduction the new term can't have any free variables that the old one didn't, so
+    // this only makes the summary more precise. Otherwise the ancestors have to forget theirs.
+    FreeVariables const old_free_variables = free_variables(old_id);
+    update_free_variables(old_id);
+    if (!free_variables(old_id).is_subset_of(old_free_variables)) {
+        forget_free_variables(old_id);
+    }
+    if (hash_consing_) {
+        share(old_id);
+    }
 
-    // The children of new_term didn't know about their parent yet, since it didn't have an id.
-    term.visit(
-        [](Variable) {},
-        [&](Abstraction& abstraction) {
-            bind_variable(abstraction.variable, old_id);
-            operator[](abstraction.body).add_parent(old_id);
-        },
-        [&](Application& application) {
-            operator[](application.left).add_parent(old_id);
-            operator[](application.right).add_parent(old_id);
+    // We only free the old children once the new ones are attached, so that we don't free any terms
+    // that the new children refer to.
+    if (reference_counting_) {
+        for (TermId child_id : old_children) {
+            if (is_unreferenced(child_id)) {
+                free_term(child_id);
+            }
         }
-    );
+    }
+}
+
+//..................................................................................................
+bool TermArena::substitute_in_place(TermId variable_id, TermId argument_id) {
+    std::optional<TermId> const abstraction_id = binder(variable_id);
+    bool const occurs_once = parents(variable_id).size() == 1;
+    if (!is_variable(variable_id) || !abstraction_id.has_value() || !occurs_once) {
+        throw std::runtime_error("Expected a bound variable that occurs once");
+    }
+    ParentEdge const occurrence = parents(variable_id)[0];
+    TermId const parent_id = occurrence.parent();
+
+    // Walk up from the occurrence to the abstraction. Each term is finished after its parents, so
+    // in reverse order every term comes before its parents, and its summary can be recomputed from
+    // those of its children.
+    struct StackEntry {
+        TermId term;
+        bool entered;
+    };
+    auto const stack_lease = scratch_.borrow<std::vector<StackEntry>>();
+    std::vector<StackEntry>& stack = *stack_lease;
+    auto const visited_lease = scratch_.borrow<TermSet>();
+    TermSet& visited = *visited_lease;
+    auto const finished_lease = scratch_.borrow<std::vector<TermId>>();
+    std::vector<TermId>& finished = *finished_lease;
+    stack.push_back({parent_id, false});
+    while (!stack.empty()) {
+        StackEntry& entry = stack.back();
+        TermId const term_id = entry.term;
+        if (entry.entered) {
+            finished.push_back(term_id);
+            stack.pop_back();
+            continue;
+        }
+        if (term_id == *abstraction_id || !visited.insert(term_id)) {
+            stack.pop_back();
+            continue;
+        }
+        // The caller holds on to this term, so it can't change.
+        if (is_root(term_id)) {
+            return false;
+        }
+        // Note that entry is invalidated as soon as we push to the stack.
+        entry.entered = true;
+        for (ParentEdge edge : parents(term_id)) {
+            stack.push_back({edge.parent(), false});
+        }
+    }
+
+    // The hash-consing keys of the rewritten terms depend on what's beneath them, so they're taken
+    // out of the table while they change. The occurrence's parent is among them.
+    if (hash_consing_) {
+        for (TermId term_id : finished) {
+            unshare(term_id);
+        }
+    }
+    detach_edge(parent_id, occurrence.slot());
+    nodes_[parent_id.value()].set_child(occurrence.slot(), argument_id);
+    attach_edge(parent_id, occurrence.slot());
+    for (auto itr = finished.rbegin(); itr != finished.rend(); ++itr) {
+        update_free_variables(*itr);
+        if (hash_consing_) {
+            share(*itr);
+        }
+        if (rewrite_callback_) {
+            rewrite_callback_(*itr);
+        }
+    }
+    return true;
+}
+
+//..................................................................................................
+std::vector<std::optional<TermId>> TermArena::collect(std::span<TermId const> roots) {
+    // Mark everything reachable from the roots. We follow the links from bound variables to their
+    // abstractions too, so that a variable never outlives the abstraction that binds it.
+    std::vector<bool> is_live(size(), false);
+    std::vector<TermId> stack(roots.begin(), roots.end());
+    for (auto const& [root_id, count] : roots_) {
+        stack.push_back(root_id);
+    }
+    while (!stack.empty()) {
+        TermId const term_id = stack.back();
+        stack.pop_back();
+        if (is_live[term_id.value()]) {
+            continue;
+        }
+        is_live[term_id.value()] = true;
+
+        if (is_variable(term_id)) {
+            if (binder(term_id).has_value()) {
+                stack.push_back(binder(term_id).value());
+            }
+        } else {
+            stack.push_back(children(term_id)[0]);
+            stack.push_back(children(term_id)[1]);
+        }
+    }
+
+    // Assign new ids. Since live terms keep their relative order, each one moves down (or stays).
+    std::vector<std::optional<TermId>> remap(size());
+    uint32_t n_live = 0;
+    for (uint32_t i = 0; i < size(); ++i) {
+        if (is_live[i]) {
+            remap[i] = TermId{n_live};
+            ++n_live;
+        }
+    }
+
+    // Move the live terms into place, and fix up all the ids they store. Children of live terms are
+    // always live, but parents need not be.
+    auto const new_id = [&remap](TermId old_id) { return remap[old_id.value()].value(); };
+    for (uint32_t i = 0; i < size(); ++i) {
+        if (!is_live[i]) {
+            continue;
+        }
+
+        ParentList& parents = parents_[i];
+        ParentEdge* const edges = parents.data();
+        auto const live_end = std::remove_if(
+            edges,
+            edges + parents.size(),
+            [&is_live](ParentEdge edge) { return !is_live[edge.parent().value()]; }
+        );
+        parents.truncate(live_end - edges);
+        for (uint32_t j = 0; j < parents.size(); ++j) {
+            edges[j] = ParentEdge{new_id(edges[j].parent()), edges[j].slot()};
+        }
+
+        PackedTerm& node = nodes_[i];
+        if (node.kind() == TermKind::variable) {
+            if (node.binder().has_value()) {
+                node.set_binder(new_id(node.binder().value()));
+            }
+        } else {
+            auto const [child_0, child_1] = node.children();
+            node = PackedTerm(node.kind(), new_id(child_0), new_id(child_1));
+        }
+
+        // Summaries can mention variables that no longer occur in the term, and may have been
+        // freed.
+        free_variables_[i] = free_variables_[i].remapped(
+            [&remap](TermId variable_id) { return remap[variable_id.value()]; }
+        );
+
+        uint32_t const new_idx = remap[i]->value();
+        if (new_idx != i) {
+            nodes_[new_idx] = nodes_[i];
+            names_[new_idx] = names_[i];
+            parents_[new_idx].take(parents_[i], *parent_resource_);
+            free_variables_[new_idx] = free_variables_[i];
+            shape_hashes_[new_idx] = shape_hashes_[i];
+        }
+    }
+
+    // Since dead edges were dropped, the remaining ones may have moved.
+    for (uint32_t i = 0; i < n_live; ++i) {
+        for (uint32_t j = 0; j < parents_[i].size(); ++j) {
+            ParentEdge const edge = parents_[i][j];
+            edge_positions_[edge.parent().value()][edge.slot()] = j;
+        }
+    }
+    for (uint32_t i = n_live; i < size(); ++i) {
+        parents_[i].release(*parent_resource_);
+    }
+    nodes_.resize(n_live);
+    names_.resize(n_live);
+    parents_.resize(n_live);
+    free_variables_.resize(n_live);
+    shape_hashes_.resize(n_live);
+    hash_keys_.resize(n_live);
+    edge_positions_.resize(n_live);
+
+    // Freed terms are never reachable, so the free list is now empty.
+    free_list_.clear();
+    std::unordered_map<TermId, uint32_t> new_roots;
+    for (auto const& [root_id, count] : roots_) {
+        new_roots.emplace(new_id(root_id), count);
+    }
+    roots_ = std::move(new_roots);
+
+    // Ids have changed, so the substitutions have to be filed under new keys once they're needed.
+    substitutions_.clear();
+    are_substitutions_indexed_ = false;
+
+    // Free variable ids have changed, so the keys have to be recomputed.
+    if (hash_consing_) {
+        hash_cons_table_.clear();
+        for (uint32_t i = 0; i < n_live; ++i) {
+            if (nodes_[i].kind() != TermKind::variable) {
+                share(TermId{i});
+            }
+        }
+    }
+    discarded_terms_.clear();
+
+    return remap;
+}
+
+//..................................................................................................
+void TermArena::remove_root(TermId term_id) {
+    auto const itr = roots_.find(term_id);
+    if (itr == roots_.end()) {
+        throw std::runtime_error("Term is not a root");
+    }
+    if (--itr->second == 0) {
+        roots_.erase(itr);
+        if (reference_counting_ && is_unreferenced(term_id)) {
+            free_term(term_id);
+        }
+    }
+}
+
+//..................................................................................................
+void TermArena::remove_parent(TermId child_id, TermId parent_id) {
+    std::array<TermId, 2> const& parent_children = children(parent_id);
+    bool const has_two_children = is_application(parent_id) || is_substitution(parent_id);
+    if (has_two_children && parent_children[0] == child_id) {
+        detach_edge(parent_id, 0);
+    } else if (!is_variable(parent_id) && parent_children[1] == child_id) {
+        detach_edge(parent_id, 1);
+    } else {
+        throw std::runtime_error("Term is not a parent of the child");
+    }
+    if (reference_counting_ && is_unreferenced(child_id)) {
+        free_term(child_id);
+    }
+}
+
+//..................................................................................................
+void TermArena::enable_hash_consing() {
+    if (size() != 0) {
+        throw std::runtime_error("Hash-consing has to be enabled before any terms are made");
+    }
+    hash_consing_ = true;
+}
+
+//..................................................................................................
+void TermArena::begin_rewrite(TermId term_id) {
+    rewrite_root_ = term_id;
+    rewrite_ancestors_found_ = false;
+}
+
+//..................................................................................................
+void TermArena::end_rewrite() {
+    rewrite_root_.reset();
+    // Discarded terms are only recorded when reference counting. Some of them may have found a
+    // parent since, or been freed along with another discarded term.
+    for (TermId term_id : discarded_terms_) {
+        if (is_unreferenced(term_id)) {
+            free_term(term_id);
+        }
+    }
+    discarded_terms_.clear();
+}
+
+//..................................................................................................
+TermId TermArena::construct(PackedTerm node) {
+    if (!free_list_.empty()) {
+        TermId const idx = free_list_.back();
+        free_list_.pop_back();
+        nodes_[idx.value()] = node;
+        return idx;
+    }
+
+    if (size() >= PackedTerm::max_terms) {
+        throw std::runtime_error("Too many terms");
+    }
+    auto const idx = static_cast<uint32_t>(size());
+    nodes_.push_back(node);
+    names_.emplace_back();
+    parents_.emplace_back();
+    free_variables_.emplace_back();
+    shape_hashes_.emplace_back();
+    hash_keys_.emplace_back();
+    edge_positions_.emplace_back();
+    return idx;
+}
+
+//..................................................................................................
+void TermArena::detach_edge(TermId parent_id, uint32_t slot) {
+    TermId const child_id = children(parent_id)[slot];
+    ParentList& parents = parents_[child_id.value()];
+    uint32_t const position = edge_positions_[parent_id.value()][slot];
+    parents.remove(position);
+
+    // The last edge was moved into the hole, so we have to tell its parent where it went.
+    if (position < parents.size()) {
+        ParentEdge const moved_edge = parents[position];
+        edge_positions_[moved_edge.parent().value()][moved_edge.slot()] = position;
+    }
+}
+
+//..................................................................................................
+FreeVariables TermArena::abstraction_free_variables(TermId variable_id, TermId body_id) const {
+    FreeVariables const result = free_variables(body_id).without(variable_id);
+    if (result.is_exact()) {
+        return result;
+    }
+
+    // Look for a free variable that isn't bound on the way down from the abstraction. Terms whose
+    // summaries are exact are checked without looking inside them. Each entry on the stack holds
+    // the number of binders on the way down to it. A shared term is looked at once for each way
+    // down, since what's bound above it can differ.
+    auto const stack_lease = scratch_.borrow<std::vector<std::pair<TermId, uint32_t>>>();
+    auto const binders_lease = scratch_.borrow<std::vector<TermId>>();
+    std::vector<std::pair<TermId, uint32_t>>& stack = *stack_lease;
+    std::vector<TermId>& binders = *binders_lease;
+    binders.push_back(variable_id);
+    stack.emplace_back(body_id, 1);
+    uint32_t budget = closed_search_budget;
+    while (!stack.empty()) {
+        auto const [term_id, n_binders] = stack.back();
+        stack.pop_back();
+        binders.resize(n_binders);
+        FreeVariables const summary = free_variables(term_id);
+        if (summary.is_exact()) {
+            for (TermId free_variable : summary.variables()) {
+                if (std::find(binders.begin(), binders.end(), free_variable) == binders.end()) {
+                    return result;
+                }
+            }
+            continue;
+        }
+        if (budget-- == 0) {
+            return result;
+        }
+        auto const [child_0, child_1] = children(term_id);
+        switch (kind(term_id)) {
+            case TermKind::abstraction:
+                binders.push_back(child_0);
+                stack.emplace_back(child_1, n_binders + 1);
+                break;
+            case TermKind::application:
+                stack.emplace_back(child_0, n_binders);
+                stack.emplace_back(child_1, n_binders);
+                break;
+            case TermKind::variable:
+            case TermKind::substitution:
+                // Variables always have exact summaries. Substitutions bind their variable
+                // somewhere else, so they're left alone.
+                return result;
+        }
+    }
+    return FreeVariables::closed();
+}
+
+//..................................................................................................
+void TermArena::forget_free_variables(TermId term_id) {
+    auto const stack_lease = scratch_.borrow<std::vector<TermId>>();
+    std::vector<TermId>& stack = *stack_lease;
+    stack.push_back(term_id);
+    while (!stack.empty()) {
+        TermId const id = stack.back();
+        stack.pop_back();
+        // If this summary is already unknown, so are those of all the ancestors.
+        if (!free_variables_[id.value()].is_exact()) {
+            continue;
+        }
+        free_variables_[id.value()] = FreeVariables::unknown();
+        for (ParentEdge edge : parents(id)) {
+            stack.push_back(edge.parent());
+        }
+    }
+}
+
+//..................................................................................................
+uint64_t TermArena::shape_hash(TermId term_id) const {
+    return is_variable(term_id) ? variable_shape : shape_hashes_[term_id.value()];
+}
+
+//..................................................................................................
+TermArena::StructuralHash TermArena::structural_hash(
+    TermKind kind,
+    TermId child_0,
+    TermId child_1,
+    FreeVariables free_variables
+) const {
+    StructuralHash hash;
+    hash.shape = (kind == TermKind::abstraction)
+        ? hash_combine(1, shape_hash(child_1))
+        : hash_combine(hash_combine(2, shape_hash(child_0)), shape_hash(child_1));
+    hash.key = hash.shape;
+    if (free_variables.is_exact()) {
+        for (TermId variable_id : free_variables.variables()) {
+            hash.key = hash_combine(hash.key, variable_id.value());
+        }
+    } else {
+        hash.key = hash_combine(hash.key, FreeVariables::capacity + 1);
+    }
+    return hash;
+}
+
+//..................................................................................................
+std::optional<TermId> TermArena::find_shared(TermKind kind, TermId child_0, TermId child_1) {
+    FreeVariables const free_variables = (kind == TermKind::abstraction)
+        ? abstraction_free_variables(child_0, child_1)
+        : this->free_variables(child_0).merged_with(this->free_variables(child_1));
+    uint64_t const key = structural_hash(kind, child_0, child_1, free_variables).key;
+
+    auto const [begin, end] = hash_cons_table_.equal_range(key);
+    for (auto itr = begin; itr != end; ++itr) {
+        TermId const existing_id = itr->second;
+        if (
+            this->kind(existing_id) != kind ||
+            is_rewrite_ancestor(existing_id) ||
+            !is_alpha_equivalent(kind, child_0, child_1, existing_id)
+        ) {
+            continue;
+        }
+        if (reference_counting_ && rewrite_root_.has_value()) {
+            discarded_terms_.push_back(child_0);
+            discarded_terms_.push_back(child_1);
+        }
+        return existing_id;
+    }
+    return std::nullopt;
+}
+
+//..................................................................................................
+bool TermArena::is_alpha_equivalent(
+    TermKind kind,
+    TermId child_0,
+    TermId child_1,
+    TermId existing_id
+) const {
+    using TermPair = std::pair<TermId, TermId>;
+    auto const stack_lease = scratch_.borrow<std::vector<TermPair>>();
+    auto const bound_lease = scratch_.borrow<std::vector<TermPair>>();
+    // Pairs of terms that still have to be compared.
+    std::vector<TermPair>& stack = *stack_lease;
+    // Pairs of variables bound by corresponding abstractions. Variables are only bound once, and
+    // only occur beneath their abstractions, so these never have to be removed.
+    std::vector<TermPair>& bound = *bound_lease;
+
+    auto const [existing_0, existing_1] = children(existing_id);
+    if (kind == TermKind::abstraction) {
+        bound.emplace_back(child_0, existing_0);
+    } else {
+        stack.emplace_back(child_0, existing_0);
+    }
+    stack.emplace_back(child_1, existing_1);
+
+    while (!stack.empty()) {
+        auto const [left, right] = stack.back();
+        stack.pop_back();
+
+        // A term is equivalent to itself, unless it contains a variable that's bound differently
+        // on each side.
+        if (left == right) {
+            bool const contains_bound_variable = std::any_of(
+                bound.begin(),
+                bound.end(),
+                [&](TermPair pair) {
+                    return may_contain(left, pair.first) || may_contain(left, pair.second);
+                }
+            );
+            if (!contains_bound_variable) {
+                continue;
+            }
+        }
+
+        if (this->kind(left) != this->kind(right)) {
+            return false;
+        }
+        auto const [left_0, left_1] = children(left);
+        auto const [right_0, right_1] = children(right);
+        switch (this->kind(left)) {
+            case TermKind::variable: {
+                // Bound variables have to be bound by corresponding abstractions. Other variables
+                // have to be the same.
+                auto const pair = std::find_if(
+                    bound.begin(),
+                    bound.end(),
+                    [&](TermPair pair) { return pair.first == left || pair.second == right; }
+                );
+                if (pair != bound.end()) {
+                    if (pair->first != left || pair->second != right) {
+                        return false;
+                    }
+                } else if (left != right) {
+                    return false;
+                }
+                break;
+            }
+            case TermKind::abstraction:
+                bound.emplace_back(left_0, right_0);
+                stack.emplace_back(left_1, right_1);
+                break;
+            case TermKind::application:
+                stack.emplace_back(left_0, right_0);
+                stack.emplace_back(left_1, right_1);
+                break;
+            case TermKind::substitution:
+                // Substitutions are never hash-consed, so they only match themselves.
+                return false;
+        }
+    }
+    return true;
+}
+
+//..................................................................................................
+bool TermArena::is_rewrite_ancestor(TermId term_id) {
+    if (!rewrite_root_.has_value()) {
+        return false;
+    }
+    if (!rewrite_ancestors_found_) {
+        rewrite_ancestors_.clear();
+        rewrite_ancestors_.insert(*rewrite_root_);
+        auto const stack_lease = scratch_.borrow<std::vector<TermId>>();
+        std::vector<TermId>& stack = *stack_lease;
+        stack.push_back(*rewrite_root_);
+        while (!stack.empty()) {
+            TermId const id = stack.back();
+            stack.pop_back();
+            for (ParentEdge edge : parents(id)) {
+                if (rewrite_ancestors_.insert(edge.parent())) {
+                    stack.push_back(edge.parent());
+                }
+            }
+        }
+        rewrite_ancestors_found_ = true;
+    }
+    return rewrite_ancestors_.contains(term_id);
+}
+
+//..................................................................................................
+void TermArena::share(TermId term_id) {
+    auto const [child_0, child_1] = children(term_id);
+    StructuralHash const hash =
+        structural_hash(kind(term_id), child_0, child_1, free_variables(term_id));
+    shape_hashes_[term_id.value()] = hash.shape;
+    hash_keys_[term_id.value()] = hash.key;
+    hash_cons_table_.emplace(hash.key, term_id);
+}
+
+//..................................................................................................
+void TermArena::unshare(TermId term_id) {
+    auto const [begin, end] = hash_cons_table_.equal_range(hash_keys_[term_id.value()]);
+    for (auto itr = begin; itr != end; ++itr) {
+        if (itr->second == term_id) {
+            hash_cons_table_.erase(itr);
+            return;
+        }
+    }
+}
+
+//..................................................................................................
+void TermArena::index_substitutions() {
+    auto const n_terms = static_cast<uint32_t>(nodes_.size());
+    for (uint32_t i = 0; i < n_terms; ++i) {
+        if (nodes_[i].kind() == TermKind::substitution) {
+            auto const [body, binding] = nodes_[i].children();
+            substitutions_.try_emplace(substitution_key(body, binding), TermId{i});
+        }
+    }
+    are_substitutions_indexed_ = true;
+}
+
+//..................................................................................................
+void TermArena::forget_substitution(TermId term_id) {
+    auto const [body, binding] = children(term_id);
+    auto const itr = substitutions_.find(substitution_key(body, binding));
+    if (itr != substitutions_.end() && itr->second == term_id) {
+        substitutions_.erase(itr);
+    }
+}
+
+//..................................................................................................
+bool TermArena::is_unreferenced(TermId term_id) const {
+    if (!parents(term_id).empty() || roots_.contains(term_id)) {
+        return false;
+    }
+    // Bound variables belong to their abstractions.
+    return !(is_variable(term_id) && binder(term_id).has_value());
+}
+
+//..................................................................................................
+void TermArena::free_term(TermId term_id) {
+    free_stack_.push_back(term_id);
+    while (!free_stack_.empty()) {
+        TermId const id = free_stack_.back();
+        free_stack_.pop_back();
+
+        // Cut this term loose from its children, and queue up any that are orphaned as a result.
+        auto const release_child = [this, id](uint32_t slot) {
+            TermId const child_id = children(id)[slot];
+            detach_edge(id, slot);
+            if (is_unreferenced(child_id)) {
+                free_stack_.push_back(child_id);
+            }
+        };
+        switch (kind(id)) {
+            case TermKind::variable:
+                // A bound variable is only queued by its abstraction. We queue it before the body,
+                // so by the time we get here all the occurrences in the body have been released.
+                nodes_[id.value()].set_binder(std::nullopt);
+                break;
+            case TermKind::abstraction:
+                free_stack_.push_back(children(id)[0]);
+                release_child(1);
+                break;
+            case TermKind::substitution:
+                forget_substitution(id);
+                release_child(0);
+                release_child(1);
+                break;
+            case TermKind::application:
+                release_child(0);
+                release_child(1);
+                break;
+        }
+        if (!parents(id).empty()) {
+            continue;
+        }
+
+        if (free_callback_) {
+            free_callback_(id);
+        }
+        if (hash_consing_ && kind(id) != TermKind::variable) {
+            unshare(id);
+        }
+        nodes_[id.value()] = PackedTerm::variable(id);
+        names_[id.value()] = {};
+        free_list_.push_back(id);
+    }
+}
+
+//..................................................................................................
+void TermArena::save_image(char const* path) const {
+    std::vector<uint32_t> spilled_terms;
+    std::vector<ParentEdge> spilled_edges;
+    for (uint32_t i = 0; i < size(); ++i) {
+        if (!parents_[i].is_inline()) {
+            spilled_terms.push_back(i);
+            spilled_edges.insert(spilled_edges.end(), parents_[i].begin(), parents_[i].end());
+        }
+    }
+    std::vector<uint32_t> free_list;
+    for (TermId term_id : free_list_) {
+        free_list.push_back(term_id.value());
+    }
+
+    // Each section is written in parts: columns are written a chunk at a time.
+    struct Section {
+        std::vector<std::span<std::byte const>> parts;
+        uint64_t count;
+    };
+    std::array<Section, n_image_sections> sections;
+    auto const add_column = [&sections](ImageSection section, auto const& column) {
+        Section& result = sections[static_cast<std::size_t>(section)];
+        for (std::size_t i = 0; i < column.n_chunks(); ++i) {
+            result.parts.push_back(std::as_bytes(column.chunk(i)));
+        }
+        result.count = column.size();
+    };
+    auto const add_array = [&sections]<typename T>(ImageSection section, std::span<T const> array) {
+        sections[static_cast<std::size_t>(section)] = Section{{std::as_bytes(array)}, array.size()};
+    };
+    add_column(ImageSection::nodes, nodes_);
+    add_column(ImageSection::names, names_);
+    add_column(ImageSection::parents, parents_);
+    add_column(ImageSection::free_variables, free_variables_);
+    add_column(ImageSection::shape_hashes, shape_hashes_);
+    add_column(ImageSection::hash_keys, hash_keys_);
+    add_column(ImageSection::edge_positions, edge_positions_);
+    add_array(ImageSection::spilled_terms, std::span<uint32_t const>(spilled_terms));
+    add_array(ImageSection::spilled_edges, std::span<ParentEdge const>(spilled_edges));
+    add_array(ImageSection::free_list, std::span<uint32_t const>(free_list));
+    add_array(ImageSection::symbol_pool, symbols_.pool());
+    add_array(ImageSection::symbol_starts, symbols_.starts());
+
+    ImageHeader header{};
+    header.magic = image_magic;
+    header.version = image_version;
+    header.flags = (reference_counting_ ? image_reference_counting : 0) |
+        (hash_consing_ ? image_hash_consing : 0);
+    header.layout = image_layout;
+    auto const align = [](uint64_t offset) {
+        return (offset + image_alignment - 1) / image_alignment * image_alignment;
+    };
+    uint64_t offset = align(sizeof(ImageHeader));
+    for (std::size_t i = 0; i < n_image_sections; ++i) {
+        header.offsets[i] = offset;
+        header.counts[i] = sections[i].count;
+        for (std::span<std::byte const> part : sections[i].parts) {
+            offset += part.size();
+        }
+        offset = align(offset);
+    }
+
+    std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+    if (!stream) {
+        throw std::runtime_error(std::string("Couldn't open ") + path);
+    }
+    uint64_t position = 0;
+    auto const write = [&stream, &position](std::span<std::byte const> bytes) {
+        stream.write(reinterpret_cast<char const*>(bytes.data()), std::ssize(bytes));
+        position += bytes.size();
+    };
+    write(std::as_bytes(std::span<ImageHeader const>(&header, 1)));
+    std::array<std::byte, image_alignment> const padding = {};
+    for (std::size_t i = 0; i < n_image_sections; ++i) {
+        write(std::span<std::byte const>(padding.data(), header.offsets[i] - position));
+        for (std::span<std::byte const> part : sections[i].parts) {
+            write(part);
+        }
+    }
+    if (!stream.flush()) {
+        throw std::runtime_error(std::string("Couldn't write ") + path);
+    }
+}
+
+//..................................................................................................
+TermArena TermArena::map_image(char const* path, std::pmr::memory_resource* resource) {
+    return TermArena(FileMapping::map(path), resource);
+}
+
+//..................................................................................................
+TermArena::TermArena(FileMapping image, std::pmr::memory_resource* resource)
+    : image_(std::move(image))
+    , resource_(resource)
+{
+    ImageHeader header;
+    if (image_.size() < sizeof(ImageHeader)) {
+        throw std::runtime_error("Not an arena image");
+    }
+    std::memcpy(&header, image_.data(), sizeof(ImageHeader));
+    if (header.magic != image_magic) {
+        throw std::runtime_error("Not an arena image");
+    }
+    if (header.version != image_version) {
+        throw std::runtime_error("Unsupported arena image version");
+    }
+    if (header.layout != image_layout) {
+        throw std::runtime_error("Arena image was written by a build with a different layout");
+    }
+
+    // The columns are used in place.
+    uint64_t const n_terms = header.counts[static_cast<std::size_t>(ImageSection::nodes)];
+    if (n_terms > PackedTerm::max_terms) {
+        throw std::runtime_error("Corrupt arena image");
+    }
+    auto const map_column = [this, &header, n_terms](ImageSection section, auto& column) {
+        using T = std::remove_reference_t<decltype(column[0])>;
+        std::span<T> const elements = image_section<T>(image_, header, section);
+        if (elements.size() != n_terms) {
+            throw std::runtime_error("Corrupt arena image");
+        }
+        column.set_base(elements.data(), static_cast<uint32_t>(n_terms));
+    };
+    map_column(ImageSection::nodes, nodes_);
+    map_column(ImageSection::names, names_);
+    map_column(ImageSection::parents, parents_);
+    map_column(ImageSection::free_variables, free_variables_);
+    map_column(ImageSection::shape_hashes, shape_hashes_);
+    map_column(ImageSection::hash_keys, hash_keys_);
+    map_column(ImageSection::edge_positions, edge_positions_);
+
+    // Lists that had spilled onto the heap still have their sizes, but their pointers are stale.
+    auto const spilled_terms =
+        image_section<uint32_t>(image_, header, ImageSection::spilled_terms);
+    auto const spilled_edges =
+        image_section<ParentEdge>(image_, header, ImageSection::spilled_edges);
+    std::size_t n_edges = 0;
+    for (uint32_t const term_idx : spilled_terms) {
+        if (term_idx >= n_terms || parents_[term_idx].size() > spilled_edges.size() - n_edges) {
+            throw std::runtime_error("Corrupt arena image");
+        }
+        ParentList& parents = parents_[term_idx];
+        uint32_t const n_parents = parents.size();
+        std::construct_at(&parents);
+        for (uint32_t i = 0; i < n_parents; ++i) {
+            parents.push_back(spilled_edges[n_edges++], *parent_resource_);
+        }
+    }
+
+    auto const free_list = image_section<uint32_t>(image_, header, ImageSection::free_list);
+    for (uint32_t const term_idx : free_list) {
+        free_list_.push_back(TermId{term_idx});
+    }
+
+    // The symbol table is small next to the terms, and has to be growable, so it's copied.
+    auto const pool = image_section<char>(image_, header, ImageSection::symbol_pool);
+    auto const starts = image_section<uint32_t>(image_, header, ImageSection::symbol_starts);
+    for (std::size_t i = 1; i + 1 < starts.size(); ++i) {
+        if (starts[i] > starts[i + 1] || starts[i + 1] > pool.size()) {
+            throw std::runtime_error("Corrupt arena image");
+        }
+        std::string_view const name(pool.data() + starts[i], starts[i + 1] - starts[i]);
+        if (symbols_.intern(name).value() != i) {
+            throw std::runtime_error("Corrupt arena image");
+        }
+    }
+
+    reference_counting_ = (header.flags & image_reference_counting) != 0;
+    hash_consing_ = (header.flags & image_hash_consing) != 0;
+    are_substitutions_indexed_ = false;
+    if (hash_consing_) {
+        for (uint32_t i = 0; i < n_terms; ++i) {
+            if (nodes_[i].kind() != TermKind::variable) {
+                share(TermId{i});
+            }
+        }
+    }
 }
 
 }
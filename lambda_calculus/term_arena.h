@@ -1,37 +1,166 @@
 #ifndef LAMBDA_TERM_ARENA_H
 #define LAMBDA_TERM_ARENA_H
 
+#include <array>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <span>
+#include <unordered_map>
 #include <vector>
+#include "free_variables.h"
+#include "parent_list.h"
+#include "scratch_space.h"
+#include "symbol_table.h"
 #include "term.h"
+#include "term_column.h"
+#include "term_set.h"
+#include "utils/file_mapping.h"
+#include "utils/page_resource.h"
 
 namespace lambda {
 
 //--------------------------------------------------------------------------------------------------
+// Terms are stored as a structure of arrays. The kind and children of each term are packed into
+// eight bytes (see PackedTerm) in a column of their own, so traversals that only need the shape of
+// the graph touch eight bytes per term, and eight terms share a cache line. Variables keep their
+// binder there too, in place of children.
+// Columns are made of fixed-size chunks that never move, so making terms never relocates existing
+// ones, and references into the arena (such as those returned by parents) stay valid until their
+// terms are freed or collected.
+// Names, parent lists, and the rest are kept in side columns. Names are interned in a symbol table
+// that the arena owns, so variables only hold a symbol, and terms don't depend on where their names
+// came from. Each edge from a parent to a child is also recorded in the child's parent list, and
+// the parent remembers where, so edges can be removed in constant time. Every term also carries a
+// summary of its free variables, so traversals can skip subterms that can't depend on a given
+// variable.
 class TermArena {
 public:
-    void reserve(std::size_t capacity) { pool_.reserve(capacity); }
-    std::size_t size() const { return pool_.size(); }
+    TermArena(): TermArena(std::pmr::get_default_resource()) {}
 
-    TermId make_variable(std::string_view name) {
-        return construct(std::vector<TermId>{}, Variable{name});
+    // The columns are allocated from resource, a chunk at a time, and so are parent lists that
+    // spill over to the heap (through a pool, so they can be reused once they're freed). Pass a
+    // PageResource to back a large arena with huge pages. The resource has to outlive the arena.
+    explicit TermArena(std::pmr::memory_resource* resource);
+
+    // Writes the arena to a file as an image. The columns are written just as they are laid out in
+    // memory, so the image can be mapped back in directly. Images are only readable by builds with
+    // the same layout; roots and callbacks aren't saved.
+    void save_image(char const* path) const;
+
+    // Maps an image written by save_image. The terms of the image keep their ids, and stay in the
+    // mapped file: the mapping is private, so pages are read when they're touched, and only copied
+    // if the terms on them are modified. New terms go after them, in memory the arena owns. Apart
+    // from copying the names into the symbol table, loading takes time proportional to the number
+    // of parent lists that had spilled onto the heap (and to the number of terms, if the arena is
+    // hash-consing, since the table has to be rebuilt). Only the header of the image is checked, so
+    // the image has to be trusted. Throws if it can't be read, or was written by a different build.
+    static TermArena map_image(
+        char const* path,
+        std::pmr::memory_resource* resource = std::pmr::get_default_resource()
+    );
+
+    // Allocates storage for capacity terms up front. This is never needed for correctness.
+    void reserve(std::size_t capacity);
+    // This includes freed terms that are waiting to be reused.
+    std::size_t size() const { return nodes_.size(); }
+    std::size_t n_free_terms() const { return free_list_.size(); }
+
+    TermId make_variable(std::string_view name) { return make_variable(intern(name)); }
+
+    TermId make_variable(Symbol name) {
+        TermId const idx = construct(PackedTerm::variable(std::nullopt));
+        names_[idx.value()] = name;
+        free_variables_[idx.value()] = FreeVariables::single(idx);
+        return idx;
     }
 
     TermId make_abstraction(TermId var, TermId body) {
-        TermId const idx = construct(std::vector<TermId>{}, Abstraction{var, body});
+        if (hash_consing_) {
+            std::optional<TermId> const existing = find_shared(TermKind::abstraction, var, body);
+            if (existing.has_value()) {
+                return *existing;
+            }
+        }
+        TermId const idx = construct(PackedTerm(TermKind::abstraction, var, body));
         bind_variable(var, idx);
-        operator[](body).parents.push_back(idx);
+        attach_edge(idx, 1);
+        update_free_variables(idx);
+        if (hash_consing_) {
+            share(idx);
+        }
         return idx;
     }
 
     TermId make_application(TermId left, TermId right) {
-        TermId const idx = construct(std::vector<TermId>{}, Application{left, right});
-        operator[](left).parents.push_back(idx);
-        operator[](right).parents.push_back(idx);
+        if (hash_consing_) {
+            std::optional<TermId> const existing = find_shared(TermKind::application, left, right);
+            if (existing.has_value()) {
+                return *existing;
+            }
+        }
+        TermId const idx = construct(PackedTerm(TermKind::application, left, right));
+        attach_edge(idx, 0);
+        attach_edge(idx, 1);
+        update_free_variables(idx);
+        if (hash_consing_) {
+            share(idx);
+        }
         return idx;
     }
 
-    LambdaTerm& operator[](TermId idx) { return pool_[idx.value()]; }
-    LambdaTerm const& operator[](TermId idx) const { return pool_[idx.value()]; }
+    // Substitutions are made during lazy reduction, so they're never hash-consed: this throws if
+    // the arena is hash-consing. It also throws if the binding isn't an application of an
+    // abstraction. If there's already a substitution of body with the same binding, that one is
+    // returned instead, so a shared term that a substitution is pushed into along several paths
+    // stays shared.
+    TermId make_substitution(TermId body, TermId binding);
+
+    TermKind kind(TermId idx) const { return nodes_[idx.value()].kind(); }
+    bool is_variable(TermId idx) const { return kind(idx) == TermKind::variable; }
+    bool is_abstraction(TermId idx) const { return kind(idx) == TermKind::abstraction; }
+    bool is_application(TermId idx) const { return kind(idx) == TermKind::application; }
+    bool is_substitution(TermId idx) const { return kind(idx) == TermKind::substitution; }
+
+    // For abstractions these are the variable and the body. For applications they are the left and
+    // right terms, and for substitutions the body and the binding. Variables don't have children.
+    std::array<TermId, 2> children(TermId idx) const { return nodes_[idx.value()].children(); }
+
+    // For substitutions, the variable that is replaced and the term that replaces it, as read from
+    // the binding.
+    std::array<TermId, 2> binding(TermId idx) const {
+        auto const [function_id, argument_id] = children(children(idx)[1]);
+        return {children(function_id)[0], argument_id};
+    }
+
+    // If idx is a bound variable, this returns the abstraction that binds it.
+    std::optional<TermId> binder(TermId idx) const { return nodes_[idx.value()].binder(); }
+
+    // Only meaningful for variables.
+    Symbol symbol(TermId idx) const { return names_[idx.value()]; }
+    // The view is only valid until the next name is interned (by make_variable, for instance).
+    std::string_view name(TermId idx) const { return symbols_.name(symbol(idx)); }
+
+    Symbol intern(std::string_view name) { return symbols_.intern(name); }
+    SymbolTable const& symbols() const { return symbols_; }
+
+    ParentList const& parents(TermId idx) const { return parents_[idx.value()]; }
+
+    // The variables that may occur free in idx. Closed terms have exact (empty) summaries.
+    FreeVariables free_variables(TermId idx) const { return free_variables_[idx.value()]; }
+
+    // Returns false only if variable_id definitely doesn't occur in idx.
+    bool may_contain(TermId idx, TermId variable_id) const {
+        return free_variables(idx).may_contain(variable_id);
+    }
+
+    // Assembles a copy of a term from the columns.
+    LambdaTerm operator[](TermId idx) const;
+
+    // Working storage for traversals. This is available from const arenas, since borrowing scratch
+    // space doesn't change any terms.
+    ScratchSpace& scratch() const { return scratch_; }
 
     // Replaces old_id with new_id. Specifically, all the parents of old_id are remapped to point to
     // new_id, and new_id has its parent list updated accordingly. The parent list of old_id is
@@ -40,31 +169,230 @@ public:
 
     // Replaces old_id with new_id. Specifically, all the children of old_id are cut loose, and
     // replaced with those of new_term. The parents of old_id remain intact. This method expects
-    // old_id to be an application, since I only use this during beta reduction.
-    void replace_application(TermId old_id, LambdaTerm new_term);
+    // old_id to be an application or a substitution, since I only use this during beta reduction
+    // (and when substitutions are pushed inward).
+    void replace_application(TermId old_id, LambdaTerm const& new_term);
 
-private:
-    template <class... Args>
-    TermId construct(Args&&... args) {
-        auto const idx = static_cast<uint32_t>(pool_.size());
-        pool_.emplace_back(std::forward<Args>(args)...);
-        return idx;
+    // Replaces the only occurrence of a bound variable with argument_id, by pointing the parent of
+    // the occurrence at it. Nothing is copied, so every term between the occurrence and the
+    // abstraction is changed in place, and the caller has to make sure that none of them can be
+    // reached other than through the abstraction (which is left binding a variable that no longer
+    // occurs). Their free variable summaries are recomputed, and the rewrite callback is invoked
+    // for each of them. If any of them is a registered root, nothing is changed and this returns
+    // false. Throws if the variable isn't bound, or doesn't occur exactly once.
+    bool substitute_in_place(TermId variable_id, TermId argument_id);
+
+    // Frees every term that can't be reached from roots. Live terms are moved to the front of the
+    // pool (keeping their relative order), and their children, parents, and abstractions are
+    // updated to match. Parents that weren't reachable are dropped from the parent lists. The
+    // returned table is indexed by old id values; it holds the new id of each live term, and
+    // nothing for terms that were freed. Every TermId held outside the arena (including the roots)
+    // has to be remapped through it.
+    // Registered roots are treated as roots as well, and are remapped automatically.
+    std::vector<std::optional<TermId>> collect(std::span<TermId const> roots);
+
+    // When reference counting is enabled, the number of parents of each term serves as its
+    // reference count. As soon as a term loses its last parent (through replace_term,
+    // replace_application, or remove_parent) it is freed, along with any children that are
+    // orphaned as a result. Bound variables are freed along with their abstractions. Registered
+    // roots are never freed, so any term that the caller holds on to has to be registered. Freed
+    // slots are reused before the pool grows. Reference counting is off by default, in which case
+    // nothing is freed until collect is called.
+    void enable_reference_counting() { reference_counting_ = true; }
+    bool is_reference_counting() const { return reference_counting_; }
+
+    // Roots are counted, so a term registered twice has to be removed twice. Removing the last
+    // registration of a term that has no parents frees it.
+    void add_root(TermId term_id) { ++roots_[term_id]; }
+    void remove_root(TermId term_id);
+    bool is_root(TermId term_id) const { return roots_.contains(term_id); }
+
+    // Removes one edge from parent_id to child_id. Throws if there isn't one.
+    void remove_parent(TermId child_id, TermId parent_id);
+
+    // The callback is invoked with the id of each term just before it is freed. Anything that
+    // caches information about terms by id (such as the set of reduced terms in
+    // reduce_normal_order) should use this to stay valid when ids are reused.
+    void set_free_callback(std::function<void(TermId)> callback) {
+        free_callback_ = std::move(callback);
+    }
+
+    // The callback is invoked with the id of each term that substitute_in_place changes, so that
+    // anything that caches information about what's beneath a term can drop it.
+    void set_rewrite_callback(std::function<void(TermId)> callback) {
+        rewrite_callback_ = std::move(callback);
     }
 
+    // When hash-consing is enabled, make_abstraction and make_application return an existing term
+    // whenever there is one that is alpha-equivalent to the requested term. The variable and body
+    // (or left and right terms) that were passed in are then left without a parent. Variables are
+    // never shared, since each one stands for its own binding. This has to be enabled before any
+    // terms are made.
+    void enable_hash_consing();
+    bool is_hash_consing() const { return hash_consing_; }
+
+    // Reduction rewrites terms in place. While term_id is being rewritten, hash-consing won't hand
+    // out term_id or any of its ancestors, since they would end up inside their own replacement.
+    // When reference counting, terms that were passed to make_* but left without a parent because
+    // an existing term was shared instead are freed at the end of the rewrite. (Before then the
+    // caller may still attach them elsewhere.) beta_reduce brackets each reduction with these.
+    void begin_rewrite(TermId term_id);
+    void end_rewrite();
+
+private:
+    TermArena(FileMapping image, std::pmr::memory_resource* resource);
+
+    TermId construct(PackedTerm node);
+
     void bind_variable(TermId variable_id, TermId abstraction_id) {
-        LambdaTerm& variable_term = operator[](variable_id);
-        variable_term.visit(
-            [abstraction_id](Variable& variable) {
-                if (variable.abstraction.has_value()) {
-                    throw std::runtime_error("Variable is already bound");
-                }
-                variable.abstraction = abstraction_id;
-            },
-            [](auto) { throw std::runtime_error("Expected variable"); }
-        );
+        if (kind(variable_id) != TermKind::variable) {
+            throw std::runtime_error("Expected variable");
+        }
+        PackedTerm& node = nodes_[variable_id.value()];
+        if (node.binder().has_value()) {
+            throw std::runtime_error("Variable is already bound");
+        }
+        node.set_binder(abstraction_id);
+    }
+
+    // Adds the edge from the given slot of parent_id to the parent list of the child in that slot.
+    void attach_edge(TermId parent_id, uint32_t slot) {
+        TermId const child_id = children(parent_id)[slot];
+        edge_positions_[parent_id.value()][slot] =
+            parents_[child_id.value()].push_back(ParentEdge{parent_id, slot}, *parent_resource_);
+    }
+
+    // Removes the edge from the given slot of parent_id from the parent list of the child in that
+    // slot. This doesn't free anything.
+    void detach_edge(TermId parent_id, uint32_t slot);
+
+    // Recomputes the free variable summary of an abstraction, application, or substitution from
+    // its children. A substitution's summary only covers its body and argument.
+    void update_free_variables(TermId term_id) {
+        auto const [child_0, child_1] = children(term_id);
+        FreeVariables& result = free_variables_[term_id.value()];
+        switch (kind(term_id)) {
+            case TermKind::abstraction:
+                result = abstraction_free_variables(child_0, child_1);
+                break;
+            case TermKind::application:
+                result = free_variables(child_0).merged_with(free_variables(child_1));
+                break;
+            case TermKind::substitution: {
+                auto const [variable_id, argument_id] = binding(term_id);
+                result = free_variables(child_0).without(variable_id)
+                    .merged_with(free_variables(argument_id));
+                break;
+            }
+            case TermKind::variable:
+                // Variables keep the summary they were made with.
+                break;
+        }
+    }
+
+    // The summary of an abstraction of variable_id over body_id. If it would be unknown, this looks
+    // a little way into the body, so that closed combinators with more than FreeVariables::capacity
+    // variables are still known to be closed.
+    FreeVariables abstraction_free_variables(TermId variable_id, TermId body_id) const;
+
+    // Marks the summaries of term_id and all its ancestors as unknown. This is needed when a term
+    // is replaced by one that may have more free variables.
+    void forget_free_variables(TermId term_id);
+
+    // Hashes that only depend on the shape of a term and its free variables, so alpha-equivalent
+    // terms always collide. The shape hash treats all variables alike; the key (which is what the
+    // table is indexed by) mixes in the free variables when they are known. The hashes of a term
+    // are computed when it is made, and aren't updated when its descendants are rewritten. This
+    // only means that some sharing is missed, since candidates are always compared structurally.
+    struct StructuralHash {
+        uint64_t shape;
+        uint64_t key;
+    };
+    uint64_t shape_hash(TermId term_id) const;
+    StructuralHash structural_hash(
+        TermKind kind,
+        TermId child_0,
+        TermId child_1,
+        FreeVariables free_variables
+    ) const;
+
+    // Looks for an existing term that is alpha-equivalent to the given abstraction or application.
+    std::optional<TermId> find_shared(TermKind kind, TermId child_0, TermId child_1);
+
+    // Returns true if the abstraction or application with the given children is alpha-equivalent
+    // to existing_id.
+    bool is_alpha_equivalent(
+        TermKind kind,
+        TermId child_0,
+        TermId child_1,
+        TermId existing_id
+    ) const;
+
+    // Returns true if term_id is the term being rewritten or one of its ancestors.
+    bool is_rewrite_ancestor(TermId term_id);
+
+    // Adds term_id to (or removes it from) the hash-consing table.
+    void share(TermId term_id);
+    void unshare(TermId term_id);
+
+    // Substitutions are looked up by body and binding, packed into one key. A substitution is
+    // forgotten once it's pushed, replaced, or freed. After an image is mapped or the arena is
+    // collected, the table is only filled in when the next substitution is made, so arenas that
+    // never make one don't pay for a pass over every term.
+    static uint64_t substitution_key(TermId body, TermId binding) {
+        return (uint64_t{body.value()} << 32) | binding.value();
     }
+    void index_substitutions();
+    void forget_substitution(TermId term_id);
+
+    // Returns true if term_id has no parents, isn't a root, and isn't a bound variable. Freed terms
+    // are marked as variables bound to themselves, so they never count as unreferenced.
+    bool is_unreferenced(TermId term_id) const;
+
+    // Frees term_id (which must be unreferenced), and everything that is orphaned as a result.
+    void free_term(TermId term_id);
+
+    // If the arena was loaded from an image, the columns start with the terms in it. This is
+    // declared first so that it outlives them.
+    FileMapping image_;
+
+    std::pmr::memory_resource* resource_;
+    // Parent lists are never released one by one when the arena is destroyed: the pool frees all
+    // their storage at once. It's held by pointer so that the arena can be moved.
+    std::unique_ptr<std::pmr::unsynchronized_pool_resource> parent_resource_ =
+        std::make_unique<std::pmr::unsynchronized_pool_resource>(resource_);
+
+    Column<PackedTerm> nodes_{resource_};
+    Column<Symbol> names_{resource_};
+    Column<ParentList> parents_{resource_};
+    Column<FreeVariables> free_variables_{resource_};
+    Column<uint64_t> shape_hashes_{resource_};
+    Column<uint64_t> hash_keys_{resource_};
+    // For each child slot of each term, the position of the corresponding edge in the child's
+    // parent list.
+    Column<std::array<uint32_t, 2>> edge_positions_{resource_};
+
+    bool reference_counting_ = false;
+    std::vector<TermId> free_list_;
+    std::vector<TermId> free_stack_;
+    std::unordered_map<TermId, uint32_t> roots_;
+    std::function<void(TermId)> free_callback_;
+    std::function<void(TermId)> rewrite_callback_;
+
+    bool hash_consing_ = false;
+    std::unordered_multimap<uint64_t, TermId> hash_cons_table_;
+    std::optional<TermId> rewrite_root_;
+    // The ancestors of the term being rewritten are only found if a lookup needs them.
+    bool rewrite_ancestors_found_ = false;
+    TermSet rewrite_ancestors_;
+    std::vector<TermId> discarded_terms_;
+
+    std::unordered_map<uint64_t, TermId> substitutions_;
+    bool are_substitutions_indexed_ = true;
+
+    SymbolTable symbols_;
 
-    std::vector<LambdaTerm> pool_;
+    mutable ScratchSpace scratch_;
 };
 
 }
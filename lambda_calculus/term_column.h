@@ -0,0 +1,160 @@
+#ifndef LAMBDA_TERM_COLUMN_H
+#define LAMBDA_TERM_COLUMN_H
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "term_id.h"
+#include "utils/stdint.h"
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// One column of a TermArena. Elements are stored in fixed-size chunks, which are allocated as the
+// column grows and never move, so references to elements stay valid until the elements themselves
+// are destroyed, and growing never copies anything. Element i is at offset i % chunk_size of chunk
+// i / chunk_size, which is exactly how a TermId splits up.
+// The column can also start with a base: elements that live in memory the column doesn't own, such
+// as a mapped arena image. Whole chunks of the base are used where they are. The elements of the
+// last, partial chunk are relocated into a chunk the column owns, so that the column can grow past
+// them. Elements of the base are destroyed along with the column (or when it shrinks), but the
+// memory they live in has to outlive the column.
+template <typename T>
+class Column {
+public:
+    static constexpr uint32_t chunk_bits = TermId::chunk_bits;
+    static constexpr uint32_t chunk_size = TermId::chunk_size;
+
+    Column(): Column(std::pmr::get_default_resource()) {}
+    // Chunks are allocated from resource, which has to outlive the column.
+    explicit Column(std::pmr::memory_resource* resource): resource_(resource) {}
+    Column(Column const&) = delete;
+    Column& operator=(Column const&) = delete;
+    Column(Column&& that) noexcept
+        : resource_(that.resource_)
+        , chunks_(std::move(that.chunks_))
+        , n_borrowed_chunks_(std::exchange(that.n_borrowed_chunks_, 0))
+        , size_(std::exchange(that.size_, 0))
+    {
+        that.chunks_.clear();
+    }
+    Column& operator=(Column&& that) noexcept {
+        if (this != &that) {
+            release();
+            resource_ = that.resource_;
+            chunks_ = std::move(that.chunks_);
+            that.chunks_.clear();
+            n_borrowed_chunks_ = std::exchange(that.n_borrowed_chunks_, 0);
+            size_ = std::exchange(that.size_, 0);
+        }
+        return *this;
+    }
+    ~Column() { release(); }
+
+    // The column has to be empty. The elements have to be constructed already, and be safe to
+    // relocate with memcpy (as everything in an image is).
+    void set_base(T* base, uint32_t size) {
+        uint32_t const n_full_chunks = size / chunk_size;
+        for (uint32_t i = 0; i < n_full_chunks; ++i) {
+            chunks_.push_back(base + std::size_t{i} * chunk_size);
+        }
+        n_borrowed_chunks_ = n_full_chunks;
+        uint32_t const n_remaining = size % chunk_size;
+        if (n_remaining > 0) {
+            T* const chunk = allocate_chunk();
+            std::memcpy(
+                static_cast<void*>(chunk),
+                static_cast<void const*>(base + std::size_t{n_full_chunks} * chunk_size),
+                n_remaining * sizeof(T)
+            );
+            chunks_.push_back(chunk);
+        }
+        size_ = size;
+    }
+
+    std::size_t size() const { return size_; }
+
+    T& operator[](std::size_t idx) { return chunks_[idx >> chunk_bits][idx & (chunk_size - 1)]; }
+    T const& operator[](std::size_t idx) const {
+        return chunks_[idx >> chunk_bits][idx & (chunk_size - 1)];
+    }
+
+    // Allocates chunks up front. Chunks are kept when the column shrinks.
+    void reserve(std::size_t capacity) {
+        while (chunks_.size() * chunk_size < capacity) {
+            chunks_.push_back(allocate_chunk());
+        }
+    }
+
+    void push_back(T const& value) { emplace_back(value); }
+
+    template <typename... Args>
+    void emplace_back(Args&&... args) {
+        if (size_ == chunks_.size() * chunk_size) {
+            chunks_.push_back(allocate_chunk());
+        }
+        std::construct_at(&(*this)[size_], std::forward<Args>(args)...);
+        ++size_;
+    }
+
+    void resize(std::size_t size) {
+        if (size < size_) {
+            destroy_from(size);
+            return;
+        }
+        reserve(size);
+        for (; size_ < size; ++size_) {
+            std::construct_at(&(*this)[size_]);
+        }
+    }
+
+    // The elements in order, as one span per chunk.
+    std::size_t n_chunks() const { return (size_ + chunk_size - 1) / chunk_size; }
+    std::span<T const> chunk(std::size_t chunk_idx) const {
+        std::size_t const start = chunk_idx * chunk_size;
+        return std::span<T const>(
+            chunks_[chunk_idx],
+            std::min<std::size_t>(size_ - start, chunk_size)
+        );
+    }
+
+private:
+    T* allocate_chunk() {
+        return static_cast<T*>(resource_->allocate(chunk_size * sizeof(T), alignof(T)));
+    }
+
+    // Destroys the elements from new_size on, and drops them from the column.
+    void destroy_from(std::size_t new_size) {
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            for (std::size_t i = new_size; i < size_; ++i) {
+                std::destroy_at(&(*this)[i]);
+            }
+        }
+        size_ = new_size;
+    }
+
+    // Destroys every element, and frees the chunks the column owns.
+    void release() {
+        destroy_from(0);
+        for (std::size_t i = n_borrowed_chunks_; i < chunks_.size(); ++i) {
+            resource_->deallocate(chunks_[i], chunk_size * sizeof(T), alignof(T));
+        }
+        chunks_.clear();
+        n_borrowed_chunks_ = 0;
+    }
+
+    std::pmr::memory_resource* resource_;
+    std::vector<T*> chunks_;
+    // The first chunks may point into the base, in which case they aren't freed.
+    std::size_t n_borrowed_chunks_ = 0;
+    std::size_t size_ = 0;
+};
+
+}
+
+#endif
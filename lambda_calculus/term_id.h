@@ -8,18 +8,29 @@ namespace lambda {
 
 //--------------------------------------------------------------------------------------------------
 class TermArena;
+class PackedTerm;
+class ParentEdge;
 
 //--------------------------------------------------------------------------------------------------
+// Terms are stored in fixed-size chunks that never move, so an id is a chunk number (the high bits)
+// and an offset within that chunk (the low bits). Ids are still dense, and ordered by value.
 class TermId {
 public:
+    static constexpr uint32_t chunk_bits = 12;
+    static constexpr uint32_t chunk_size = uint32_t{1} << chunk_bits;
+
     TermId() = default;
     uint32_t value() const { return idx; }
+    uint32_t chunk() const { return idx >> chunk_bits; }
+    uint32_t offset() const { return idx & (chunk_size - 1); }
 
     bool operator==(TermId rhs) const { return idx == rhs.idx; }
     bool operator<(TermId rhs) const { return idx < rhs.idx; }
 
 private:
     friend class TermArena;
+    friend class PackedTerm;
+    friend class ParentEdge;
     TermId(uint32_t i): idx(i) {}
 
     uint32_t idx;
@@ -0,0 +1,388 @@
+#include "term_parser.h"
+#include "utils/utf8.h"
+#include <array>
+#include <bit>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace lambda {
+
+namespace {
+
+//--------------------------------------------------------------------------------------------------
+enum class TokenKind : uint8_t {
+    name,
+    lambda,
+    dot,
+    open,
+    close,
+    equals,
+    let,
+    in,
+    end
+};
+
+//--------------------------------------------------------------------------------------------------
+struct Token {
+    TokenKind kind;
+    std::string_view text;
+    std::size_t offset;
+};
+
+//--------------------------------------------------------------------------------------------------
+// ASCII bytes that can appear in names. Everything else is looked up in this table, and non-ASCII
+// bytes go through the UTF-8 decoder.
+constexpr std::array<bool, 128> name_bytes = []() {
+    std::array<bool, 128> result = {};
+    for (char c = 'a'; c <= 'z'; ++c) {
+        result[static_cast<uint8_t>(c)] = true;
+    }
+    for (char c = 'A'; c <= 'Z'; ++c) {
+        result[static_cast<uint8_t>(c)] = true;
+    }
+    for (char c = '0'; c <= '9'; ++c) {
+        result[static_cast<uint8_t>(c)] = true;
+    }
+    result[static_cast<uint8_t>('_')] = true;
+    result[static_cast<uint8_t>('\'')] = true;
+    return result;
+}();
+
+// λ (U+03BB) in UTF-8.
+constexpr uint8_t lambda_byte_0 = 0xCE;
+constexpr uint8_t lambda_byte_1 = 0xBB;
+
+//--------------------------------------------------------------------------------------------------
+class Parser {
+public:
+    Parser(TermArena& arena, std::string_view text): arena_(arena), text_(text), pos_(0) {}
+
+    TermId parse();
+
+private:
+    // Each frame is a term that's still being parsed.
+    //  - root: The whole text.
+    //  - application: A sequence of terms that are applied one after another. term holds the
+    //    application so far (if there is anything yet).
+    //  - abstraction: Binds the variables in binders_ from first_binder on. Its body follows.
+    //  - parenthesis: Waiting for a closing parenthesis.
+    //  - definition: The definition of a let, named name. It ends with in.
+    //  - let_body: The body of a let, in which name is bound.
+    enum class FrameKind : uint8_t {
+        root,
+        application,
+        abstraction,
+        parenthesis,
+        definition,
+        let_body
+    };
+
+    struct Frame {
+        FrameKind kind;
+        // Where the frame started, for error messages.
+        std::size_t offset;
+        std::optional<TermId> term;
+        uint32_t first_binder;
+        std::string_view name;
+    };
+
+    Token next_token();
+    bool is_lambda(std::size_t offset) const {
+        return offset + 1 < text_.size() &&
+            static_cast<uint8_t>(text_[offset]) == lambda_byte_0 &&
+            static_cast<uint8_t>(text_[offset + 1]) == lambda_byte_1;
+    }
+    // Returns the length of the (non-ASCII) code point at offset, or throws if it isn't valid.
+    std::size_t code_point_length(std::size_t offset) const;
+
+    void push_frame(FrameKind kind, std::size_t offset, std::string_view name = {}) {
+        frames_.push_back(
+            Frame{kind, offset, std::nullopt, static_cast<uint32_t>(binders_.size()), name}
+        );
+    }
+
+    // Adds a term to the application at the top of the stack.
+    void append(TermId term_id);
+    // Completes every frame above the nearest parenthesis, definition, or root, and returns the
+    // resulting term. offset is where the term ended.
+    TermId finish(std::size_t offset);
+
+    void bind(std::string_view name, TermId term_id) { scopes_[name].push_back(term_id); }
+    void unbind(std::string_view name) { scopes_[name].pop_back(); }
+    TermId look_up(std::string_view name);
+
+    [[noreturn]] void fail(std::string const& message, std::size_t offset) const;
+
+    TermArena& arena_;
+    std::string_view text_;
+    std::size_t pos_;
+
+    std::vector<Frame> frames_;
+    std::vector<TermId> binders_;
+    // The terms that names are bound to, innermost last.
+    std::unordered_map<std::string_view, std::vector<TermId>> scopes_;
+    std::unordered_map<std::string_view, TermId> free_variables_;
+};
+
+//..................................................................................................
+TermId Parser::parse() {
+    push_frame(FrameKind::root, 0);
+    push_frame(FrameKind::application, 0);
+    while (true) {
+        Token const token = next_token();
+        switch (token.kind) {
+            case TokenKind::name:
+                append(look_up(token.text));
+                break;
+
+            case TokenKind::lambda: {
+                push_frame(FrameKind::abstraction, token.offset);
+                Token binder = next_token();
+                while (binder.kind == TokenKind::name) {
+                    TermId const variable_id = arena_.make_variable(binder.text);
+                    binders_.push_back(variable_id);
+                    bind(binder.text, variable_id);
+                    binder = next_token();
+                }
+                if (binders_.size() == frames_.back().first_binder) {
+                    fail("Expected a variable name", binder.offset);
+                }
+                if (binder.kind != TokenKind::dot) {
+                    fail("Expected '.'", binder.offset);
+                }
+                push_frame(FrameKind::application, pos_);
+                break;
+            }
+
+            case TokenKind::open:
+                push_frame(FrameKind::parenthesis, token.offset);
+                push_frame(FrameKind::application, pos_);
+                break;
+
+            case TokenKind::close: {
+                TermId const term_id = finish(token.offset);
+                if (frames_.back().kind != FrameKind::parenthesis) {
+                    fail("Unexpected ')'", token.offset);
+                }
+                frames_.pop_back();
+                append(term_id);
+                break;
+            }
+
+            case TokenKind::let: {
+                Token const name = next_token();
+                if (name.kind != TokenKind::name) {
+                    fail("Expected a name", name.offset);
+                }
+                Token const equals = next_token();
+                if (equals.kind != TokenKind::equals) {
+                    fail("Expected '='", equals.offset);
+                }
+                push_frame(FrameKind::definition, token.offset, name.text);
+                push_frame(FrameKind::application, pos_);
+                break;
+            }
+
+            case TokenKind::in: {
+                TermId const term_id = finish(token.offset);
+                Frame& frame = frames_.back();
+                if (frame.kind != FrameKind::definition) {
+                    fail("Unexpected 'in'", token.offset);
+                }
+                // The name isn't bound in its own definition, only in the body.
+                frame.kind = FrameKind::let_body;
+                bind(frame.name, term_id);
+                push_frame(FrameKind::application, pos_);
+                break;
+            }
+
+            case TokenKind::end: {
+                TermId const term_id = finish(token.offset);
+                Frame const& frame = frames_.back();
+                if (frame.kind == FrameKind::parenthesis) {
+                    fail("Unclosed '('", frame.offset);
+                }
+                if (frame.kind == FrameKind::definition) {
+                    fail("Expected 'in'", token.offset);
+                }
+                return term_id;
+            }
+
+            case TokenKind::dot:
+            case TokenKind::equals:
+                fail(std::string("Unexpected '") + token.text.front() + '\'', token.offset);
+        }
+    }
+}
+
+//..................................................................................................
+Token Parser::next_token() {
+    // Skip whitespace and comments.
+    while (pos_ < text_.size()) {
+        char const c = text_[pos_];
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            ++pos_;
+        } else if (c == '#') {
+            while (pos_ < text_.size() && text_[pos_] != '\n') {
+                ++pos_;
+            }
+        } else {
+            break;
+        }
+    }
+
+    std::size_t const start = pos_;
+    if (start == text_.size()) {
+        return Token{TokenKind::end, std::string_view(), start};
+    }
+    auto const single = [&](TokenKind kind) {
+        ++pos_;
+        return Token{kind, text_.substr(start, 1), start};
+    };
+    switch (text_[start]) {
+        case '(':
+            return single(TokenKind::open);
+        case ')':
+            return single(TokenKind::close);
+        case '.':
+            return single(TokenKind::dot);
+        case '=':
+            return single(TokenKind::equals);
+        case '\\':
+            return single(TokenKind::lambda);
+        default:
+            break;
+    }
+    if (is_lambda(start)) {
+        pos_ += 2;
+        return Token{TokenKind::lambda, text_.substr(start, 2), start};
+    }
+
+    // Anything else has to be a name.
+    while (pos_ < text_.size()) {
+        auto const byte = static_cast<uint8_t>(text_[pos_]);
+        if (byte < 0x80) {
+            if (!name_bytes[byte]) {
+                break;
+            }
+            ++pos_;
+        } else {
+            if (is_lambda(pos_)) {
+                break;
+            }
+            pos_ += code_point_length(pos_);
+        }
+    }
+    if (pos_ == start) {
+        fail("Unexpected character", start);
+    }
+
+    std::string_view const name = text_.substr(start, pos_ - start);
+    if (name == "let") {
+        return Token{TokenKind::let, name, start};
+    }
+    if (name == "in") {
+        return Token{TokenKind::in, name, start};
+    }
+    return Token{TokenKind::name, name, start};
+}
+
+//..................................................................................................
+std::size_t Parser::code_point_length(std::size_t offset) const {
+    auto const length = static_cast<std::size_t>(
+        std::countl_one(static_cast<uint8_t>(text_[offset]))
+    );
+    // next_utf8_codepoint checks the continuation bytes, but doesn't know where the text ends.
+    if (length < 2 || length > 4 || offset + length > text_.size()) {
+        fail("Invalid UTF-8", offset);
+    }
+    auto const pos = reinterpret_cast<char8_t const*>(text_.data() + offset);
+    if (next_utf8_codepoint(pos) != pos + length) {
+        fail("Invalid UTF-8", offset);
+    }
+    return length;
+}
+
+//..................................................................................................
+void Parser::append(TermId term_id) {
+    std::optional<TermId>& application = frames_.back().term;
+    application = application.has_value()
+        ? arena_.make_application(*application, term_id)
+        : term_id;
+}
+
+//..................................................................................................
+TermId Parser::finish(std::size_t offset) {
+    std::optional<TermId> term;
+    while (true) {
+        Frame& frame = frames_.back();
+        switch (frame.kind) {
+            case FrameKind::application:
+                // An abstraction or let that just finished is the last term in the application.
+                if (term.has_value()) {
+                    append(*term);
+                }
+                if (!frame.term.has_value()) {
+                    fail("Expected a term", offset);
+                }
+                term = frame.term;
+                break;
+            case FrameKind::abstraction:
+                for (auto i = binders_.size(); i-- > frame.first_binder;) {
+                    term = arena_.make_abstraction(binders_[i], *term);
+                    unbind(arena_.name(binders_[i]));
+                }
+                binders_.resize(frame.first_binder);
+                break;
+            case FrameKind::let_body:
+                unbind(frame.name);
+                break;
+            case FrameKind::root:
+            case FrameKind::parenthesis:
+            case FrameKind::definition:
+                return *term;
+        }
+        frames_.pop_back();
+    }
+}
+
+//..................................................................................................
+TermId Parser::look_up(std::string_view name) {
+    auto const scope = scopes_.find(name);
+    if (scope != scopes_.end() && !scope->second.empty()) {
+        return scope->second.back();
+    }
+    auto const [itr, is_new] = free_variables_.try_emplace(name, TermId{});
+    if (is_new) {
+        itr->second = arena_.make_variable(name);
+    }
+    return itr->second;
+}
+
+//..................................................................................................
+void Parser::fail(std::string const& message, std::size_t offset) const {
+    // Positions are only worked out when something goes wrong, so the main loop doesn't have to
+    // keep track of lines.
+    uint32_t line = 1;
+    uint32_t column = 1;
+    for (std::size_t i = 0; i < offset && i < text_.size(); ++i) {
+        auto const byte = static_cast<uint8_t>(text_[i]);
+        if (byte == '\n') {
+            ++line;
+            column = 1;
+        } else if ((byte & 0xC0) != 0x80) {
+            ++column;
+        }
+    }
+    throw ParseError(message, line, column);
+}
+
+}
+
+//..................................................................................................
+TermId parse_term(TermArena& arena, std::string_view text) {
+    return Parser(arena, text).parse();
+}
+
+}
@@ -0,0 +1,51 @@
+#ifndef LAMBDA_TERM_PARSER_H
+#define LAMBDA_TERM_PARSER_H
+
+#include "term_arena.h"
+#include "utils/stdint.h"
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// Lines and columns start at one. Columns count code points, not bytes.
+class ParseError : public std::runtime_error {
+public:
+    ParseError(std::string const& message, uint32_t line, uint32_t column)
+        : std::runtime_error(
+            std::to_string(line) + ':' + std::to_string(column) + ": " + message
+        )
+        , line_(line)
+        , column_(column)
+    {}
+
+    uint32_t line() const { return line_; }
+    uint32_t column() const { return column_; }
+
+private:
+    uint32_t line_;
+    uint32_t column_;
+};
+
+//--------------------------------------------------------------------------------------------------
+// Parses UTF-8 text into the arena, and returns the id of the term. The syntax is the one
+// serialize_term writes, plus some conveniences:
+//  - Abstractions start with λ or a backslash, and may bind several variables: λx y.x is λx.λy.x.
+//    The body extends as far to the right as possible.
+//  - Application is left associative, and doesn't need parentheses: f x y is ((f x) y).
+//  - let name = definition in body binds name to the definition within the body. The definition
+//    isn't copied; every use of the name shares the same term.
+//  - A # starts a comment that runs to the end of the line.
+// Names are made of letters, digits, underscores, and apostrophes, along with any non-ASCII code
+// points other than λ. let and in are reserved. Names that aren't bound anywhere become free
+// variables, with one variable per name. Names are interned in the arena, so the text can be freed
+// as soon as parse_term returns.
+// The text is read in one pass, without recursion, so deeply nested terms are fine. Throws a
+// ParseError if the text isn't a valid term.
+TermId parse_term(TermArena& arena, std::string_view text);
+
+}
+
+#endif
@@ -2,15 +2,15 @@
 #include "utils/stdint.h"
 #include "utils/visit.h"
 #include <array>
-#include <unordered_map>
 
 namespace lambda {
 
 //..................................................................................................
-std::unordered_set<TermId> find_terms_with_bound_variable(
+void find_terms_with_bound_variable(
     TermArena const& arena,
     TermId root_id,
-    TermId variable_id
+    TermId variable_id,
+    TermSet& result
 ) {
     struct StackEntry {
         StackEntry(TermId term):
@@ -32,30 +32,35 @@ std::unordered_set<TermId> find_terms_with_bound_variable(
         uint32_t idx;
     };
 
-    std::vector<StackEntry> stack;
+    auto const stack_lease = arena.scratch().borrow<std::vector<StackEntry>>();
+    std::vector<StackEntry>& stack = *stack_lease;
     stack.emplace_back(root_id);
 
-    std::unordered_set<TermId> visited;
-    std::unordered_set<TermId> result;
+    auto const visited_lease = arena.scratch().borrow<TermSet>();
+    TermSet& visited = *visited_lease;
+    result.clear();
 
     while (true) {
         TermId term_id = stack.back().terms[stack.back().idx];
 
-        if (!visited.contains(term_id)) {
+        // Terms that can't contain the variable are treated as leaves, since nothing beneath them
+        // can depend on it.
+        if (!visited.contains(term_id) && arena.may_contain(term_id, variable_id)) {
             // Enter this term, and add its children (if any) to the stack.
-            bool const added_terms_to_stack = arena[term_id].visit(
-                [&](Variable) {
-                    return false;
-                },
-                [&](Abstraction abstraction) {
-                    stack.emplace_back(abstraction.body);
-                    return true;
-                },
-                [&](Application application) {
-                    stack.emplace_back(application.left, application.right);
-                    return true;
-                }
-            );
+            auto const [child_0, child_1] = arena.children(term_id);
+            bool added_terms_to_stack = true;
+            switch (arena.kind(term_id)) {
+                case TermKind::variable:
+                    added_terms_to_stack = false;
+                    break;
+                case TermKind::abstraction:
+                    stack.emplace_back(child_1);
+                    break;
+                case TermKind::application:
+                case TermKind::substitution:
+                    stack.emplace_back(child_0, child_1);
+                    break;
+            }
 
             // If this term has children, go down one level.
             if (added_terms_to_stack) {
@@ -92,7 +97,7 @@ std::unordered_set<TermId> find_terms_with_bound_variable(
 
             // If this is the last element on the stack, we're done.
             if (stack.size() == 1) {
-                return result;
+                return;
             }
 
             // Otherwise go up a level.
@@ -130,44 +135,60 @@ std::variant<TermId, LambdaTerm> substitute(
     };
 
     // Initialize the stack for a depth first traversal from root_id.
-    std::vector<StackEntry> stack;
+    auto const stack_lease = arena.scratch().borrow<std::vector<StackEntry>>();
+    std::vector<StackEntry>& stack = *stack_lease;
     stack.emplace_back(root_id);
 
-    // This stores all terms that have been duplicated. It maps the original TermId (as used in the
-    // the tree beneath root_id) to that of the duplicate.
-    std::unordered_map<TermId, AnnotatedTerm> new_terms;
+    // This stores all terms that have been covered. It maps the original TermId (as used in the
+    // the tree beneath root_id) to that of the duplicate, or to itself if it wasn't duplicated.
+    auto const new_terms_lease = arena.scratch().borrow<TermMap>();
+    TermMap& new_terms = *new_terms_lease;
 
     // Traverse the tree to find terms that directly depend on the variable_id.
     // TODO We really only need to know about abstractions.
-    std::unordered_set<TermId> const direct_dependencies =
-        find_terms_with_bound_variable(arena, root_id, variable_id);
+    auto const direct_dependencies_lease = arena.scratch().borrow<TermSet>();
+    TermSet& direct_dependencies = *direct_dependencies_lease;
+    find_terms_with_bound_variable(arena, root_id, variable_id, direct_dependencies);
 
     // Traverse the tree, performing substitutions.
     // The nodes in direct_dependencies all have to be duplicated. So do any nodes that depend on
     // the bound variables of any abstractions in direct_dependencies (these are indirect
     // dependencies). Remaining nodes can be safely re-used.
+    // A term can be re-used without looking inside it if we know all of its free variables, and
+    // none of them is variable_id or is bound by an abstraction in direct_dependencies.
+    auto const is_unaffected = [&](TermId term_id) {
+        FreeVariables const free_variables = arena.free_variables(term_id);
+        if (!free_variables.is_exact()) {
+            return false;
+        }
+        for (TermId free_variable : free_variables.variables()) {
+            std::optional<TermId> const binder = arena.binder(free_variable);
+            if (
+                free_variable == variable_id ||
+                (binder.has_value() && direct_dependencies.contains(*binder))
+            ) {
+                return false;
+            }
+        }
+        return true;
+    };
+
     // (This is wrapped in a lambda so I can use return for control flow within the nested loops.)
     [&]() {
         while (true) {
             StackEntry* context = &stack.back();
             TermId term_id = context->terms[context->idx];
-            LambdaTerm* term = &arena[term_id];
 
             // Enter this term.
+            if (!new_terms.contains(term_id) && is_unaffected(term_id)) {
+                new_terms.insert_or_assign(term_id, term_id);
+            }
             if (!new_terms.contains(term_id)) {
-                bool const added_terms_to_stack = term->visit(
-                    [](Variable) {
-                        return false;
-                    },
-                    [&](Abstraction abstraction) {
-                        stack.emplace_back(abstraction.variable, abstraction.body);
-                        return true;
-                    },
-                    [&](Application application) {
-                        stack.emplace_back(application.left, application.right);
-                        return true;
-                    }
-                );
+                bool const added_terms_to_stack = !arena.is_variable(term_id);
+                if (added_terms_to_stack) {
+                    auto const [child_0, child_1] = arena.children(term_id);
+                    stack.emplace_back(child_0, child_1);
+                }
 
                 // If this term has children, go down one level.
                 if (added_terms_to_stack) {
@@ -190,54 +211,46 @@ std::variant<TermId, LambdaTerm> substitute(
                     }
 
                     // If we've already covered this term, return the existing copy.
-                    auto itr = new_terms.find(term_id);
-                    if (itr != new_terms.end()) {
-                        return itr->second;
+                    if (TermId const* new_id = new_terms.find(term_id)) {
+                        return AnnotatedTerm{*new_id, *new_id != term_id};
                     }
 
                     // Otherwise we have to make a new copy.
-                    AnnotatedTerm new_term = term->visit(
-                        [&](Variable variable) {
+                    AnnotatedTerm const child_0 = context->new_children[0];
+                    AnnotatedTerm const child_1 = context->new_children[1];
+                    AnnotatedTerm new_term{term_id, false};
+                    switch (arena.kind(term_id)) {
+                        case TermKind::variable: {
                             // If this is a bound variable, and its lambda depends (directly) on
                             // variable_id, then anything that depends on this variable also depends
                             // (indirectly) on variable_id.
-                            // TODO: If lambdas knew what free variables (in their contexts) they
-                            // referenced, we wouldn't need to do the extra traversal.
-                            if (
-                                variable.abstraction.has_value() &&
-                                direct_dependencies.contains(variable.abstraction.value())
-                            ) {
-                                return AnnotatedTerm{arena.make_variable(variable.name), true};
-                            } else {
-                                return AnnotatedTerm{term_id, false};
+                            // (Terms with exact free variable summaries are skipped before we get
+                            // here, so this only matters beneath terms with many free variables.)
+                            std::optional<TermId> const binder = arena.binder(term_id);
+                            if (binder.has_value() && direct_dependencies.contains(*binder)) {
+                                new_term = {arena.make_variable(arena.symbol(term_id)), true};
                             }
-                        },
-                        [&](Abstraction) {
-                            AnnotatedTerm child_0 = context->new_children[0];
-                            AnnotatedTerm child_1 = context->new_children[1];
+                            break;
+                        }
+                        case TermKind::abstraction:
                             if (child_0.is_new || child_1.is_new) {
-                                return AnnotatedTerm{
-                                    arena.make_abstraction(child_0.id, child_1.id),
-                                    true
-                                };
-                            } else {
-                                return AnnotatedTerm{term_id, false};
+                                new_term = {arena.make_abstraction(child_0.id, child_1.id), true};
                             }
-                        },
-                        [&](Application) {
-                            AnnotatedTerm child_0 = context->new_children[0];
-                            AnnotatedTerm child_1 = context->new_children[1];
+                            break;
+                        case TermKind::application:
                             if (child_0.is_new || child_1.is_new) {
-                                return AnnotatedTerm{
-                                    arena.make_application(child_0.id, child_1.id),
-                                    true
-                                };
-                            } else {
-                                return AnnotatedTerm{term_id, false};
+                                new_term = {arena.make_application(child_0.id, child_1.id), true};
                             }
-                        }
-                    );
-                    new_terms.emplace(term_id, new_term);
+                            break;
+                        case TermKind::substitution:
+                            // If the abstraction of the binding is duplicated, so is its variable,
+                            // and the body picks up the new one.
+                            if (child_0.is_new || child_1.is_new) {
+                                new_term = {arena.make_substitution(child_0.id, child_1.id), true};
+                            }
+                            break;
+                    }
+                    new_terms.insert_or_assign(term_id, new_term.id);
                     return new_term;
                 }();
 
@@ -255,68 +268,310 @@ std::variant<TermId, LambdaTerm> substitute(
                 stack.pop_back();
                 context = &stack.back();
                 term_id = context->terms[context->idx];
-                term = &arena[term_id];
             }
         }
     }();
 
     // Build the final node. This is different from what we do inside traverse(), since if we have
     // to construct a node we don't do it inside the arena.
-    auto const context = stack.back();
-    return arena[root_id].visit(
-        [=](Variable) -> std::variant<TermId, LambdaTerm> {
+    AnnotatedTerm const child_0 = stack.back().new_children[0];
+    AnnotatedTerm const child_1 = stack.back().new_children[1];
+    switch (arena.kind(root_id)) {
+        case TermKind::variable:
             // Note that the root node cannot be a variable bound by another lambda.
             return (root_id == variable_id) ? argument_id : root_id;
-        },
-        [=](Abstraction) -> std::variant<TermId, LambdaTerm> {
-            AnnotatedTerm child_0 = context.new_children[0];
-            AnnotatedTerm child_1 = context.new_children[1];
+        case TermKind::abstraction:
             if (child_0.is_new || child_1.is_new) {
-                return LambdaTerm{{}, Abstraction{child_0.id, child_1.id}};
-            } else {
-                return root_id;
+                return LambdaTerm{Abstraction{child_0.id, child_1.id}};
             }
-        },
-        [=](Application) -> std::variant<TermId, LambdaTerm> {
-            AnnotatedTerm child_0 = context.new_children[0];
-            AnnotatedTerm child_1 = context.new_children[1];
+            return root_id;
+        case TermKind::application:
             if (child_0.is_new || child_1.is_new) {
-                return LambdaTerm{{}, Application{child_0.id, child_1.id}};
-            } else {
-                return root_id;
+                return LambdaTerm{Application{child_0.id, child_1.id}};
+            }
+            return root_id;
+        case TermKind::substitution:
+            if (child_0.is_new || child_1.is_new) {
+                return LambdaTerm{Substitution{child_0.id, child_1.id}};
+            }
+            return root_id;
+    }
+    throw std::runtime_error("Corrupt term kind");
+}
+
+//..................................................................................................
+void find_dependent_terms(
+    TermArena const& arena,
+    TermId root_id,
+    TermId variable_id,
+    TermSet& result
+) {
+    // Each pending entry is a variable whose occurrences have to be duplicated, along with the term
+    // beneath which those occurrences live.
+    struct PendingVariable {
+        TermId variable;
+        TermId root;
+    };
+
+    ScratchSpace& scratch = arena.scratch();
+    auto const pending_lease = scratch.borrow<std::vector<PendingVariable>>();
+    std::vector<PendingVariable>& pending = *pending_lease;
+    pending.push_back({variable_id, root_id});
+
+    auto const ancestors_lease = scratch.borrow<TermSet>();
+    auto const visited_lease = scratch.borrow<TermSet>();
+    auto const stack_lease = scratch.borrow<std::vector<TermId>>();
+    TermSet& ancestors = *ancestors_lease;
+    TermSet& visited = *visited_lease;
+    std::vector<TermId>& stack = *stack_lease;
+    result.clear();
+
+    while (!pending.empty()) {
+        PendingVariable const entry = pending.back();
+        pending.pop_back();
+
+        // Walk up from the variable, collecting everything that contains it. We don't go above the
+        // root. Any other term we reach this way has been discarded, or belongs to one that has.
+        ancestors.clear();
+        ancestors.insert(entry.variable);
+        stack.push_back(entry.variable);
+        while (!stack.empty()) {
+            TermId const term_id = stack.back();
+            stack.pop_back();
+            if (term_id == entry.root) {
+                continue;
+            }
+            for (ParentEdge edge : arena.parents(term_id)) {
+                if (ancestors.insert(edge.parent())) {
+                    stack.push_back(edge.parent());
+                }
             }
         }
-    );
+
+        // If we never reached the root, the variable only occurs in discarded terms.
+        if (!ancestors.contains(entry.root)) {
+            continue;
+        }
+
+        // Walk back down from the root, only following the paths that lead to the variable.
+        visited.clear();
+        visited.insert(entry.root);
+        stack.push_back(entry.root);
+        while (!stack.empty()) {
+            TermId const term_id = stack.back();
+            stack.pop_back();
+            result.insert(term_id);
+
+            auto const push_child = [&](TermId child_id) {
+                if (ancestors.contains(child_id) && visited.insert(child_id)) {
+                    stack.push_back(child_id);
+                }
+            };
+
+            auto const [child_0, child_1] = arena.children(term_id);
+            switch (arena.kind(term_id)) {
+                case TermKind::variable:
+                    break;
+                case TermKind::abstraction:
+                    // This abstraction will be duplicated, so it needs a new bound variable. Then
+                    // everything that refers to the old one has to be duplicated as well.
+                    if (result.insert(child_0)) {
+                        pending.push_back({child_0, child_1});
+                    }
+                    push_child(child_1);
+                    break;
+                case TermKind::application:
+                    push_child(child_0);
+                    push_child(child_1);
+                    break;
+                case TermKind::substitution:
+                    // The variable of the binding can occur in the body, which isn't beneath the
+                    // binding's abstraction, so walking up from it doesn't find every occurrence.
+                    throw std::runtime_error(
+                        "Bottom up substitution doesn't support explicit substitutions"
+                    );
+            }
+        }
+    }
 }
 
 //..................................................................................................
-TermId beta_reduce(TermArena& arena, TermId term_id) {
+std::variant<TermId, LambdaTerm> substitute_bottom_up(
+    TermArena& arena,
+    TermId root_id,
+    TermId variable_id,
+    TermId argument_id
+) {
+    ScratchSpace& scratch = arena.scratch();
+    auto const dependent_terms_lease = scratch.borrow<TermSet>();
+    TermSet& dependent_terms = *dependent_terms_lease;
+    find_dependent_terms(arena, root_id, variable_id, dependent_terms);
+    if (!dependent_terms.contains(root_id)) {
+        return root_id;
+    }
+
+    // This maps each dependent term to its duplicate. Other terms are re-used as they are.
+    auto const new_terms_lease = scratch.borrow<TermMap>();
+    TermMap& new_terms = *new_terms_lease;
+    new_terms.insert_or_assign(variable_id, argument_id);
+    auto const get_new_term = [&](TermId term_id) {
+        TermId const* new_id = new_terms.find(term_id);
+        return (new_id == nullptr) ? term_id : *new_id;
+    };
+
+    // Builds the duplicate of a term whose dependent children have all been duplicated already.
+    auto const duplicate = [&](TermId term_id) -> LambdaTerm {
+        auto const [child_0, child_1] = arena.children(term_id);
+        switch (arena.kind(term_id)) {
+            case TermKind::variable:
+                return LambdaTerm{Variable{arena.symbol(term_id)}};
+            case TermKind::abstraction:
+                return LambdaTerm{Abstraction{get_new_term(child_0), get_new_term(child_1)}};
+            case TermKind::application:
+                return LambdaTerm{Application{get_new_term(child_0), get_new_term(child_1)}};
+            case TermKind::substitution:
+                return LambdaTerm{Substitution{get_new_term(child_0), get_new_term(child_1)}};
+        }
+        throw std::runtime_error("Corrupt term kind");
+    };
+
+    // Traverse the dependent terms depth first, building duplicates on the way back up. The root is
+    // handled separately below, since we don't construct it inside the arena.
+    struct StackEntry {
+        TermId term;
+        bool entered;
+    };
+    auto const stack_lease = scratch.borrow<std::vector<StackEntry>>();
+    std::vector<StackEntry>& stack = *stack_lease;
+    stack.push_back({root_id, false});
+
+    while (!stack.empty()) {
+        StackEntry& entry = stack.back();
+        TermId const term_id = entry.term;
+
+        // A term can be pushed more than once if it is shared. If we've already duplicated it
+        // through another parent, there's nothing left to do.
+        if (term_id != root_id && new_terms.contains(term_id)) {
+            stack.pop_back();
+            continue;
+        }
+
+        // Enter this term, and add its dependent children (if any) to the stack.
+        if (!entry.entered) {
+            entry.entered = true;
+            if (!arena.is_variable(term_id)) {
+                // Note that entry is invalidated as soon as we push to the stack.
+                for (TermId child_id : arena.children(term_id)) {
+                    if (dependent_terms.contains(child_id) && !new_terms.contains(child_id)) {
+                        stack.push_back({child_id, false});
+                    }
+                }
+            }
+            continue;
+        }
+
+        // Leave this term.
+        stack.pop_back();
+        if (term_id == root_id) {
+            continue;
+        }
+        TermId const new_id = duplicate(term_id).visit(
+            [&](Variable variable) { return arena.make_variable(variable.name); },
+            [&](Abstraction abstraction) {
+                return arena.make_abstraction(abstraction.variable, abstraction.body);
+            },
+            [&](Application application) {
+                return arena.make_application(application.left, application.right);
+            },
+            [&](Substitution substitution) {
+                return arena.make_substitution(substitution.body, substitution.binding);
+            }
+        );
+        new_terms.insert_or_assign(term_id, new_id);
+    }
+
+    // Build the final node.
+    if (root_id == variable_id) {
+        return argument_id;
+    }
+    return duplicate(root_id);
+}
+
+//..................................................................................................
+TermId beta_reduce(
+    TermArena& arena,
+    TermId term_id,
+    SubstitutionMode mode
+) {
     // Check that the term is an application.
-    LambdaTerm& term = arena[term_id];
-    if (!term.is_applicaton()) {
+    if (!arena.is_application(term_id)) {
         throw std::runtime_error("Only applications can be reduced");
     }
-    Application& application = term.get_application();
-    TermId const function_id = application.left;
-    TermId const argument_id = application.right;
+    auto const [function_id, argument_id] = arena.children(term_id);
 
     // Check that the application's left term is an abstraction.
-    LambdaTerm& function = arena[function_id];
-    if (!function.is_abstraction()) {
+    if (!arena.is_abstraction(function_id)) {
         throw std::runtime_error("Only applications of abstractions can be reduced");
     }
-    Abstraction& abstraction = function.get_abstraction();
-    TermId body_id = abstraction.body;
-    TermId variable_id = abstraction.variable;
+    auto const [variable_id, body_id] = arena.children(function_id);
+
+    // This keeps hash-consing from sharing term_id (or its ancestors) into the substituted body.
+    struct RewriteGuard {
+        RewriteGuard(TermArena& arena, TermId term_id): arena(arena) {
+            arena.begin_rewrite(term_id);
+        }
+        ~RewriteGuard() { arena.end_rewrite(); }
+        TermArena& arena;
+    };
+    RewriteGuard const rewrite_guard(arena, term_id);
+
+    // If the variable doesn't occur, the result is just the body.
+    if (!arena.may_contain(body_id, variable_id)) {
+        arena.replace_term(term_id, body_id);
+        return body_id;
+    }
+
+    // If the variable occurs once, and the abstraction is only reachable through this redex, the
+    // argument can go straight into the body. Nothing is copied, and no terms are made. (The
+    // occurrence and its ancestors all lie beneath the abstraction, since they contain its
+    // variable.) Parent lists only account for every reference when reference counting, since
+    // otherwise the caller may hold on to terms without registering them.
+    bool const is_linear = arena.is_reference_counting() &&
+        arena.parents(variable_id).size() == 1 &&
+        arena.parents(function_id).size() == 1 &&
+        !arena.is_root(function_id);
+    if (is_linear) {
+        if (body_id == variable_id) {
+            arena.replace_term(term_id, argument_id);
+            return argument_id;
+        }
+        if (arena.substitute_in_place(variable_id, argument_id)) {
+            arena.replace_term(term_id, body_id);
+            return body_id;
+        }
+    }
+
+    // Lazy substitution leaves the body alone, and the redex becomes the substitution. Its binding
+    // is a copy of the redex, since the redex's own node is reused.
+    if (mode == SubstitutionMode::lazy && !arena.is_hash_consing()) {
+        if (body_id == variable_id) {
+            arena.replace_term(term_id, argument_id);
+            return argument_id;
+        }
+        TermId const binding_id = arena.make_application(function_id, argument_id);
+        arena.replace_application(term_id, LambdaTerm{Substitution{body_id, binding_id}});
+        return term_id;
+    }
 
     // Perform the substitution and splice in the new node.
-    std::variant<TermId, LambdaTerm> new_root =
-        substitute(arena, body_id, variable_id, argument_id);
+    std::variant<TermId, LambdaTerm> new_root = (mode == SubstitutionMode::bottom_up)
+        ? substitute_bottom_up(arena, body_id, variable_id, argument_id)
+        : substitute(arena, body_id, variable_id, argument_id);
     return lambda::visit(
         new_root,
         [&](TermId new_id) {
-            // If the new root is an existing node, we remap the current node to it.
-            // Note: if we start tracking memory more closely, we could free term_id here.
+            // If the new root is an existing node, we remap the current node to it. If the arena
+            // is reference counting, this frees term_id.
             arena.replace_term(term_id, new_id);
             return new_id;
         },
@@ -329,67 +584,174 @@ TermId beta_reduce(TermArena& arena, TermId term_id) {
 }
 
 //..................................................................................................
-TermId reduce_normal_order(
-    TermArena& arena,
-    TermId root_id,
-    uint32_t& n_reductions,
-    std::optional<uint32_t> max_reductions
-) {
-    struct StackEntry {
-        StackEntry(TermId term): children{term, TermId{}}, size{1}, idx{0} {}
-        StackEntry(TermId left, TermId right): children{left, right}, size{2}, idx{0} {}
+TermId push_substitution(TermArena& arena, TermId term_id) {
+    if (!arena.is_substitution(term_id)) {
+        throw std::runtime_error("Only substitutions can be pushed");
+    }
 
-        std::array<TermId, 2> children;
-        uint32_t size;
-        uint32_t idx;
-    };
+    // Pushes a substitution whose body isn't a substitution.
+    auto const push = [&arena](TermId substitution_id) {
+        auto const [body_id, binding_id] = arena.children(substitution_id);
+        auto const [variable_id, argument_id] = arena.binding(substitution_id);
+        if (body_id == variable_id) {
+            arena.replace_term(substitution_id, argument_id);
+            return argument_id;
+        }
+        if (!arena.may_contain(body_id, variable_id)) {
+            arena.replace_term(substitution_id, body_id);
+            return body_id;
+        }
 
-    std::vector<StackEntry> stack;
-    stack.emplace_back(root_id);
+        // Only children that may contain the variable get a substitution of their own, and the
+        // variable itself is replaced right away. The substitutions share the binding, and
+        // make_substitution reuses one that already exists, so shared terms stay shared.
+        auto const substitute_into = [&](TermId child_id) {
+            if (child_id == variable_id) {
+                return argument_id;
+            }
+            if (!arena.may_contain(child_id, variable_id)) {
+                return child_id;
+            }
+            return arena.make_substitution(child_id, binding_id);
+        };
+        auto const [child_0, child_1] = arena.children(body_id);
+        if (arena.is_application(body_id)) {
+            Application const application{substitute_into(child_0), substitute_into(child_1)};
+            arena.replace_application(substitution_id, LambdaTerm{application});
+            return substitution_id;
+        }
 
-    auto const get_term_id = [&stack](uint32_t depth) -> TermId {
-        return stack[depth].children[stack[depth].idx];
+        // The abstraction may be shared, so its variable can't be bound by the new one. Instead
+        // the body renames it, with a binding of its own.
+        TermId const new_variable_id = arena.make_variable(arena.symbol(child_0));
+        TermId renamed_id = child_1;
+        if (arena.may_contain(child_1, child_0)) {
+            TermId const renaming_id = arena.make_application(body_id, new_variable_id);
+            renamed_id = arena.make_substitution(child_1, renaming_id);
+        }
+        LambdaTerm const new_term{Abstraction{new_variable_id, substitute_into(renamed_id)}};
+        arena.replace_application(substitution_id, new_term);
+        return substitution_id;
     };
 
-    // This stores all terms that have been fully reduced, so we know not to traverse them again.
-    std::unordered_set<TermId> reduced_terms;
-
-    n_reductions = 0;
+    // If the body is a substitution too, it has to be pushed first. Pushing it can leave another
+    // one in its place (if its argument is one), so we look again each time.
+    auto const stack_lease = arena.scratch().borrow<std::vector<TermId>>();
+    std::vector<TermId>& stack = *stack_lease;
+    stack.push_back(term_id);
     while (true) {
+        TermId const substitution_id = stack.back();
+        TermId const body_id = arena.children(substitution_id)[0];
+        if (arena.is_substitution(body_id)) {
+            stack.push_back(body_id);
+            continue;
+        }
+        TermId const new_id = push(substitution_id);
+        stack.pop_back();
+        if (stack.empty()) {
+            return new_id;
+        }
+    }
+}
+
+//..................................................................................................
+template <typename Strategy>
+Reducer<Strategy>::Reducer(TermArena& arena, TermId root_id, SubstitutionMode mode):
+    arena_(arena),
+    mode_(mode),
+    stack_(arena.scratch().borrow<std::vector<StackEntry>>()),
+    reduced_terms_(arena.scratch().borrow<TermSet>())
+{
+    stack_->emplace_back(root_id);
+
+    // If the arena frees terms as we go, their ids can be reused for new terms that haven't been
+    // reduced yet. The stack doesn't need cleaning up: it only holds terms on the path down from
+    // the root, which stay alive while we're beneath them, and it reads their children afresh. A
+    // copy of a child could name a redex that was contracted (and freed) through another parent,
+    // and then a new term that took over its id.
+    if (arena_.is_reference_counting()) {
+        arena_.set_free_callback([this](TermId term_id) { reduced_terms_->erase(term_id); });
+    }
+    // Linear redexes are contracted in place, which can turn reduced terms back into redexes.
+    arena_.set_rewrite_callback([this](TermId term_id) { reduced_terms_->erase(term_id); });
+}
+
+//..................................................................................................
+template <typename Strategy>
+Reducer<Strategy>::~Reducer() {
+    if (arena_.is_reference_counting()) {
+        arena_.set_free_callback({});
+    }
+    arena_.set_rewrite_callback({});
+}
+
+//..................................................................................................
+template <typename Strategy>
+uint32_t Reducer<Strategy>::step(std::optional<uint32_t> max_reductions) {
+    std::vector<StackEntry>& stack = *stack_;
+    TermSet& reduced_terms = *reduced_terms_;
+    uint32_t n_reductions = 0;
+
+    while (!is_done_) {
+        // Return if we've reached the limit.
+        if (max_reductions.has_value() && n_reductions == max_reductions.value()) {
+            break;
+        }
+
         TermId term_id = get_term_id(stack.size() - 1);
 
         if (!reduced_terms.contains(term_id)) {
             // Enter this term, and add its children (if any) to the stack.
-            bool const modified_stack = arena[term_id].visit(
-                [&](Variable) {
-                    return false;
-                },
-                [&](Abstraction abstraction) {
-                    stack.emplace_back(abstraction.body);
-                    return true;
-                },
-                [&](Application application) {
-                    // If this term is a redex, reduce it.
-                    if (arena[application.left].is_abstraction()) {
-                        term_id = beta_reduce(arena, term_id);
+            auto const [child_0, child_1] = arena_.children(term_id);
+            bool modified_stack = true;
+            switch (arena_.kind(term_id)) {
+                case TermKind::variable:
+                    modified_stack = false;
+                    break;
+                case TermKind::abstraction:
+                    if constexpr (Strategy::reduces_under_abstractions) {
+                        stack.emplace_back(term_id, 1, 1);
+                    } else {
+                        modified_stack = false;
+                    }
+                    break;
+                case TermKind::application:
+                    if (arena_.is_abstraction(child_0)) {
+                        // We come back to this term once the argument has been reduced.
+                        if constexpr (Strategy::reduces_arguments_first) {
+                            if (!reduced_terms.contains(child_1)) {
+                                stack.emplace_back(term_id, 1, 1);
+                                break;
+                            }
+                        }
+
+                        // This term is a redex, so reduce it.
+                        term_id = beta_reduce(arena_, term_id, mode_);
                         ++n_reductions;
                         // It's possible that our parent is now a redex.
                         stack.pop_back();
                         if (stack.size() == 0) {
                             stack.emplace_back(term_id);
                         }
-                        return true;
+                        break;
                     }
 
                     // Otherwise, continue walking down.
-                    stack.emplace_back(application.left, application.right);
-                    return true;
-                }
-            );
-
-            // Return if we've reached the limit.
-            if (max_reductions.has_value() && n_reductions == max_reductions.value()) {
-                return stack.front().children[0];
+                    if constexpr (Strategy::reduces_arguments) {
+                        stack.emplace_back(term_id, 0, 2);
+                    } else {
+                        stack.emplace_back(term_id, 0, 1);
+                    }
+                    break;
+                case TermKind::substitution:
+                    // Substitutions are only pushed inward once we get to them. Like a reduction,
+                    // this can make our parent a redex.
+                    term_id = push_substitution(arena_, term_id);
+                    stack.pop_back();
+                    if (stack.size() == 0) {
+                        stack.emplace_back(term_id);
+                    }
+                    break;
             }
 
             // If we modified the stack, go down (or up) one level.
@@ -406,21 +768,63 @@ TermId reduce_normal_order(
             // If this term has more siblings, move to the next one.
             ++stack.back().idx;
             if (stack.back().idx < stack.back().size) {
-                // This means it was an application.
-                // We want a space between the left and right terms.
                 break;
             }
 
-            // If this is the last node in the stack, we're done.
+            // If this is the last node in the stack, we're done. We leave the root where root()
+            // can find it.
             if (stack.size() == 1) {
-                return term_id;
+                stack.back().idx = 0;
+                is_done_ = true;
+                break;
             }
 
             // Otherwise go up a level.
             stack.pop_back();
             term_id = get_term_id(stack.size() - 1);
+
+            // If we only reduced the argument of a redex, we still have to contract it.
+            if constexpr (Strategy::reduces_arguments_first) {
+                if (
+                    arena_.is_application(term_id) &&
+                    arena_.is_abstraction(arena_.children(term_id)[0])
+                ) {
+                    break;
+                }
+            }
         }
     }
+
+    n_reductions_ += n_reductions;
+    return n_reductions;
+}
+
+//..................................................................................................
+template <typename Strategy>
+void Reducer<Strategy>::remap(std::span<std::optional<TermId> const> remap) {
+    // The stack only holds terms on the path down from the root, so all of them are still there.
+    for (StackEntry& entry : *stack_) {
+        entry.term = remap[entry.term.value()].value();
+    }
+    reduced_terms_->clear();
+}
+
+//..................................................................................................
+template class Reducer<NormalOrder>;
+template class Reducer<HeadNormalForm>;
+template class Reducer<WeakHeadNormalForm>;
+template class Reducer<CallByValue>;
+template class Reducer<ApplicativeOrder>;
+
+//..................................................................................................
+TermId reduce_normal_order(
+    TermArena& arena,
+    TermId root_id,
+    uint32_t& n_reductions,
+    std::optional<uint32_t> max_reductions,
+    SubstitutionMode mode
+) {
+    return reduce<NormalOrder>(arena, root_id, n_reductions, max_reductions, mode);
 }
 
 }
@@ -2,19 +2,40 @@
 #define LAMBDA_TERM_REDUCTION_H
 
 #include "term_arena.h"
-#include <unordered_set>
+#include "term_set.h"
+#include <array>
 #include <optional>
+#include <span>
+#include <variant>
+#include <vector>
 
 namespace lambda {
 
+//--------------------------------------------------------------------------------------------------
+// Selects how beta_reduce builds the substituted body. Top down substitution walks the entire body
+// of the abstraction. Bottom up substitution starts at the occurrences of the bound variable and
+// follows parent links up to the body, so its cost scales with the size of the copied paths rather
+// than the size of the body. Lazy substitution doesn't build anything: the redex becomes an
+// explicit substitution, which is pushed inward a level at a time as reduction reaches it (see
+// push_substitution), so parts of the body that are discarded are never copied. It allocates more
+// terms than top down substitution, since every level pushed through gets a substitution of its
+// own. Arenas that are hash-consing use top down substitution instead.
+enum class SubstitutionMode {
+    top_down,
+    bottom_up,
+    lazy
+};
+
 //--------------------------------------------------------------------------------------------------
 // Walks down the tree starting at root_id, collecting all terms that directly depend on
-// variable_id. Bound variables of inner lambdas are not added along with their abstractions, so a
-// second pass is needed to propagate up these indirect dependencies.
-std::unordered_set<TermId> find_terms_with_bound_variable(
+// variable_id into result (which is cleared first). Bound variables of inner lambdas are not added
+// along with their abstractions, so a second pass is needed to propagate up these indirect
+// dependencies.
+void find_terms_with_bound_variable(
     TermArena const& arena,
     TermId root_id,
-    TermId variable_id
+    TermId variable_id,
+    TermSet& result
 );
 
 //--------------------------------------------------------------------------------------------------
@@ -30,24 +51,212 @@ std::variant<TermId, LambdaTerm> substitute(
 );
 
 //--------------------------------------------------------------------------------------------------
-TermId beta_reduce(TermArena& arena, TermId term_id);
+// Walks up the parent links starting at variable_id, collecting all terms beneath root_id that have
+// to be duplicated when variable_id is substituted into result (which is cleared first). This
+// includes the terms that contain variable_id, as well as the terms that contain the bound
+// variables of any abstractions that have to be duplicated (and those bound variables themselves).
+// Parent links that don't lead back to root_id (for instance those of discarded terms) are ignored.
+void find_dependent_terms(
+    TermArena const& arena,
+    TermId root_id,
+    TermId variable_id,
+    TermSet& result
+);
+
+//--------------------------------------------------------------------------------------------------
+// Performs the same substitution as substitute, but only visits the terms returned by
+// find_dependent_terms. Portions of the tree that don't depend on variable_id are never traversed.
+// Throws if the body contains explicit substitutions (which substitute copies like any other term).
+std::variant<TermId, LambdaTerm> substitute_bottom_up(
+    TermArena& arena,
+    TermId root_id,
+    TermId variable_id,
+    TermId argument_id
+);
+
+//--------------------------------------------------------------------------------------------------
+// Contracts the redex term_id, and returns the term that takes its place. If the bound variable
+// doesn't occur in the body, that's just the body. If the arena is reference counting, the
+// variable occurs once, and the abstraction has no other parent, the argument is substituted in
+// place without copying anything. Otherwise mode decides how the body is duplicated.
+TermId beta_reduce(
+    TermArena& arena,
+    TermId term_id,
+    SubstitutionMode mode = SubstitutionMode::top_down
+);
+
+//--------------------------------------------------------------------------------------------------
+// Pushes the explicit substitution term_id one level into its body, and returns the term that
+// takes its place. Substitutions nested in the body are pushed first (innermost first), so pending
+// substitutions move inward together rather than one after the other. If the body can't contain
+// the variable, the body takes the place of the substitution, and if it is the variable, the
+// argument does. Otherwise term_id is rewritten in place: an application becomes an application of
+// substituted children, and an abstraction gets a new variable, and a body in which the old one is
+// renamed and then substituted. Children that can't contain the variable are used as they are.
+TermId push_substitution(TermArena& arena, TermId term_id);
+
+//--------------------------------------------------------------------------------------------------
+// Reduction strategies. Each one says where to look for redexes, and is used as a template
+// parameter to Reducer so that the traversal is specialized for it. Redexes are always contracted
+// leftmost first.
+//  - reduces_under_abstractions: Whether to reduce the bodies of abstractions.
+//  - reduces_arguments: Whether to reduce the arguments of applications that aren't redexes (such
+//    as those of free variables). Otherwise only the function is reduced.
+//  - reduces_arguments_first: Whether to reduce the argument of a redex before contracting it.
+
+// Reduces terms all the way to normal form, if there is one.
+struct NormalOrder {
+    static constexpr bool reduces_under_abstractions = true;
+    static constexpr bool reduces_arguments = true;
+    static constexpr bool reduces_arguments_first = false;
+};
+
+// Stops once the term is an abstraction or an application with a variable at its head. Bodies of
+// abstractions are reduced, but arguments are left alone.
+struct HeadNormalForm {
+    static constexpr bool reduces_under_abstractions = true;
+    static constexpr bool reduces_arguments = false;
+    static constexpr bool reduces_arguments_first = false;
+};
+
+// Like HeadNormalForm, but abstractions are left alone as well. This is enough to see which branch
+// a boolean selects, for instance.
+struct WeakHeadNormalForm {
+    static constexpr bool reduces_under_abstractions = false;
+    static constexpr bool reduces_arguments = false;
+    static constexpr bool reduces_arguments_first = false;
+};
+
+// Arguments are reduced (to weak normal form) before they are substituted. This doesn't terminate
+// for terms that only reach normal form by discarding arguments that have none (such as those that
+// use the Y combinator).
+struct CallByValue {
+    static constexpr bool reduces_under_abstractions = false;
+    static constexpr bool reduces_arguments = true;
+    static constexpr bool reduces_arguments_first = true;
+};
+
+// Like CallByValue, but reduces all the way to normal form.
+struct ApplicativeOrder {
+    static constexpr bool reduces_under_abstractions = true;
+    static constexpr bool reduces_arguments = true;
+    static constexpr bool reduces_arguments_first = true;
+};
+
+// Substitution never copies arguments; every occurrence of the bound variable refers to the same
+// argument term. And redexes are rewritten in place (or all their parents are remapped), so when
+// one occurrence of an argument is reduced, they all are. So weak head reduction in a TermArena is
+// call-by-need.
+using CallByNeed = WeakHeadNormalForm;
+
+//--------------------------------------------------------------------------------------------------
+// Reduces a term according to a strategy, a few steps at a time. The traversal stack and the set of
+// terms already reduced are kept between calls to step, so pausing and resuming doesn't redo any
+// work. Between calls, the terms beneath the root mustn't be modified except through this reducer.
+// If the arena is collected, the reducer has to be remapped (and the current root has to be among
+// the roots). When the arena is reference counting, the reducer installs a free callback for its
+// whole lifetime, so only one reducer can be active at a time.
+// Explicit substitutions are pushed inward whenever the traversal reaches one, with whichever
+// substitution mode. Those the strategy never reaches (beneath an abstraction in weak head normal
+// form, for instance) are left in the result. Pushing them doesn't count as a reduction.
+// This is instantiated for each of the strategies above.
+template <typename Strategy>
+class Reducer {
+public:
+    Reducer(TermArena& arena, TermId root_id, SubstitutionMode mode = SubstitutionMode::top_down);
+    Reducer(Reducer const&) = delete;
+    Reducer& operator=(Reducer const&) = delete;
+    ~Reducer();
+
+    // Performs up to max_reductions beta reductions (or as many as the strategy calls for, if
+    // there's no limit). Returns the number of reductions performed.
+    uint32_t step(std::optional<uint32_t> max_reductions = {});
+
+    // The root changes when the whole term is a redex that reduces to an existing term.
+    TermId root() const { return stack_->front().term; }
+    bool is_done() const { return is_done_; }
+    // The total over all calls to step.
+    uint32_t n_reductions() const { return n_reductions_; }
+
+    // Updates the reducer after the arena is collected. The set of reduced terms is forgotten, so
+    // some terms may be traversed again, but the position of the traversal is kept.
+    void remap(std::span<std::optional<TermId> const> remap);
+
+private:
+    // The bottom entry holds the root itself. Every other entry holds the parent of the terms it
+    // traverses (size of its children, starting at first_slot), and reads them from the arena.
+    // Copies of the children could go stale, since a shared child can be contracted through
+    // another path, which replaces it for every parent.
+    struct StackEntry {
+        StackEntry(TermId root): term{root}, first_slot{0}, size{1}, idx{0}, is_root{true} {}
+        StackEntry(TermId parent, uint32_t first_slot, uint32_t size):
+            term{parent}, first_slot{first_slot}, size{size}, idx{0}, is_root{false}
+        {}
+
+        TermId term;
+        uint32_t first_slot;
+        uint32_t size;
+        uint32_t idx;
+        bool is_root;
+    };
+
+    TermId get_term_id(uint32_t depth) const {
+        StackEntry const& entry = (*stack_)[depth];
+        if (entry.is_root) {
+            return entry.term;
+        }
+        return arena_.children(entry.term)[entry.first_slot + entry.idx];
+    }
+
+    TermArena& arena_;
+    SubstitutionMode mode_;
+    ScratchSpace::Lease<std::vector<StackEntry>> stack_;
+    // This stores all terms that have been fully reduced (as far as the strategy is concerned), so
+    // we know not to traverse them again.
+    ScratchSpace::Lease<TermSet> reduced_terms_;
+    uint32_t n_reductions_ = 0;
+    bool is_done_ = false;
+};
+
+using NormalOrderReducer = Reducer<NormalOrder>;
+
+//--------------------------------------------------------------------------------------------------
+// Reduces a term according to a strategy, or until max_reductions beta reductions have been
+// performed.
+template <typename Strategy>
+TermId reduce(
+    TermArena& arena,
+    TermId root_id,
+    uint32_t& n_reductions,
+    std::optional<uint32_t> max_reductions = {},
+    SubstitutionMode mode = SubstitutionMode::top_down
+) {
+    Reducer<Strategy> reducer(arena, root_id, mode);
+    n_reductions = reducer.step(max_reductions);
+    return reducer.root();
+}
 
 //--------------------------------------------------------------------------------------------------
+// Reduces a term to normal form, or until max_reductions beta reductions have been performed. To
+// reduce a term a few steps at a time, use NormalOrderReducer instead; calling this repeatedly
+// starts over from the root every time.
 TermId reduce_normal_order(
     TermArena& arena,
     TermId root_id,
     uint32_t& n_reductions,
-    std::optional<uint32_t> max_reductions = {}
+    std::optional<uint32_t> max_reductions = {},
+    SubstitutionMode mode = SubstitutionMode::top_down
 );
 
 //--------------------------------------------------------------------------------------------------
 inline TermId reduce_normal_order(
     TermArena& arena,
     TermId root_id,
-    std::optional<uint32_t> max_reductions = {}
+    std::optional<uint32_t> max_reductions = {},
+    SubstitutionMode mode = SubstitutionMode::top_down
 ) {
     uint32_t n_reductions;
-    return reduce_normal_order(arena, root_id, n_reductions, max_reductions);
+    return reduce_normal_order(arena, root_id, n_reductions, max_reductions, mode);
 }
 
 }
@@ -1,77 +1,382 @@
 #include "term_serialization.h"
+#include <algorithm>
 #include <array>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <variant>
+#include <vector>
 
 namespace lambda {
 
-//..................................................................................................
-void serialize_term(TermArena const& arena, TermId root, std::ostream& stream) {
-    struct StackEntry {
-        StackEntry(TermId term): children{term, TermId{}}, size{1}, idx{0} {}
-        StackEntry(TermId left, TermId right): children{left, right}, size{2}, idx{0} {}
+namespace {
+
+//--------------------------------------------------------------------------------------------------
+constexpr uint32_t none = 0xFFFFFFFF;
+constexpr std::string_view ellipsis = "…";
+
+//--------------------------------------------------------------------------------------------------
+// The children that are printed. A substitution is printed as its body followed by its variable
+// and argument, so the rest of its binding isn't printed.
+std::array<TermId, 2> printed_children(TermArena const& arena, TermId term_id) {
+    if (arena.is_substitution(term_id)) {
+        return {arena.children(term_id)[0], arena.binding(term_id)[1]};
+    }
+    return arena.children(term_id);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Finds the subterms of a term that are reached along more than one path, names them, and decides
+// where their bindings go.
+// A binding has to be inside every abstraction whose variable the subterm uses. These abstractions
+// all enclose every occurrence of the subterm, so they're nested in one another, and the binding
+// goes at the start of the body of the innermost one. To find it, each term gets the list of
+// abstractions whose variables occur free in it, innermost first. The lists are immutable and share
+// their tails, so an abstraction's list is just the tail of its body's.
+class Sharing {
+public:
+    Sharing(TermArena const& arena, TermId root);
+
+    // Returns nothing if the term isn't shared.
+    std::optional<std::string_view> name(TermId term_id) const {
+        auto const itr = indices_.find(term_id);
+        if (itr == indices_.end() || nodes_[itr->second].name == none) {
+            return std::nullopt;
+        }
+        return names_[nodes_[itr->second].name];
+    }
+
+    // The shared terms to bind at the start of the body of the abstraction, in order.
+    std::span<TermId const> bindings(TermId abstraction_id) const {
+        auto const itr = indices_.find(abstraction_id);
+        if (itr == indices_.end()) {
+            return {};
+        }
+        Node const& node = nodes_[itr->second];
+        return std::span<TermId const>(bindings_).subspan(node.bindings_begin, node.n_bindings);
+    }
+
+    // The shared terms that don't use any variables bound in the term, in order.
+    std::span<TermId const> top_level_bindings() const {
+        return std::span<TermId const>(bindings_).subspan(top_level_begin_);
+    }
+
+private:
+    enum class State : uint8_t {
+        pending,
+        entered,
+        finished
+    };
+
+    struct Node {
+        TermId term;
+        State state;
+        // The number of edges into this term, within the printed term.
+        uint32_t n_uses;
+        // The first cell of the list of abstractions whose variables are free in this term.
+        uint32_t binders;
+        // While an abstraction is on the path being traversed, its depth along it (from one).
+        uint32_t depth;
+        // Only shared terms have names.
+        uint32_t name;
+        uint32_t bindings_begin;
+        uint32_t n_bindings;
+    };
 
-        std::array<TermId, 2> children;
-        uint32_t size;
-        uint32_t idx;
+    struct Cell {
+        // The node of the abstraction.
+        uint32_t binder;
+        uint32_t next;
     };
 
+    // Returns the index of the node for term_id, and whether it's new.
+    std::pair<uint32_t, bool> add_use(TermId term_id) {
+        auto const [itr, is_new] = indices_.try_emplace(term_id, nodes_.size());
+        if (is_new) {
+            nodes_.push_back(Node{term_id, State::pending, 0, none, 0, none, 0, 0});
+        }
+        ++nodes_[itr->second].n_uses;
+        return {itr->second, is_new};
+    }
+
+    uint32_t make_cell(uint32_t binder, uint32_t next) {
+        cells_.push_back(Cell{binder, next});
+        return static_cast<uint32_t>(cells_.size() - 1);
+    }
+
+    // Merges two lists of binders. Everything in them is on the current path, so the innermost one
+    // is the deepest.
+    uint32_t merge(uint32_t list_0, uint32_t list_1);
+
+    std::unordered_map<TermId, uint32_t> indices_;
+    std::vector<Node> nodes_;
+    std::vector<Cell> cells_;
+    std::vector<uint32_t> merged_;
+    std::vector<std::string> names_;
+    std::vector<TermId> bindings_;
+    uint32_t top_level_begin_ = 0;
+};
+
+//..................................................................................................
+Sharing::Sharing(TermArena const& arena, TermId root) {
+    // Names that the variables use, so that the bindings can avoid them.
+    std::unordered_set<std::string_view> variable_names;
+    // Shared terms are bound in the order they're finished, so terms come after their subterms.
+    std::vector<uint32_t> finished;
+
+    struct StackEntry {
+        uint32_t node;
+        bool entered;
+    };
     std::vector<StackEntry> stack;
-    stack.emplace_back(root);
-
-    while (true) {
-        TermId term_id = stack.back().children[stack.back().idx];
-        LambdaTerm const& term = arena[term_id];
-
-        // Enter this term, and add its children (if any) to the stack.
-        bool const added_terms_to_stack = term.visit(
-            [&](Variable variable) {
-                stream << variable.name;
-                return false;
-            },
-            [&](Abstraction abstraction) {
-                stream << "(λ" << arena[abstraction.variable].get_name() << '.';
-                stack.emplace_back(abstraction.body);
-                return true;
-            },
-            [&](Application application) {
-                stream << '(';
-                stack.emplace_back(application.left, application.right);
-                return true;
+    stack.push_back({add_use(root).first, false});
+    nodes_[0].n_uses = 0;
+    uint32_t path_depth = 0;
+
+    while (!stack.empty()) {
+        StackEntry& entry = stack.back();
+        uint32_t const node_idx = entry.node;
+        // A term can be pushed again by another parent before it's finished. Whichever copy is on
+        // top goes first.
+        if (!entry.entered && nodes_[node_idx].state != State::pending) {
+            stack.pop_back();
+            continue;
+        }
+        TermId const term_id = nodes_[node_idx].term;
+        auto const [child_0, child_1] = printed_children(arena, term_id);
+
+        // Enter this term, and add its children (other than bound variables) to the stack.
+        if (!entry.entered) {
+            entry.entered = true;
+            nodes_[node_idx].state = State::entered;
+            switch (arena.kind(term_id)) {
+                case TermKind::variable: {
+                    variable_names.insert(arena.name(term_id));
+                    // Variables bound outside of the printed term are printed as if they were free.
+                    std::optional<TermId> const binder = arena.binder(term_id);
+                    auto const itr = binder.has_value() ? indices_.find(*binder) : indices_.end();
+                    if (itr != indices_.end() && nodes_[itr->second].depth != 0) {
+                        nodes_[node_idx].binders = make_cell(itr->second, none);
+                    }
+                    break;
+                }
+                case TermKind::abstraction:
+                    variable_names.insert(arena.name(child_0));
+                    nodes_[node_idx].depth = ++path_depth;
+                    stack.push_back({add_use(child_1).first, false});
+                    break;
+                case TermKind::substitution:
+                    // The variable is printed as if it were free, since its abstraction isn't.
+                    variable_names.insert(arena.name(arena.binding(term_id)[0]));
+                    [[fallthrough]];
+                case TermKind::application:
+                    // Note that entry is invalidated as soon as we push to the stack.
+                    for (TermId child_id : {child_1, child_0}) {
+                        uint32_t const child_idx = add_use(child_id).first;
+                        if (nodes_[child_idx].state != State::finished) {
+                            stack.push_back({child_idx, false});
+                        }
+                    }
+                    break;
+            }
+            if (arena.is_variable(term_id)) {
+                nodes_[node_idx].state = State::finished;
+                stack.pop_back();
             }
-        );
+            continue;
+        }
 
-        // If this term has children, go down one level.
-        if (added_terms_to_stack) {
+        // Leave this term.
+        stack.pop_back();
+        Node& node = nodes_[node_idx];
+        if (arena.is_abstraction(term_id)) {
+            uint32_t const body_binders = nodes_[indices_.at(child_1)].binders;
+            node.binders = (body_binders != none && cells_[body_binders].binder == node_idx)
+                ? cells_[body_binders].next
+                : body_binders;
+            node.depth = 0;
+            --path_depth;
+        } else {
+            node.binders = merge(
+                nodes_[indices_.at(child_0)].binders,
+                nodes_[indices_.at(child_1)].binders
+            );
+        }
+        node.state = State::finished;
+        finished.push_back(node_idx);
+    }
+
+    // Name the shared terms, and group their bindings by the abstraction they go in. Top level
+    // bindings (which have no abstraction) sort last.
+    std::vector<std::pair<uint32_t, uint32_t>> placements;
+    uint32_t n_candidates = 0;
+    for (uint32_t const node_idx : finished) {
+        Node& node = nodes_[node_idx];
+        if (node.n_uses < 2) {
             continue;
         }
+        std::string name;
+        do {
+            name.assign(1, '_');
+            name += std::to_string(n_candidates++);
+        } while (variable_names.contains(name));
+        node.name = static_cast<uint32_t>(names_.size());
+        names_.push_back(std::move(name));
+        uint32_t const block = (node.binders == none) ? none : cells_[node.binders].binder;
+        placements.emplace_back(block, node_idx);
+    }
+    std::stable_sort(
+        placements.begin(),
+        placements.end(),
+        [](auto const& lhs, auto const& rhs) { return lhs.first < rhs.first; }
+    );
+    top_level_begin_ = static_cast<uint32_t>(placements.size());
+    for (auto const& [block, node_idx] : placements) {
+        if (block == none) {
+            top_level_begin_ = std::min(top_level_begin_, static_cast<uint32_t>(bindings_.size()));
+        } else {
+            if (nodes_[block].n_bindings == 0) {
+                nodes_[block].bindings_begin = static_cast<uint32_t>(bindings_.size());
+            }
+            ++nodes_[block].n_bindings;
+        }
+        bindings_.push_back(nodes_[node_idx].term);
+    }
+}
+
+//..................................................................................................
+uint32_t Sharing::merge(uint32_t list_0, uint32_t list_1) {
+    // Lists often share their tails, so the merge stops as soon as they meet.
+    merged_.clear();
+    while (list_0 != list_1 && list_0 != none && list_1 != none) {
+        Cell const cell_0 = cells_[list_0];
+        Cell const cell_1 = cells_[list_1];
+        if (cell_0.binder == cell_1.binder) {
+            merged_.push_back(cell_0.binder);
+            list_0 = cell_0.next;
+            list_1 = cell_1.next;
+        } else if (nodes_[cell_0.binder].depth > nodes_[cell_1.binder].depth) {
+            merged_.push_back(cell_0.binder);
+            list_0 = cell_0.next;
+        } else {
+            merged_.push_back(cell_1.binder);
+            list_1 = cell_1.next;
+        }
+    }
+    uint32_t result = (list_0 == none) ? list_1 : list_0;
+    for (auto itr = merged_.rbegin(); itr != merged_.rend(); ++itr) {
+        result = make_cell(*itr, result);
+    }
+    return result;
+}
+
+}
+
+//..................................................................................................
+void print_term(
+    TermArena const& arena,
+    TermId root,
+    OutputBuffer& output,
+    PrintOptions const& options
+) {
+    std::optional<Sharing> sharing;
+    if (options.shares_subterms) {
+        sharing.emplace(arena, root);
+    }
+
+    // Each task either writes some text, or prints a term. A term that is being defined by a let is
+    // printed in full, even though it's shared.
+    struct Print {
+        TermId term;
+        uint32_t depth;
+        bool is_definition;
+    };
+    using Task = std::variant<std::string_view, Print>;
+    std::vector<Task> tasks;
 
-        // Otherwise we need to backtrack.
-        term.visit(
-            [](Variable) {},
-            [&](auto) { stream << ')'; }
-        );
-        while (true) {
-            // If this term has more siblings, move to the next one.
-            ++stack.back().idx;
-            if (stack.back().idx < stack.back().size) {
-                // This means it was an application.
-                // We want a space between the left and right terms.
-                stream << ' ';
-                break;
+    // Pushes the bindings at the start of a block, which come before its body on the stack.
+    auto const push_bindings = [&](std::span<TermId const> bindings, uint32_t depth) {
+        for (auto itr = bindings.rbegin(); itr != bindings.rend(); ++itr) {
+            tasks.emplace_back(std::string_view(" in "));
+            tasks.emplace_back(Print{*itr, depth, true});
+            tasks.emplace_back(std::string_view(" = "));
+            tasks.emplace_back(*sharing->name(*itr));
+            tasks.emplace_back(std::string_view("let "));
+        }
+    };
+
+    tasks.emplace_back(Print{root, 0, false});
+    if (sharing.has_value()) {
+        push_bindings(sharing->top_level_bindings(), 1);
+    }
+
+    uint64_t n_terms = 0;
+    while (!tasks.empty()) {
+        Task const task = tasks.back();
+        tasks.pop_back();
+        if (std::string_view const* text = std::get_if<std::string_view>(&task)) {
+            output.write(*text);
+            continue;
+        }
+
+        auto const [term_id, depth, is_definition] = std::get<Print>(task);
+        bool const is_truncated = (options.max_depth.has_value() && depth > *options.max_depth) ||
+            (options.max_terms.has_value() && n_terms >= *options.max_terms);
+        if (is_truncated) {
+            output.write(ellipsis);
+            continue;
+        }
+
+        auto const [child_0, child_1] = printed_children(arena, term_id);
+        if (arena.is_variable(term_id)) {
+            output.write(arena.name(term_id));
+            continue;
+        }
+        if (sharing.has_value() && !is_definition) {
+            std::optional<std::string_view> const name = sharing->name(term_id);
+            if (name.has_value()) {
+                output.write(*name);
+                continue;
             }
+        }
 
-            // Otherwise go up a level.
-            stack.pop_back();
-            if (stack.size() > 0) {
-                term_id = stack.back().children[stack.back().idx];
-                arena[term_id].visit(
-                    [](Variable) {},
-                    [&](auto) { stream << ')'; }
-                );
-            } else {
-                return;
+        ++n_terms;
+        if (arena.is_abstraction(term_id)) {
+            output.write("(λ");
+            output.write(arena.name(child_0));
+            output.put('.');
+            tasks.emplace_back(std::string_view(")"));
+            tasks.emplace_back(Print{child_1, depth + 1, false});
+            if (sharing.has_value()) {
+                push_bindings(sharing->bindings(term_id), depth + 1);
             }
+        } else if (arena.is_substitution(term_id)) {
+            output.put('(');
+            tasks.emplace_back(std::string_view("])"));
+            tasks.emplace_back(Print{child_1, depth + 1, false});
+            tasks.emplace_back(std::string_view(" := "));
+            tasks.emplace_back(arena.name(arena.binding(term_id)[0]));
+            tasks.emplace_back(std::string_view(" ["));
+            tasks.emplace_back(Print{child_0, depth + 1, false});
+        } else {
+            output.put('(');
+            tasks.emplace_back(std::string_view(")"));
+            tasks.emplace_back(Print{child_1, depth + 1, false});
+            tasks.emplace_back(std::string_view(" "));
+            tasks.emplace_back(Print{child_0, depth + 1, false});
         }
     }
 }
 
+//..................................................................................................
+void serialize_term(TermArena const& arena, TermId root, std::ostream& stream) {
+    OutputBuffer output(stream);
+    print_term(arena, root, output, PrintOptions{false, std::nullopt, std::nullopt});
+    output.flush();
+}
+
 }
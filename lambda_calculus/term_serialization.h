@@ -2,12 +2,41 @@
 #define LAMBDA_TERM_SERIALIZATION_H
 
 #include "term_arena.h"
+#include "utils/output_buffer.h"
+#include <optional>
 #include <ostream>
 
 namespace lambda {
 
 //--------------------------------------------------------------------------------------------------
-// Assumes the stream expects UTF-8 text.
+struct PrintOptions {
+    // Subterms that are reached along more than one path are printed once, as let bindings, and
+    // referred to by name everywhere they occur. Each binding is placed as deep as it can go: at
+    // the start of the body of the innermost abstraction whose variable it uses, or at the very
+    // start if it doesn't use any. The names are _0, _1, and so on (skipping any that are used by
+    // variables), and parse_term reads the result back with the same sharing. Otherwise the term
+    // is printed as a tree, and shared subterms are repeated.
+    bool shares_subterms = true;
+    // Once this many abstractions, applications, and substitutions have been printed, the rest are
+    // printed as …
+    std::optional<uint64_t> max_terms;
+    // Terms nested more deeply than this (counting abstractions, applications, substitutions, and
+    // bindings) are printed as …
+    std::optional<uint32_t> max_depth;
+};
+
+//--------------------------------------------------------------------------------------------------
+// Writes UTF-8 text. Abstractions and applications are always parenthesized. Explicit
+// substitutions are printed as (M [x := N]), which parse_term doesn't read.
+void print_term(
+    TermArena const& arena,
+    TermId root,
+    OutputBuffer& output,
+    PrintOptions const& options = {}
+);
+
+//--------------------------------------------------------------------------------------------------
+// Prints the whole tree, without sharing. Assumes the stream expects UTF-8 text.
 void serialize_term(TermArena const& arena, TermId root, std::ostream& stream);
 
 //--------------------------------------------------------------------------------------------------
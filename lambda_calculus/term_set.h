@@ -0,0 +1,87 @@
+#ifndef LAMBDA_TERM_SET_H
+#define LAMBDA_TERM_SET_H
+
+#include <algorithm>
+#include <vector>
+#include "term_id.h"
+#include "utils/stdint.h"
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// A set of terms, stored as one stamp per term id. A term is in the set if its stamp matches the
+// current epoch, so clearing the set is constant time. The stamps grow as needed to cover new ids.
+class TermSet {
+public:
+    void clear() {
+        ++epoch_;
+        // If the epoch wraps around, old stamps could look current again.
+        if (epoch_ == 0) {
+            std::fill(stamps_.begin(), stamps_.end(), 0);
+            epoch_ = 1;
+        }
+    }
+
+    bool contains(TermId term_id) const {
+        return term_id.value() < stamps_.size() && stamps_[term_id.value()] == epoch_;
+    }
+
+    // Returns true if the term wasn't already in the set.
+    bool insert(TermId term_id) {
+        reserve_id(term_id);
+        uint32_t& stamp = stamps_[term_id.value()];
+        if (stamp == epoch_) {
+            return false;
+        }
+        stamp = epoch_;
+        return true;
+    }
+
+    void erase(TermId term_id) {
+        if (term_id.value() < stamps_.size()) {
+            stamps_[term_id.value()] = 0;
+        }
+    }
+
+private:
+    void reserve_id(TermId term_id) {
+        if (term_id.value() >= stamps_.size()) {
+            stamps_.resize(std::max<std::size_t>(term_id.value() + 1, 2 * stamps_.size()), 0);
+        }
+    }
+
+    // Zero is never a valid epoch.
+    std::vector<uint32_t> stamps_;
+    uint32_t epoch_ = 1;
+};
+
+//--------------------------------------------------------------------------------------------------
+// Maps terms to terms. This is a TermSet with a dense array of values alongside the stamps, so it
+// is also cleared in constant time.
+class TermMap {
+public:
+    void clear() { keys_.clear(); }
+    bool contains(TermId term_id) const { return keys_.contains(term_id); }
+    void erase(TermId term_id) { keys_.erase(term_id); }
+
+    // Returns nullptr if term_id isn't in the map.
+    TermId const* find(TermId term_id) const {
+        return contains(term_id) ? &values_[term_id.value()] : nullptr;
+    }
+
+    void insert_or_assign(TermId term_id, TermId value) {
+        keys_.insert(term_id);
+        if (term_id.value() >= values_.size()) {
+            values_.resize(std::max<std::size_t>(term_id.value() + 1, 2 * values_.size()));
+        }
+        values_[term_id.value()] = value;
+    }
+
+private:
+    TermSet keys_;
+    std::vector<TermId> values_;
+};
+
+}
+
+#endif
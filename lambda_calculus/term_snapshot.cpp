@@ -0,0 +1,276 @@
+#include "term_snapshot.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace lambda {
+
+namespace {
+
+//--------------------------------------------------------------------------------------------------
+constexpr std::string_view magic = "λsnp";
+constexpr uint32_t none = 0xFFFFFFFF;
+
+//--------------------------------------------------------------------------------------------------
+// Collects output in a buffer, and hands it to the stream in large blocks.
+class Writer {
+public:
+    explicit Writer(std::ostream& stream): stream_(stream) { buffer_.reserve(block_size); }
+    ~Writer() { flush(); }
+
+    void put_byte(uint8_t byte) {
+        buffer_.push_back(static_cast<char>(byte));
+        if (buffer_.size() >= block_size) {
+            flush();
+        }
+    }
+
+    void put_varint(uint64_t value) {
+        while (value >= 0x80) {
+            put_byte(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        put_byte(static_cast<uint8_t>(value));
+    }
+
+    void put_bytes(std::string_view bytes) {
+        for (char const c : bytes) {
+            put_byte(static_cast<uint8_t>(c));
+        }
+    }
+
+    void flush() {
+        stream_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+        buffer_.clear();
+    }
+
+private:
+    static constexpr std::size_t block_size = 1 << 16;
+
+    std::ostream& stream_;
+    std::vector<char> buffer_;
+};
+
+//--------------------------------------------------------------------------------------------------
+// Reads straight from the stream buffer, one byte at a time.
+class Reader {
+public:
+    explicit Reader(std::istream& stream): buffer_(*stream.rdbuf()) {}
+
+    uint8_t get_byte() {
+        auto const byte = buffer_.sbumpc();
+        if (byte == std::char_traits<char>::eof()) {
+            throw std::runtime_error("Truncated snapshot");
+        }
+        return static_cast<uint8_t>(byte);
+    }
+
+    uint64_t get_varint() {
+        uint64_t value = 0;
+        for (uint32_t shift = 0; shift < 64; shift += 7) {
+            uint8_t const byte = get_byte();
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        throw std::runtime_error("Corrupt snapshot: varint is too long");
+    }
+
+    // Reads a count, and checks that it fits in a term id.
+    uint32_t get_count() {
+        uint64_t const count = get_varint();
+        if (count >= none) {
+            throw std::runtime_error("Corrupt snapshot: count is too large");
+        }
+        return static_cast<uint32_t>(count);
+    }
+
+    // The bytes are read in blocks, so a corrupt size fails once the stream runs out rather than
+    // by allocating it all up front.
+    void get_bytes(std::size_t size, std::string& bytes) {
+        constexpr std::size_t block_size = 1 << 12;
+        bytes.clear();
+        while (bytes.size() < size) {
+            std::size_t const start = bytes.size();
+            bytes.resize(std::min(size, start + block_size));
+            auto const n_wanted = static_cast<std::streamsize>(bytes.size() - start);
+            if (buffer_.sgetn(bytes.data() + start, n_wanted) != n_wanted) {
+                throw std::runtime_error("Truncated snapshot");
+            }
+        }
+    }
+
+private:
+    std::streambuf& buffer_;
+};
+
+}
+
+//..................................................................................................
+void write_snapshot(TermArena const& arena, std::span<TermId const> roots, std::ostream& stream) {
+    // Number the reachable terms in post order, so children come before their parents.
+    std::vector<uint32_t> indices(arena.size(), none);
+    std::vector<TermId> order;
+    struct StackEntry {
+        TermId term;
+        bool entered;
+    };
+    std::vector<StackEntry> stack;
+    for (TermId root_id : roots) {
+        stack.push_back({root_id, false});
+        while (!stack.empty()) {
+            StackEntry& entry = stack.back();
+            TermId const term_id = entry.term;
+            // Shared terms can be pushed more than once.
+            if (indices[term_id.value()] != none) {
+                stack.pop_back();
+                continue;
+            }
+            if (!entry.entered) {
+                entry.entered = true;
+                if (!arena.is_variable(term_id)) {
+                    // Note that entry is invalidated as soon as we push to the stack.
+                    for (TermId child_id : arena.children(term_id)) {
+                        if (indices[child_id.value()] == none) {
+                            stack.push_back({child_id, false});
+                        }
+                    }
+                }
+                continue;
+            }
+            stack.pop_back();
+            indices[term_id.value()] = static_cast<uint32_t>(order.size());
+            order.push_back(term_id);
+        }
+    }
+
+    // Number the names in the order they're first used.
+    std::vector<uint32_t> symbol_indices(arena.symbols().size(), none);
+    std::vector<Symbol> symbols;
+    for (TermId term_id : order) {
+        if (arena.is_variable(term_id)) {
+            uint32_t& symbol_index = symbol_indices[arena.symbol(term_id).value()];
+            if (symbol_index == none) {
+                symbol_index = static_cast<uint32_t>(symbols.size());
+                symbols.push_back(arena.symbol(term_id));
+            }
+        }
+    }
+
+    Writer writer(stream);
+    writer.put_bytes(magic);
+    writer.put_varint(snapshot_version);
+
+    writer.put_varint(symbols.size());
+    for (Symbol symbol : symbols) {
+        std::string_view const name = arena.symbols().name(symbol);
+        writer.put_varint(name.size());
+        writer.put_bytes(name);
+    }
+
+    writer.put_varint(order.size());
+    for (uint32_t idx = 0; idx < order.size(); ++idx) {
+        TermId const term_id = order[idx];
+        TermKind const kind = arena.kind(term_id);
+        if (kind == TermKind::variable) {
+            uint64_t const symbol_index = symbol_indices[arena.symbol(term_id).value()];
+            writer.put_varint(symbol_index << 2);
+        } else {
+            auto const [child_0, child_1] = arena.children(term_id);
+            uint64_t const distance_0 = idx - indices[child_0.value()];
+            uint64_t const distance_1 = idx - indices[child_1.value()];
+            writer.put_varint((distance_0 << 2) | static_cast<uint64_t>(kind));
+            writer.put_varint(distance_1);
+        }
+    }
+
+    writer.put_varint(roots.size());
+    for (TermId root_id : roots) {
+        writer.put_varint(indices[root_id.value()]);
+    }
+}
+
+//..................................................................................................
+std::vector<TermId> read_snapshot(TermArena& arena, std::istream& stream) {
+    Reader reader(stream);
+    for (char const c : magic) {
+        if (reader.get_byte() != static_cast<uint8_t>(c)) {
+            throw std::runtime_error("Not a snapshot");
+        }
+    }
+    if (reader.get_varint() > snapshot_version) {
+        throw std::runtime_error("Unsupported snapshot version");
+    }
+
+    // Counts aren't trusted for reservations, since a corrupt count could be huge.
+    constexpr uint32_t max_reservation = 1 << 20;
+
+    uint32_t const n_symbols = reader.get_count();
+    std::vector<Symbol> symbols;
+    symbols.reserve(std::min(n_symbols, max_reservation));
+    std::string name;
+    for (uint32_t i = 0; i < n_symbols; ++i) {
+        reader.get_bytes(reader.get_count(), name);
+        symbols.push_back(arena.intern(name));
+    }
+
+    uint32_t const n_nodes = reader.get_count();
+    std::vector<TermId> ids;
+    ids.reserve(std::min(n_nodes, max_reservation));
+    auto const get_child = [&](uint64_t distance) {
+        if (distance == 0 || distance > ids.size()) {
+            throw std::runtime_error("Corrupt snapshot: child is out of range");
+        }
+        return ids[ids.size() - distance];
+    };
+    for (uint32_t i = 0; i < n_nodes; ++i) {
+        uint64_t const header = reader.get_varint();
+        uint64_t const payload = header >> 2;
+        switch (header & 3) {
+            case static_cast<uint64_t>(TermKind::variable):
+                if (payload >= symbols.size()) {
+                    throw std::runtime_error("Corrupt snapshot: name is out of range");
+                }
+                ids.push_back(arena.make_variable(symbols[payload]));
+                break;
+            case static_cast<uint64_t>(TermKind::abstraction): {
+                // make_abstraction checks that the variable is a variable, and isn't bound yet.
+                TermId const variable_id = get_child(payload);
+                TermId const body_id = get_child(reader.get_varint());
+                ids.push_back(arena.make_abstraction(variable_id, body_id));
+                break;
+            }
+            case static_cast<uint64_t>(TermKind::application): {
+                TermId const left_id = get_child(payload);
+                TermId const right_id = get_child(reader.get_varint());
+                ids.push_back(arena.make_application(left_id, right_id));
+                break;
+            }
+            case static_cast<uint64_t>(TermKind::substitution): {
+                // make_substitution checks that the binding is a redex.
+                TermId const body_id = get_child(payload);
+                TermId const binding_id = get_child(reader.get_varint());
+                ids.push_back(arena.make_substitution(body_id, binding_id));
+                break;
+            }
+            default:
+                throw std::runtime_error("Corrupt snapshot: unknown term kind");
+        }
+    }
+
+    uint32_t const n_roots = reader.get_count();
+    std::vector<TermId> roots;
+    roots.reserve(std::min(n_roots, max_reservation));
+    for (uint32_t i = 0; i < n_roots; ++i) {
+        uint64_t const idx = reader.get_varint();
+        if (idx >= ids.size()) {
+            throw std::runtime_error("Corrupt snapshot: root is out of range");
+        }
+        roots.push_back(ids[idx]);
+    }
+    return roots;
+}
+
+}
@@ -0,0 +1,39 @@
+#ifndef LAMBDA_TERM_SNAPSHOT_H
+#define LAMBDA_TERM_SNAPSHOT_H
+
+#include "term_arena.h"
+#include <istream>
+#include <ostream>
+#include <span>
+#include <vector>
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// Snapshots are a binary format for a set of roots and every term reachable from them. Shared
+// subterms are written once, so a snapshot is proportional to the size of the graph rather than the
+// unfolded tree. All integers are unsigned LEB128 varints. A snapshot holds:
+//  - The UTF-8 bytes of "λsnp", followed by the format version.
+//  - The symbol section: the number of names, then each name as a length and its UTF-8 bytes. Only
+//    the names of variables in the snapshot are included.
+//  - The node table: the number of nodes, then the nodes, with children always before their
+//    parents. A variable is the index of its name shifted left by two. An abstraction,
+//    application, or substitution is the distance back to its first child shifted left by two
+//    and tagged with its kind (1, 2, or 3), followed by the distance back to its second child.
+//  - The roots: the number of roots, then the index of each root in the node table.
+// A variable whose abstraction isn't reachable from any root is written as a free variable.
+// Version 2 added substitutions.
+constexpr uint32_t snapshot_version = 2;
+
+//--------------------------------------------------------------------------------------------------
+void write_snapshot(TermArena const& arena, std::span<TermId const> roots, std::ostream& stream);
+
+//--------------------------------------------------------------------------------------------------
+// Rebuilds the terms in a snapshot in the arena, and returns the new ids of the roots, in the order
+// they were written. The stream is read from front to back without seeking, and is left just past
+// the end of the snapshot. Throws if the snapshot is malformed or uses a newer version.
+std::vector<TermId> read_snapshot(TermArena& arena, std::istream& stream);
+
+}
+
+#endif
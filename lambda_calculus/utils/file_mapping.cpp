@@ -0,0 +1,97 @@
+#include "file_mapping.h"
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LAMBDA_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define LAMBDA_HAS_MMAP 0
+#endif
+
+namespace lambda {
+
+//..................................................................................................
+FileMapping FileMapping::map(char const* path) {
+    FileMapping mapping;
+#if LAMBDA_HAS_MMAP
+    int const fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Couldn't open ") + path);
+    }
+    struct stat status;
+    if (::fstat(fd, &status) != 0) {
+        ::close(fd);
+        throw std::runtime_error(std::string("Couldn't read ") + path);
+    }
+    auto const size = static_cast<std::size_t>(status.st_size);
+    // Empty files can't be mapped, but there's nothing to map anyway.
+    if (size > 0) {
+        int const protection = PROT_READ | PROT_WRITE;
+        void* const data = ::mmap(nullptr, size, protection, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error(std::string("Couldn't map ") + path);
+        }
+        mapping.data_ = static_cast<std::byte*>(data);
+        mapping.size_ = size;
+    }
+    // The mapping stays valid after the file is closed.
+    ::close(fd);
+#else
+    std::ifstream stream(path, std::ios::binary | std::ios::ate);
+    if (!stream) {
+        throw std::runtime_error(std::string("Couldn't open ") + path);
+    }
+    auto const size = static_cast<std::size_t>(stream.tellg());
+    std::size_t const n_blocks = (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+    mapping.contents_ = std::make_unique<std::max_align_t[]>(n_blocks);
+    mapping.data_ = reinterpret_cast<std::byte*>(mapping.contents_.get());
+    mapping.size_ = size;
+    stream.seekg(0);
+    if (!stream.read(reinterpret_cast<char*>(mapping.data_), static_cast<std::streamsize>(size))) {
+        throw std::runtime_error(std::string("Couldn't read ") + path);
+    }
+#endif
+    return mapping;
+}
+
+//..................................................................................................
+FileMapping::FileMapping(FileMapping&& other) noexcept {
+    *this = std::move(other);
+}
+
+//..................................................................................................
+FileMapping& FileMapping::operator=(FileMapping&& other) noexcept {
+    if (this != &other) {
+        release();
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+        contents_ = std::move(other.contents_);
+    }
+    return *this;
+}
+
+//..................................................................................................
+FileMapping::~FileMapping() {
+    release();
+}
+
+//..................................................................................................
+void FileMapping::release() {
+#if LAMBDA_HAS_MMAP
+    if (data_ != nullptr) {
+        ::munmap(data_, size_);
+    }
+#endif
+    data_ = nullptr;
+    size_ = 0;
+    contents_.reset();
+}
+
+}
@@ -0,0 +1,41 @@
+#ifndef LAMBDA_UTILS_FILE_MAPPING_H
+#define LAMBDA_UTILS_FILE_MAPPING_H
+
+#include <cstddef>
+#include <memory>
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// The contents of a file, mapped into memory. The mapping is private: the memory can be written,
+// but pages are only copied when they are, and the file itself never changes. Where mapping isn't
+// supported, the file is read into memory instead. Either way the contents stay at the same address
+// until the mapping is destroyed, even if it's moved, and are aligned for any fundamental type.
+class FileMapping {
+public:
+    FileMapping() = default;
+
+    // Throws if the file can't be read.
+    static FileMapping map(char const* path);
+
+    FileMapping(FileMapping const&) = delete;
+    FileMapping& operator=(FileMapping const&) = delete;
+    FileMapping(FileMapping&& other) noexcept;
+    FileMapping& operator=(FileMapping&& other) noexcept;
+    ~FileMapping();
+
+    std::byte* data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+private:
+    void release();
+
+    std::byte* data_ = nullptr;
+    std::size_t size_ = 0;
+    // If the file had to be read, this holds it.
+    std::unique_ptr<std::max_align_t[]> contents_;
+};
+
+}
+
+#endif
@@ -0,0 +1,48 @@
+#include "output_buffer.h"
+#include "visit.h"
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LAMBDA_HAS_POSIX 1
+#include <cerrno>
+#include <unistd.h>
+#else
+#define LAMBDA_HAS_POSIX 0
+#endif
+
+namespace lambda {
+
+//..................................................................................................
+void OutputBuffer::write_through(std::string_view text) {
+    lambda::visit(
+        sink_,
+        [text](int fd) {
+#if LAMBDA_HAS_POSIX
+            // Writes to pipes and sockets can be partial, or interrupted by signals.
+            std::string_view remaining = text;
+            while (!remaining.empty()) {
+                ssize_t const n_written = ::write(fd, remaining.data(), remaining.size());
+                if (n_written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error("Couldn't write to file descriptor");
+                }
+                remaining.remove_prefix(static_cast<std::size_t>(n_written));
+            }
+#else
+            static_cast<void>(fd);
+            static_cast<void>(text);
+            throw std::runtime_error("File descriptors aren't supported on this platform");
+#endif
+        },
+        [text](std::string* string) { string->append(text); },
+        [text](std::ostream* stream) {
+            if (!stream->write(text.data(), static_cast<std::streamsize>(text.size()))) {
+                throw std::runtime_error("Couldn't write to stream");
+            }
+        }
+    );
+}
+
+}
@@ -0,0 +1,80 @@
+#ifndef LAMBDA_UTILS_OUTPUT_BUFFER_H
+#define LAMBDA_UTILS_OUTPUT_BUFFER_H
+
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// Collects text in a large buffer, and hands it on in blocks: to a file descriptor, to the end of a
+// string, or to a stream. The buffer is flushed when it fills up and when it's destroyed.
+class OutputBuffer {
+public:
+    static constexpr std::size_t capacity = 1 << 16;
+
+    // Writes to a file descriptor, such as STDOUT_FILENO. Only available where POSIX is.
+    static OutputBuffer to_file_descriptor(int fd) { return OutputBuffer(Sink{fd}); }
+    explicit OutputBuffer(std::string& string): OutputBuffer(Sink{&string}) {}
+    explicit OutputBuffer(std::ostream& stream): OutputBuffer(Sink{&stream}) {}
+
+    OutputBuffer(OutputBuffer const&) = delete;
+    OutputBuffer& operator=(OutputBuffer const&) = delete;
+    // Errors are ignored here, so call flush first to find out about them.
+    ~OutputBuffer() {
+        try {
+            flush();
+        } catch (std::runtime_error const&) {
+        }
+    }
+
+    void write(std::string_view text) {
+        if (text.size() > capacity - size_) {
+            flush();
+            // Text that wouldn't fit even in an empty buffer goes straight through.
+            if (text.size() > capacity) {
+                write_through(text);
+                return;
+            }
+        }
+        std::memcpy(buffer_.get() + size_, text.data(), text.size());
+        size_ += text.size();
+    }
+
+    void put(char c) {
+        if (size_ == capacity) {
+            flush();
+        }
+        buffer_[size_++] = c;
+    }
+
+    // Throws if the text can't be written.
+    void flush() {
+        if (size_ > 0) {
+            std::size_t const size = size_;
+            size_ = 0;
+            write_through(std::string_view(buffer_.get(), size));
+        }
+    }
+
+private:
+    using Sink = std::variant<int, std::string*, std::ostream*>;
+
+    explicit OutputBuffer(Sink sink)
+        : sink_(sink), buffer_(std::make_unique_for_overwrite<char[]>(capacity)) {}
+
+    void write_through(std::string_view text);
+
+    Sink sink_;
+    std::unique_ptr<char[]> buffer_;
+    std::size_t size_ = 0;
+};
+
+}
+
+#endif
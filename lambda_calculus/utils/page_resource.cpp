@@ -0,0 +1,101 @@
+#include "page_resource.h"
+#include <algorithm>
+#include <cstdint>
+#include <new>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LAMBDA_HAS_MMAP 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define LAMBDA_HAS_MMAP 0
+#endif
+
+namespace lambda {
+
+//..................................................................................................
+PageResource::~PageResource() {
+    for (Region const& region : regions_) {
+#if LAMBDA_HAS_MMAP
+        ::munmap(region.data, region.size);
+#else
+        ::operator delete(region.data, std::align_val_t{huge_page_size});
+#endif
+    }
+}
+
+//..................................................................................................
+void* PageResource::do_allocate(std::size_t size, std::size_t alignment) {
+    auto const align = [alignment](std::byte* pointer) {
+        auto const address = reinterpret_cast<std::uintptr_t>(pointer);
+        return pointer + ((alignment - address % alignment) % alignment);
+    };
+    std::byte* start = align(next_);
+    if (next_ == nullptr || size > static_cast<std::size_t>(end_ - start)) {
+        // Regions start on a huge page boundary, which covers any sensible alignment.
+        map_region(size);
+        start = next_;
+    }
+    next_ = start + size;
+    return start;
+}
+
+//..................................................................................................
+void PageResource::map_region(std::size_t min_size) {
+    std::size_t const wanted_size = std::max(options_.region_size, min_size);
+    std::size_t const size = (wanted_size + huge_page_size - 1) / huge_page_size * huge_page_size;
+
+#if LAMBDA_HAS_MMAP
+    // The kernel only aligns mappings to ordinary pages, so we map an extra huge page and trim the
+    // ends, to make sure that the whole region can be backed by huge pages.
+    int const protection = PROT_READ | PROT_WRITE;
+    int const flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    void* const mapping = ::mmap(nullptr, size + huge_page_size, protection, flags, -1, 0);
+    if (mapping == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    auto* const raw = static_cast<std::byte*>(mapping);
+    auto const address = reinterpret_cast<std::uintptr_t>(raw);
+    std::size_t const lead = (huge_page_size - address % huge_page_size) % huge_page_size;
+    std::byte* const data = raw + lead;
+    if (lead > 0) {
+        ::munmap(raw, lead);
+    }
+    ::munmap(data + size, huge_page_size - lead);
+
+#ifdef MADV_HUGEPAGE
+    if (options_.huge_pages) {
+        // This is only advice; without transparent huge pages the region just uses small pages.
+        ::madvise(data, size, MADV_HUGEPAGE);
+    }
+#endif
+
+    if (options_.prefault) {
+        bool is_populated = false;
+#ifdef MADV_POPULATE_WRITE
+        is_populated = ::madvise(data, size, MADV_POPULATE_WRITE) == 0;
+#endif
+        if (!is_populated) {
+            auto const page_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+            for (std::size_t offset = 0; offset < size; offset += page_size) {
+                *static_cast<std::byte volatile*>(data + offset) = std::byte{0};
+            }
+        }
+    }
+#else
+    auto* const data =
+        static_cast<std::byte*>(::operator new(size, std::align_val_t{huge_page_size}));
+    if (options_.prefault) {
+        for (std::size_t offset = 0; offset < size; offset += 4096) {
+            data[offset] = std::byte{0};
+        }
+    }
+#endif
+
+    regions_.push_back(Region{data, size});
+    next_ = data;
+    end_ = data + size;
+    mapped_size_ += size;
+}
+
+}
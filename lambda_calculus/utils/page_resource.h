@@ -0,0 +1,66 @@
+#ifndef LAMBDA_UTILS_PAGE_RESOURCE_H
+#define LAMBDA_UTILS_PAGE_RESOURCE_H
+
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+struct PageOptions {
+    // Memory is mapped in regions of this size (rounded up to a whole number of huge pages).
+    // Allocations that don't fit in one get a region of their own.
+    std::size_t region_size = std::size_t{1} << 30;
+    // Asks the kernel to back each region with transparent huge pages, which cuts the number of TLB
+    // misses for random access over large arenas. This only has an effect if transparent huge pages
+    // are enabled in madvise or always mode.
+    bool huge_pages = true;
+    // Faults in every page of a region as soon as it's mapped, so that nothing stalls on a page
+    // fault later. This costs time and memory up front, for the whole region.
+    bool prefault = false;
+};
+
+//--------------------------------------------------------------------------------------------------
+// A memory resource that carves allocations out of large anonymous mappings. Like
+// std::pmr::monotonic_buffer_resource, deallocation does nothing: the memory is only returned when
+// the resource is destroyed. This suits TermArena, which allocates its columns in large chunks and
+// keeps them until it's destroyed, and reuses parent list storage through a pool of its own. Where
+// mmap isn't available, regions come from operator new instead. Not thread safe.
+class PageResource : public std::pmr::memory_resource {
+public:
+    static constexpr std::size_t huge_page_size = std::size_t{1} << 21;
+
+    explicit PageResource(PageOptions const& options = {}): options_(options) {}
+    PageResource(PageResource const&) = delete;
+    PageResource& operator=(PageResource const&) = delete;
+    ~PageResource() override;
+
+    // The total size of the regions mapped so far.
+    std::size_t mapped_size() const { return mapped_size_; }
+
+private:
+    struct Region {
+        std::byte* data;
+        std::size_t size;
+    };
+
+    void* do_allocate(std::size_t size, std::size_t alignment) override;
+    void do_deallocate(void*, std::size_t, std::size_t) override {}
+    bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override {
+        return this == &other;
+    }
+
+    // Maps a region of at least min_size bytes, and allocates from it from now on.
+    void map_region(std::size_t min_size);
+
+    PageOptions options_;
+    std::vector<Region> regions_;
+    std::byte* next_ = nullptr;
+    std::byte* end_ = nullptr;
+    std::size_t mapped_size_ = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef LAMBDA_UTILS_SOURCE_BUFFER_H
+#define LAMBDA_UTILS_SOURCE_BUFFER_H
+
+#include "file_mapping.h"
+#include <string_view>
+#include <utility>
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// Read-only text, either viewed in place or mapped from a file.
+class SourceBuffer {
+public:
+    // Views text that the caller owns.
+    explicit SourceBuffer(std::string_view text): text_(text) {}
+
+    // Maps the file into memory. Throws if the file can't be read.
+    static SourceBuffer map_file(char const* path) {
+        return SourceBuffer(FileMapping::map(path));
+    }
+
+    std::string_view text() const { return text_; }
+
+private:
+    explicit SourceBuffer(FileMapping mapping)
+        : mapping_(std::move(mapping))
+        , text_(reinterpret_cast<char const*>(mapping_.data()), mapping_.size())
+    {}
+
+    // The mapped contents don't move along with the buffer, so the view stays valid.
+    FileMapping mapping_;
+    std::string_view text_;
+};
+
+}
+
+#endif
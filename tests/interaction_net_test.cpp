@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "interaction_net.h"
+#include "term_arena.h"
+#include "term_parser.h"
+
+using namespace lambda;
+
+namespace {
+
+//--------------------------------------------------------------------------------------------------
+// Writes the term with de Bruijn indices, so terms that only differ in the names of their
+// variables give the same text.
+void write_de_bruijn(
+    TermArena const& arena,
+    TermId term_id,
+    std::vector<TermId>& binders,
+    std::ostream& stream
+) {
+    auto const [child_0, child_1] = arena.children(term_id);
+    switch (arena.kind(term_id)) {
+        case TermKind::variable: {
+            auto const itr = std::find(binders.rbegin(), binders.rend(), term_id);
+            if (itr == binders.rend()) {
+                stream << arena.name(term_id);
+            } else {
+                stream << (itr - binders.rbegin());
+            }
+            break;
+        }
+        case TermKind::abstraction:
+            binders.push_back(child_0);
+            stream << "(λ ";
+            write_de_bruijn(arena, child_1, binders, stream);
+            stream << ')';
+            binders.pop_back();
+            break;
+        case TermKind::application:
+        case TermKind::substitution:
+            stream << '(';
+            write_de_bruijn(arena, child_0, binders, stream);
+            stream << ' ';
+            write_de_bruijn(arena, child_1, binders, stream);
+            stream << ')';
+            break;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+std::string to_de_bruijn(TermArena const& arena, TermId term_id) {
+    std::vector<TermId> binders;
+    std::ostringstream stream;
+    write_de_bruijn(arena, term_id, binders, stream);
+    return stream.str();
+}
+
+//--------------------------------------------------------------------------------------------------
+// The Church numeral for n, written out.
+std::string numeral(uint32_t n) {
+    std::string result = "λf.λx.";
+    for (uint32_t i = 0; i < n; ++i) {
+        result += "f (";
+    }
+    result += 'x';
+    result.append(n, ')');
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Normalizes the source with an interaction net, and compares the result to the expected term.
+bool check(std::string const& source, std::string const& expected, uint32_t n_threads) {
+    TermArena arena;
+    TermId const term_id = parse_term(arena, source);
+    InteractionNet net(arena, term_id);
+    if (!net.reduce(n_threads, 1'000'000)) {
+        std::cerr << source << ": didn't finish\n";
+        return false;
+    }
+    std::string const result = to_de_bruijn(arena, net.read_back(arena));
+    std::string const wanted = to_de_bruijn(arena, parse_term(arena, expected));
+    if (result != wanted) {
+        std::cerr << source << ": got " << result << ", expected " << wanted << '\n';
+        return false;
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Checks that a term the arena shares heavily is translated into a net about as large as the
+// arena's graph of it, rather than the tree it stands for.
+bool check_size(std::string const& source, uint32_t max_nodes) {
+    TermArena arena;
+    InteractionNet const net(arena, parse_term(arena, source));
+    if (net.n_nodes() > max_nodes) {
+        std::cerr << source << ": " << net.n_nodes() << " nodes\n";
+        return false;
+    }
+    return true;
+}
+
+}
+
+//--------------------------------------------------------------------------------------------------
+int main() {
+    // a24 stands for a tree of 2^24 identities.
+    std::string chain = "let a0 = λx.x in ";
+    for (uint32_t i = 1; i <= 24; ++i) {
+        chain += "let a" + std::to_string(i) + " = a" + std::to_string(i - 1) + " a" +
+            std::to_string(i - 1) + " in ";
+    }
+    chain += "a24";
+
+    bool is_ok = check_size(chain, 1'000);
+    for (uint32_t n_threads : {1u, 4u}) {
+        // Numerals built separately, and shared by let. When shared, the copies of two meet each
+        // other's duplicators, which have to commute rather than annihilate.
+        is_ok &= check("(λf.λx.f (f x)) (λf.λx.f (f x))", numeral(4), n_threads);
+        is_ok &= check("let two = λf.λx.f (f x) in two two", numeral(4), n_threads);
+        is_ok &= check(
+            "let two = λf.λx.f (f x) in let four = two two in four two",
+            numeral(16),
+            n_threads
+        );
+        // The numeral is duplicated before it's applied to itself.
+        is_ok &= check("(λx.x x) (λf.λx.f (f x))", numeral(4), n_threads);
+        is_ok &= check("(λx.x x) (λf.λx.f (f (f x)))", numeral(27), n_threads);
+        is_ok &= check(chain, "λx.x", n_threads);
+    }
+    return is_ok ? 0 : 1;
+}
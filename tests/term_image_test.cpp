@@ -0,0 +1,138 @@
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+#include "term_arena.h"
+#include "test_terms.h"
+
+using namespace lambda;
+
+namespace {
+
+//--------------------------------------------------------------------------------------------------
+std::string image_path() {
+    return (std::filesystem::temp_directory_path() / "lambda_term_image_test.img").string();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Saves the arena as an image, maps it back in, and checks that the roots have the same graphs,
+// with the same ids.
+bool check_round_trip(
+    TermArena const& arena,
+    std::vector<TermId> const& roots,
+    std::string const& what
+) {
+    std::string const path = image_path();
+    arena.save_image(path.c_str());
+    TermArena const mapped = TermArena::map_image(path.c_str());
+    std::remove(path.c_str());
+    if (mapped.size() != arena.size()) {
+        std::cerr << what << ": mapped " << mapped.size() << " terms\n";
+        return false;
+    }
+    for (TermId const root : roots) {
+        if (!is_same_graph(arena, root, mapped, root)) {
+            std::cerr << what << ": root " << root.value() << " changed\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+// A substitution made before the image was saved is found again after it's mapped, both before
+// and after the mapped terms are collected.
+bool check_substitution() {
+    std::string const path = image_path();
+    TermId body;
+    TermId binding;
+    TermId substitution;
+    {
+        TermArena arena;
+        TermId const x = arena.make_variable("x");
+        TermId const y = arena.make_variable("y");
+        TermId const abstraction = arena.make_abstraction(x, arena.make_application(x, x));
+        binding = arena.make_application(abstraction, y);
+        body = arena.make_application(x, y);
+        substitution = arena.make_substitution(body, binding);
+        arena.save_image(path.c_str());
+    }
+    TermArena mapped = TermArena::map_image(path.c_str());
+    std::remove(path.c_str());
+    if (mapped.make_substitution(body, binding) != substitution) {
+        std::cerr << "substitution: not reused after mapping\n";
+        return false;
+    }
+
+    // Terms made after mapping go after the image.
+    std::size_t const n_image_terms = mapped.size();
+    TermId const z = mapped.make_variable("z");
+    TermId const extra = mapped.make_application(substitution, z);
+    if (z.value() < n_image_terms || mapped.children(extra)[0] != substitution) {
+        std::cerr << "substitution: new terms are wrong\n";
+        return false;
+    }
+
+    TermId const roots[] = {extra};
+    std::vector<std::optional<TermId>> const ids = mapped.collect(roots);
+    TermId const moved = *ids[substitution.value()];
+    auto const [moved_body, moved_binding] = mapped.children(moved);
+    if (mapped.make_substitution(moved_body, moved_binding) != moved) {
+        std::cerr << "substitution: not reused after collecting\n";
+        return false;
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+// A hash-consing arena keeps sharing terms that came from its image.
+bool check_hash_consing() {
+    std::string const path = image_path();
+    TermId identity;
+    {
+        TermArena arena;
+        arena.enable_hash_consing();
+        TermId const x = arena.make_variable("x");
+        identity = arena.make_abstraction(x, x);
+        arena.save_image(path.c_str());
+    }
+    TermArena mapped = TermArena::map_image(path.c_str());
+    std::remove(path.c_str());
+    TermId const y = mapped.make_variable("y");
+    if (!mapped.is_hash_consing() || mapped.make_abstraction(y, y) != identity) {
+        std::cerr << "hash-consing: mapped terms aren't shared\n";
+        return false;
+    }
+    return true;
+}
+
+}
+
+//--------------------------------------------------------------------------------------------------
+int main() {
+    bool is_ok = true;
+
+    for (uint32_t seed = 0; seed < 50; ++seed) {
+        TermArena arena;
+        RandomTermMaker maker(arena, seed);
+        std::vector<TermId> roots;
+        for (uint32_t i = 0; i < 3; ++i) {
+            roots.push_back(maker.make(12));
+        }
+        std::string what = "seed ";
+        what += std::to_string(seed);
+        is_ok &= check_round_trip(arena, roots, what);
+    }
+
+    {
+        TermArena arena;
+        std::vector<TermId> const roots = {make_deep_term(arena, 200'000)};
+        is_ok &= check_round_trip(arena, roots, "deep term");
+    }
+
+    is_ok &= check_substitution();
+    is_ok &= check_hash_consing();
+    return is_ok ? 0 : 1;
+}
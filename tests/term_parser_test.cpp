@@ -0,0 +1,104 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "term_arena.h"
+#include "term_parser.h"
+#include "term_serialization.h"
+#include "test_terms.h"
+
+using namespace lambda;
+
+namespace {
+
+//--------------------------------------------------------------------------------------------------
+std::string print_shared(TermArena const& arena, TermId root) {
+    std::string result;
+    OutputBuffer output(result);
+    print_term(arena, root, output);
+    output.flush();
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+std::string serialize(TermArena const& arena, TermId root) {
+    std::ostringstream stream;
+    serialize_term(arena, root, stream);
+    return stream.str();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Printed with let bindings, the term reads back with the same sharing. Printed as a tree, it reads
+// back as the same tree, so printing it again gives the same text.
+bool check_round_trip(TermArena const& arena, TermId root, std::string const& what) {
+    TermArena copy;
+    std::string const shared_text = print_shared(arena, root);
+    if (!is_same_graph(arena, root, copy, parse_term(copy, shared_text))) {
+        std::cerr << what << ": " << shared_text << " doesn't read back the same\n";
+        return false;
+    }
+    std::string const text = serialize(arena, root);
+    if (serialize(copy, parse_term(copy, text)) != text) {
+        std::cerr << what << ": " << text << " doesn't read back the same\n";
+        return false;
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+// The conveniences of the syntax read as the terms they stand for.
+bool check_same(std::string const& source, std::string const& expected) {
+    TermArena arena;
+    std::string const result = serialize(arena, parse_term(arena, source));
+    std::string const wanted = serialize(arena, parse_term(arena, expected));
+    if (result != wanted) {
+        std::cerr << source << ": got " << result << ", expected " << wanted << '\n';
+        return false;
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+bool check_error(std::string const& source, uint32_t line, uint32_t column) {
+    TermArena arena;
+    try {
+        parse_term(arena, source);
+    } catch (ParseError const& error) {
+        if (error.line() != line || error.column() != column) {
+            std::cerr << source << ": " << error.what() << '\n';
+            return false;
+        }
+        return true;
+    }
+    std::cerr << source << ": parsed\n";
+    return false;
+}
+
+}
+
+//--------------------------------------------------------------------------------------------------
+int main() {
+    bool is_ok = true;
+
+    for (uint32_t seed = 0; seed < 200; ++seed) {
+        TermArena arena;
+        RandomTermMaker maker(arena, seed);
+        std::string what = "seed ";
+        what += std::to_string(seed);
+        is_ok &= check_round_trip(arena, maker.make(12), what);
+    }
+
+    {
+        TermArena arena;
+        is_ok &= check_round_trip(arena, make_deep_term(arena, 200'000), "deep term");
+    }
+
+    is_ok &= check_same("λx y.x", "λx.λy.x");
+    is_ok &= check_same("\\x.x", "λx.x");
+    is_ok &= check_same("f x y", "((f x) y)");
+    is_ok &= check_same("λx.f x # comment\n y", "λx.((f x) y)");
+    is_ok &= check_same("let i = λx.x in i i", "(λx.x) (λx.x)");
+    is_ok &= check_error("λx.", 1, 4);
+    is_ok &= check_error("f\n  (x y", 2, 3);
+    is_ok &= check_error("let in = x in in", 1, 5);
+    return is_ok ? 0 : 1;
+}
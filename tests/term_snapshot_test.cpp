@@ -0,0 +1,97 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "term_arena.h"
+#include "term_snapshot.h"
+#include "test_terms.h"
+
+using namespace lambda;
+
+namespace {
+
+//--------------------------------------------------------------------------------------------------
+// Writes the roots to a snapshot, reads it into a new arena, and compares the results.
+bool check_round_trip(
+    TermArena const& arena,
+    std::vector<TermId> const& roots,
+    std::string const& what
+) {
+    std::stringstream stream;
+    write_snapshot(arena, roots, stream);
+    std::string const snapshot = stream.str();
+    stream << "trailing";
+
+    TermArena copy;
+    std::vector<TermId> const copy_roots = read_snapshot(copy, stream);
+    if (copy_roots.size() != roots.size()) {
+        std::cerr << what << ": read " << copy_roots.size() << " roots\n";
+        return false;
+    }
+    for (std::size_t i = 0; i < roots.size(); ++i) {
+        if (!is_same_graph(arena, roots[i], copy, copy_roots[i])) {
+            std::cerr << what << ": root " << i << " changed\n";
+            return false;
+        }
+    }
+    std::string rest;
+    stream >> rest;
+    if (rest != "trailing") {
+        std::cerr << what << ": read past the end of the snapshot\n";
+        return false;
+    }
+
+    // A snapshot of the copy is the same bytes, since the graph is the same.
+    std::ostringstream again;
+    write_snapshot(copy, copy_roots, again);
+    if (again.str() != snapshot) {
+        std::cerr << what << ": snapshot of the copy differs\n";
+        return false;
+    }
+    return true;
+}
+
+}
+
+//--------------------------------------------------------------------------------------------------
+int main() {
+    bool is_ok = true;
+
+    // Several roots that share subterms with each other.
+    for (uint32_t seed = 0; seed < 200; ++seed) {
+        TermArena arena;
+        RandomTermMaker maker(arena, seed);
+        std::vector<TermId> roots;
+        for (uint32_t i = 0; i < 3; ++i) {
+            roots.push_back(maker.make(12));
+        }
+        roots.push_back(roots.front());
+        std::string what = "seed ";
+        what += std::to_string(seed);
+        is_ok &= check_round_trip(arena, roots, what);
+    }
+
+    {
+        TermArena arena;
+        std::vector<TermId> const roots = {make_deep_term(arena, 200'000)};
+        is_ok &= check_round_trip(arena, roots, "deep term");
+    }
+
+    {
+        // (x y) [x := (λz.z z) w], as lazy reduction would make it.
+        TermArena arena;
+        TermId const x = arena.make_variable("x");
+        TermId const y = arena.make_variable("y");
+        TermId const z = arena.make_variable("z");
+        TermId const w = arena.make_variable("w");
+        TermId const redex = arena.make_application(
+            arena.make_abstraction(z, arena.make_application(z, z)),
+            w
+        );
+        TermId const body = arena.make_application(x, y);
+        std::vector<TermId> const roots = {arena.make_substitution(body, redex)};
+        is_ok &= check_round_trip(arena, roots, "substitution");
+    }
+
+    return is_ok ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+#ifndef LAMBDA_TESTS_TEST_TERMS_H
+#define LAMBDA_TESTS_TEST_TERMS_H
+
+#include "term_arena.h"
+#include <cstdint>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace lambda {
+
+//--------------------------------------------------------------------------------------------------
+// Makes random terms that share subterms. Each term made while n binders are in scope is kept in
+// a pool for that many binders, and can be used again anywhere those binders are still in scope.
+class RandomTermMaker {
+public:
+    RandomTermMaker(TermArena& arena, uint32_t seed): arena_(arena), random_(seed) {
+        for (uint32_t i = 0; i < 3; ++i) {
+            std::string name = "f";
+            name += std::to_string(i);
+            free_variables_.push_back(arena_.make_variable(name));
+        }
+        pools_.emplace_back();
+    }
+
+    TermId make(uint32_t max_depth) {
+        uint32_t const choice = random_() % 100;
+        TermId result;
+        if (max_depth == 0 || choice < 20) {
+            uint32_t const n_choices = static_cast<uint32_t>(binders_.size() + 3);
+            uint32_t const index = random_() % n_choices;
+            return (index < binders_.size())
+                ? binders_[index]
+                : free_variables_[index - binders_.size()];
+        } else if (choice < 40) {
+            uint32_t const n_binders = random_() % static_cast<uint32_t>(pools_.size());
+            std::vector<TermId> const& pool = pools_[n_binders];
+            if (!pool.empty()) {
+                return pool[random_() % pool.size()];
+            }
+            result = arena_.make_application(make(max_depth - 1), make(max_depth - 1));
+        } else if (choice < 70) {
+            std::string name = "x";
+            name += std::to_string(n_variables_++);
+            TermId const variable = arena_.make_variable(name);
+            binders_.push_back(variable);
+            pools_.emplace_back();
+            TermId const body = make(max_depth - 1);
+            pools_.pop_back();
+            binders_.pop_back();
+            result = arena_.make_abstraction(variable, body);
+        } else {
+            result = arena_.make_application(make(max_depth - 1), make(max_depth - 1));
+        }
+        pools_.back().push_back(result);
+        return result;
+    }
+
+private:
+    TermArena& arena_;
+    std::mt19937 random_;
+    std::vector<TermId> free_variables_;
+    std::vector<TermId> binders_;
+    std::vector<std::vector<TermId>> pools_;
+    uint32_t n_variables_ = 0;
+};
+
+//--------------------------------------------------------------------------------------------------
+// λx.f (f (… (f x))), with depth applications.
+inline TermId make_deep_term(TermArena& arena, uint32_t depth) {
+    TermId const f = arena.make_variable("f");
+    TermId const x = arena.make_variable("x");
+    TermId body = x;
+    for (uint32_t i = 0; i < depth; ++i) {
+        body = arena.make_application(f, body);
+    }
+    return arena.make_abstraction(x, body);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Checks that two terms have the same graph: not just the same tree, but the same sharing, with
+// each variable bound by the matching abstraction, and with the same names.
+inline bool is_same_graph(
+    TermArena const& arena_a,
+    TermId root_a,
+    TermArena const& arena_b,
+    TermId root_b
+) {
+    std::unordered_map<uint32_t, uint32_t> a_to_b;
+    std::unordered_map<uint32_t, uint32_t> b_to_a;
+    std::vector<std::pair<TermId, TermId>> stack = {{root_a, root_b}};
+    while (!stack.empty()) {
+        auto const [term_a, term_b] = stack.back();
+        stack.pop_back();
+        auto const [itr_a, is_new_a] = a_to_b.try_emplace(term_a.value(), term_b.value());
+        auto const [itr_b, is_new_b] = b_to_a.try_emplace(term_b.value(), term_a.value());
+        if (itr_a->second != term_b.value() || itr_b->second != term_a.value()) {
+            return false;
+        }
+        if (!is_new_a) {
+            continue;
+        }
+        if (arena_a.kind(term_a) != arena_b.kind(term_b)) {
+            return false;
+        }
+        if (arena_a.is_variable(term_a)) {
+            if (arena_a.name(term_a) != arena_b.name(term_b)) {
+                return false;
+            }
+            continue;
+        }
+        auto const [child_0_a, child_1_a] = arena_a.children(term_a);
+        auto const [child_0_b, child_1_b] = arena_b.children(term_b);
+        stack.emplace_back(child_0_a, child_0_b);
+        stack.emplace_back(child_1_a, child_1_b);
+    }
+    return true;
+}
+
+}
+
+#endif